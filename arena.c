@@ -0,0 +1,69 @@
+// This file implements arena allocators.
+//
+// Objects that are allocated in large numbers, such as tokens and AST
+// nodes, are carved out of large zero-filled blocks by bumping a
+// pointer instead of being calloc'ed one by one. That is faster, has
+// no per-object overhead, and places objects allocated one after
+// another, like the tokens of a list, next to each other in memory.
+//
+// Objects in an arena cannot be freed individually. Instead, all
+// objects of an arena are released at once by arena_free(). Each
+// subsystem has its own arena so that their lifetimes are independent.
+
+#include "widcc.h"
+
+#define BLOCK_SIZE (1024 * 1024)
+#define ALIGN 16
+
+// Each block starts with a header that links it to the next block.
+// The header is padded to keep objects aligned.
+struct ArenaBlock {
+  ArenaBlock *next;
+  char pad[ALIGN - sizeof(ArenaBlock *)];
+};
+
+Arena token_arena;
+Arena ast_arena;
+
+static char *new_block(Arena *arena, size_t size) {
+  ArenaBlock *blk = calloc(1, sizeof(ArenaBlock) + size);
+  if (!blk)
+    error("out of memory");
+  blk->next = arena->blocks;
+  arena->blocks = blk;
+  arena->reserved += sizeof(ArenaBlock) + size;
+  return (char *)(blk + 1);
+}
+
+// Returns `size` bytes of zero-filled memory.
+void *arena_calloc(Arena *arena, size_t size) {
+  size = (size + ALIGN - 1) / ALIGN * ALIGN;
+
+  if (size <= arena->end - arena->ptr) {
+    void *p = arena->ptr;
+    arena->ptr += size;
+    return p;
+  }
+
+  // A large object gets its own block, so that the rest of the
+  // current block is not wasted.
+  if (size > BLOCK_SIZE / 4)
+    return new_block(arena, size);
+
+  arena->ptr = new_block(arena, BLOCK_SIZE);
+  arena->end = arena->ptr + BLOCK_SIZE;
+
+  void *p = arena->ptr;
+  arena->ptr += size;
+  return p;
+}
+
+// Frees all objects allocated in a given arena.
+void arena_free(Arena *arena) {
+  for (ArenaBlock *blk = arena->blocks; blk;) {
+    ArenaBlock *next = blk->next;
+    free(blk);
+    blk = next;
+  }
+  *arena = (Arena){0};
+}
@@ -0,0 +1,188 @@
+// This file implements a compilation cache enabled by -fcache-dir.
+//
+// The key of a cache entry is the preprocessed token stream combined
+// with the options that affect code generation and the identity of
+// the compiler binary. If we have compiled the same key before, the
+// output is copied from the cache, skipping the parser, the code
+// generator and the assembler.
+//
+// Each entry is a file in the cache directory whose name is a hash of
+// the key. Since a hash can collide, an entry contains the full key
+// as well as the output, and the key is compared on lookup.
+
+#include "widcc.h"
+
+#define CACHE_MAGIC "widcc cache 1\n"
+
+static char *key;
+static size_t keylen;
+static char *entry_path;
+
+static uint64_t hash_key(char *s, size_t len) {
+  uint64_t hash = 0xcbf29ce484222325;
+  for (size_t i = 0; i < len; i++) {
+    hash *= 0x100000001b3;
+    hash ^= (unsigned char)s[i];
+  }
+  return hash;
+}
+
+static void write_int(FILE *out, int64_t val) {
+  fwrite(&val, sizeof(val), 1, out);
+}
+
+static void write_str(FILE *out, char *s, int len) {
+  write_int(out, len);
+  fwrite(s, 1, len, out);
+}
+
+void write_compiler_id(FILE *out) {
+  struct stat st;
+  if (stat("/proc/self/exe", &st))
+    memset(&st, 0, sizeof(st));
+  write_int(out, st.st_dev);
+  write_int(out, st.st_ino);
+  write_int(out, st.st_size);
+  write_int(out, st.st_mtim.tv_sec);
+  write_int(out, st.st_mtim.tv_nsec);
+}
+
+static void write_options(FILE *out, bool is_obj) {
+  write_int(out, is_obj);
+  write_int(out, opt_fpic);
+  write_int(out, opt_fcommon);
+  write_int(out, opt_func_sections);
+  write_int(out, opt_data_sections);
+  write_int(out, opt_g);
+  write_int(out, opt_std);
+  write_int(out, dont_reuse_stack);
+  write_int(out, ty_pchar->is_unsigned);
+
+  // Debug info refers to source files by name.
+  if (opt_g) {
+    File **files = get_input_files();
+    for (int i = 0; files[i]; i++) {
+      write_int(out, files[i]->file_no);
+      write_str(out, files[i]->name, strlen(files[i]->name));
+    }
+    write_int(out, -1);
+  }
+}
+
+static void write_tokens(FILE *out, Token *tok) {
+  for (; tok->kind != TK_EOF; tok = tok->next) {
+    write_int(out, tok->kind);
+    write_str(out, tok->loc, tok->len);
+
+    // Adjacent string literals have been joined, so the contents
+    // of a string literal can't be derived from its text.
+    if (tok->kind == TK_STR) {
+      write_int(out, tok->extra->ty->base->size);
+      write_str(out, tok->extra->str, tok->extra->ty->size);
+    }
+
+    int nattrs = 0;
+    if (tok->extra)
+      for (Token *t = tok->extra->attr_next; t; t = t->extra->attr_next)
+        nattrs++;
+    write_int(out, nattrs);
+
+    if (opt_g) {
+      write_int(out, tok->display_file_no);
+      write_int(out, tok->display_line_no);
+    }
+  }
+}
+
+static char *read_entry(char *path, size_t *len) {
+  FILE *fp = fopen(path, "r");
+  if (!fp)
+    return NULL;
+
+  char *buf;
+  FILE *out = open_memstream(&buf, len);
+  char buf2[4096];
+  for (;;) {
+    int n = fread(buf2, 1, sizeof(buf2), fp);
+    if (n == 0)
+      break;
+    fwrite(buf2, 1, n, out);
+  }
+  bool err = ferror(fp);
+  fclose(fp);
+  fclose(out);
+
+  if (err) {
+    free(buf);
+    return NULL;
+  }
+  return buf;
+}
+
+// Look up the cache for the output of a given token stream. If found,
+// write it to `output` and return true.
+bool cache_lookup(char *dir, Token *tok, bool is_obj, char *output) {
+  FILE *out = open_memstream(&key, &keylen);
+  fputs(CACHE_MAGIC, out);
+  write_compiler_id(out);
+  write_options(out, is_obj);
+  write_tokens(out, tok);
+  fclose(out);
+
+  entry_path = format("%s/%016llx", dir, (unsigned long long)hash_key(key, keylen));
+
+  size_t len;
+  char *buf = read_entry(entry_path, &len);
+  if (!buf)
+    return false;
+
+  if (len < sizeof(uint64_t) + keylen ||
+      *(uint64_t *)buf != keylen ||
+      memcmp(buf + sizeof(uint64_t), key, keylen)) {
+    free(buf);
+    return false;
+  }
+
+  FILE *fp = (strcmp(output, "-") == 0) ? stdout : fopen(output, "w");
+  if (!fp)
+    error("cannot open output file: %s: %s", output, strerror(errno));
+
+  char *p = buf + sizeof(uint64_t) + keylen;
+  fwrite(p, 1, buf + len - p, fp);
+  if (fp != stdout)
+    fclose(fp);
+  free(buf);
+  return true;
+}
+
+// Add the output of the last cache_lookup() miss to the cache. Errors
+// are ignored because the cache is only an optimization.
+void cache_store(char *dir, char *output) {
+  if (!entry_path || !strcmp(output, "-"))
+    return;
+
+  size_t len;
+  char *buf = read_entry(output, &len);
+  if (!buf)
+    return;
+
+  mkdir(dir, 0777);
+
+  // Write to a temporary file first so that concurrent compilations
+  // never see a partially written entry.
+  char *tmp = format("%s.%d.tmp", entry_path, (int)getpid());
+  FILE *fp = fopen(tmp, "w");
+  if (!fp) {
+    free(buf);
+    return;
+  }
+
+  uint64_t n = keylen;
+  fwrite(&n, sizeof(n), 1, fp);
+  fwrite(key, 1, keylen, fp);
+  fwrite(buf, 1, len, fp);
+  free(buf);
+
+  if (fclose(fp) || rename(tmp, entry_path))
+    unlink(tmp);
+}
@@ -4,6 +4,7 @@
 #define FP_MAX 8
 
 static FILE *output_file;
+static bool is_seekable;
 static char *argreg8[] = {"%dil", "%sil", "%dl", "%cl", "%r8b", "%r9b"};
 static char *argreg16[] = {"%di", "%si", "%dx", "%cx", "%r8w", "%r9w"};
 static char *argreg32[] = {"%edi", "%esi", "%edx", "%ecx", "%r8d", "%r9d"};
@@ -32,14 +33,17 @@ FMTCHK(1,2)
 static void println(char *fmt, ...) {
   va_list ap;
   va_start(ap, fmt);
-  vfprintf(output_file, fmt, ap);
+  stats.asm_bytes += vfprintf(output_file, fmt, ap);
   va_end(ap);
   fprintf(output_file, "\n");
+  stats.asm_bytes++;
 }
 
+static int label_cnt = 1;
+static int loc_file_no, loc_line_no;
+
 static int count(void) {
-  static int i = 1;
-  return i++;
+  return label_cnt++;
 }
 
 static int push_tmpstack(int sz) {
@@ -760,15 +764,13 @@ static void dealloc_vla(Node *node) {
 }
 
 static void print_loc(Token *tok) {
-  static int file_no, line_no;
-
-  if (file_no == tok->display_file_no && line_no == tok->display_line_no)
+  if (loc_file_no == tok->display_file_no && loc_line_no == tok->display_line_no)
     return;
 
   println("  .loc %d %d", tok->display_file_no, tok->display_line_no);
 
-  file_no = tok->display_file_no;
-  line_no = tok->display_line_no;
+  loc_file_no = tok->display_file_no;
+  loc_line_no = tok->display_line_no;
 }
 
 // Generate code for a given node.
@@ -1578,8 +1580,20 @@ static void emit_text(Obj *prog) {
     println("  push %%rbp");
     println("  mov %%rsp, %%rbp");
 
-    long stack_alloc_loc = ftell(output_file);
-    println("                             ");
+    // The stack size isn't known until the body has been generated.
+    // Leave room for the instruction and patch it in later, or if the
+    // output can't be rewound (e.g. -pipe), buffer the body instead.
+    FILE *out = output_file;
+    long stack_alloc_loc = 0;
+    char *body;
+    size_t bodylen;
+
+    if (is_seekable) {
+      stack_alloc_loc = ftell(output_file);
+      println("                             ");
+    } else {
+      output_file = open_memstream(&body, &bodylen);
+    }
 
     lvar_stk_sz = 0;
 
@@ -1665,10 +1679,18 @@ static void emit_text(Obj *prog) {
     gen_stmt(fn->body);
     assert(tmp_stk.depth == 0);
 
-    long cur_loc = ftell(output_file);
-    fseek(output_file, stack_alloc_loc, SEEK_SET);
-    println("  sub $%d, %%rsp", align_to(peak_stk_usage, 16));
-    fseek(output_file, cur_loc, SEEK_SET);
+    if (is_seekable) {
+      long cur_loc = ftell(output_file);
+      fseek(output_file, stack_alloc_loc, SEEK_SET);
+      println("  sub $%d, %%rsp", align_to(peak_stk_usage, 16));
+      fseek(output_file, cur_loc, SEEK_SET);
+    } else {
+      fclose(output_file);
+      output_file = out;
+      println("  sub $%d, %%rsp", align_to(peak_stk_usage, 16));
+      fwrite(body, bodylen, 1, output_file);
+      free(body);
+    }
 
     // [https://www.sigbus.info/n1570#5.1.2.2.3p1] The C spec defines
     // a special rule for the main function. Reaching the end of the
@@ -1685,8 +1707,15 @@ static void emit_text(Obj *prog) {
   }
 }
 
+// Reset the code generator for the next translation unit.
+void reset_codegen(void) {
+  label_cnt = 1;
+  loc_file_no = loc_line_no = 0;
+}
+
 void codegen(Obj *prog, FILE *out) {
   output_file = out;
+  is_seekable = (fseek(out, 0, SEEK_CUR) == 0);
 
   if (opt_g) {
     File **files = get_input_files();
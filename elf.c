@@ -0,0 +1,2266 @@
+// This file implements a small assembler that turns the AT&T-syntax
+// text produced by codegen.c into an x86-64 ELF relocatable object,
+// so that `-c` doesn't have to pay for running the system assembler
+// over everything we just printed.
+//
+// Only the instructions and directives the code generator emits are
+// supported, plus a few close relatives. If the input contains
+// anything else, such as inline assembly we don't understand or
+// debug line info, emit_elf_object() returns false without writing
+// anything and the caller falls back to `as`.
+//
+// Like GNU as, jumps to local labels start out in the 2-byte form and
+// are relaxed to the 5/6-byte form only if the target is out of range.
+
+#include "widcc.h"
+#include <elf.h>
+#include <setjmp.h>
+
+typedef struct Section Section;
+typedef struct Frag Frag;
+typedef struct Fixup Fixup;
+typedef struct Symbol Symbol;
+
+struct Symbol {
+  char *name;
+  Section *sec;  // Defining section, NULL if undefined
+  Frag *frag;    // Defining fragment
+  int ofs;       // Offset within the fragment
+  bool is_defined;
+  bool is_global;
+  bool is_local;
+  bool is_tls;
+  bool is_common;
+  bool is_used;
+  bool in_symtab;
+  int type;
+  long size;
+  int common_align;
+  long lcomm_size;
+  int idx;
+};
+
+// A relocation request within a fragment's fixed part.
+struct Fixup {
+  Fixup *next;
+  int ofs;
+  int type;
+  Symbol *sym;
+  long addend;
+};
+
+typedef enum {
+  FRAG_FIXED,
+  FRAG_JUMP,
+  FRAG_ALIGN,
+} FragKind;
+
+// A fragment is a run of bytes of known length optionally followed
+// by a variable-sized part (a relaxable jump or alignment padding).
+struct Frag {
+  Frag *next;
+  char *buf;
+  int len;
+  int cap;
+  Fixup *fixups;
+
+  FragKind kind;
+  int cc;         // Condition code of a jump; -1 for jmp
+  Symbol *target;
+  bool is_long;
+  int align;
+  long addr;
+};
+
+typedef struct {
+  long ofs;
+  int type;
+  Symbol *sym;
+  long addend;
+  bool is_section_rel; // Relative to the section symbol of `sym`
+} Rela;
+
+struct Section {
+  Section *next;
+  char *name;
+  int type;
+  long flags;
+  int align;
+  Frag *frags;
+  Frag *last;
+  long size;
+  int idx;
+  int sym_idx;
+
+  char *data;
+  Rela *relas;
+  int nrelas;
+  int rela_cap;
+  int rela_idx;
+};
+
+typedef enum {
+  OP_REG,
+  OP_IMM,
+  OP_MEM,
+  OP_EXPR,
+} OpKind;
+
+typedef enum {
+  RC_GP,
+  RC_XMM,
+  RC_ST,
+} RegClass;
+
+typedef enum {
+  MOD_NONE,
+  MOD_PLT,
+  MOD_GOTPCREL,
+  MOD_TLSGD,
+  MOD_TPOFF,
+} Modifier;
+
+typedef struct {
+  OpKind kind;
+  bool indirect;
+
+  // Register
+  RegClass cls;
+  int reg;
+  int size;
+  bool is_high8;
+  bool need_rex;
+
+  // Immediate or displacement
+  long val;
+  Symbol *sym;
+  Modifier mod;
+
+  // Memory
+  int base;
+  int index;
+  int scale;
+  bool rip;
+  int seg;
+} Operand;
+
+static jmp_buf bailout;
+static Section *sections;
+static Section *cur_sec;
+static HashMap symbols;
+static StringArray lcomms;
+static int local_label_cnt[10];
+
+static void unsupported(void) NORETURN;
+
+static void unsupported(void) {
+  longjmp(bailout, 1);
+}
+
+//
+// Sections, fragments and symbols
+//
+
+static Frag *new_frag(Section *sec) {
+  Frag *f = calloc(1, sizeof(Frag));
+  if (sec->last)
+    sec->last = sec->last->next = f;
+  else
+    sec->frags = sec->last = f;
+  return f;
+}
+
+static Section *get_section(char *name, int type, long flags) {
+  for (Section *sec = sections; sec; sec = sec->next)
+    if (!strcmp(sec->name, name))
+      return sec;
+
+  Section *sec = calloc(1, sizeof(Section));
+  sec->name = name;
+  sec->type = type;
+  sec->flags = flags;
+  sec->align = 1;
+  new_frag(sec);
+
+  Section **p = &sections;
+  while (*p)
+    p = &(*p)->next;
+  *p = sec;
+  return sec;
+}
+
+static Symbol *get_symbol(char *name) {
+  Symbol *sym = hashmap_get(&symbols, name);
+  if (sym)
+    return sym;
+  sym = calloc(1, sizeof(Symbol));
+  sym->name = name;
+  sym->lcomm_size = -1;
+  hashmap_put(&symbols, name, sym);
+  return sym;
+}
+
+static bool is_temp_symbol(Symbol *sym) {
+  return !strncmp(sym->name, ".L", 2);
+}
+
+static void define_symbol(Symbol *sym) {
+  if (sym->is_defined || sym->is_common)
+    unsupported();
+  sym->is_defined = true;
+  sym->sec = cur_sec;
+  sym->frag = cur_sec->last;
+  sym->ofs = cur_sec->last->len;
+  if (cur_sec->flags & SHF_TLS)
+    sym->is_tls = true;
+}
+
+static void emit8(int c) {
+  Frag *f = cur_sec->last;
+  if (f->len == f->cap) {
+    f->cap = f->cap ? f->cap * 2 : 64;
+    f->buf = realloc(f->buf, f->cap);
+  }
+  f->buf[f->len++] = c;
+}
+
+static void emit16(int v) {
+  emit8(v);
+  emit8(v >> 8);
+}
+
+static void emit32(int v) {
+  emit16(v);
+  emit16(v >> 16);
+}
+
+static void emit64(long v) {
+  emit32(v);
+  emit32(v >> 32);
+}
+
+static void add_fixup(int type, Symbol *sym, long addend) {
+  Frag *f = cur_sec->last;
+  Fixup *fx = calloc(1, sizeof(Fixup));
+  fx->ofs = f->len;
+  fx->type = type;
+  fx->sym = sym;
+  fx->addend = addend;
+  fx->next = f->fixups;
+  f->fixups = fx;
+  sym->is_used = true;
+}
+
+static void emit_jump(int cc, Symbol *target) {
+  Frag *f = cur_sec->last;
+  f->kind = FRAG_JUMP;
+  f->cc = cc;
+  f->target = target;
+  target->is_used = true;
+  new_frag(cur_sec);
+}
+
+static void emit_align(int align) {
+  if (align <= 0 || (align & (align - 1)))
+    unsupported();
+  Frag *f = cur_sec->last;
+  f->kind = FRAG_ALIGN;
+  f->align = align;
+  cur_sec->align = MAX(cur_sec->align, align);
+  new_frag(cur_sec);
+}
+
+//
+// Operand parsing
+//
+
+static char *skip_space(char *p) {
+  while (*p == ' ' || *p == '\t')
+    p++;
+  return p;
+}
+
+static bool is_sym_char(char c) {
+  return isalnum(c) || c == '_' || c == '.' || c == '$';
+}
+
+static char *read_symbol_name(char **rest, char *p) {
+  if (*p == '"') {
+    char *q = strchr(p + 1, '"');
+    if (!q)
+      unsupported();
+    *rest = q + 1;
+    return strndup(p + 1, q - p - 1);
+  }
+
+  char *q = p;
+  while (is_sym_char(*q))
+    q++;
+  if (q == p)
+    unsupported();
+  *rest = q;
+  return strndup(p, q - p);
+}
+
+// Numeric local labels such as `1:` may be defined any number of
+// times. `1b` refers to the last definition and `1f` to the next one.
+static Symbol *local_label(int n, bool fwd) {
+  return get_symbol(format(".L%d\002%d", n, local_label_cnt[n] + fwd));
+}
+
+static bool read_number(char **rest, char *p, long *val) {
+  char *q = p;
+  if (*q == '-' || *q == '+')
+    q++;
+  if (!isdigit(*q))
+    return false;
+
+  errno = 0;
+  unsigned long v = strtoul(q, &q, 0);
+  if (errno || is_sym_char(*q))
+    return false;
+  *val = (*p == '-') ? -v : v;
+  *rest = q;
+  return true;
+}
+
+static Modifier read_modifier(char **rest, char *p) {
+  static struct { char *name; Modifier mod; } mods[] = {
+    {"@PLT", MOD_PLT}, {"@GOTPCREL", MOD_GOTPCREL},
+    {"@tlsgd", MOD_TLSGD}, {"@tpoff", MOD_TPOFF},
+  };
+
+  for (int i = 0; i < sizeof(mods) / sizeof(*mods); i++) {
+    int len = strlen(mods[i].name);
+    if (!strncmp(p, mods[i].name, len) && !is_sym_char(p[len])) {
+      *rest = p + len;
+      return mods[i].mod;
+    }
+  }
+  if (*p == '@')
+    unsupported();
+  *rest = p;
+  return MOD_NONE;
+}
+
+// expr = number | symbol ("@" modifier)? (("+" | "-") number)?
+static void read_expr(char **rest, char *p, Operand *op) {
+  p = skip_space(p);
+
+  if (read_number(rest, p, &op->val))
+    return;
+
+  if (isdigit(p[0]) && (p[1] == 'f' || p[1] == 'b') && !is_sym_char(p[2])) {
+    op->sym = local_label(p[0] - '0', p[1] == 'f');
+    *rest = p + 2;
+    return;
+  }
+
+  op->sym = get_symbol(read_symbol_name(&p, p));
+  op->mod = read_modifier(&p, p);
+  p = skip_space(p);
+
+  if (*p == '+' || *p == '-') {
+    bool neg = (*p == '-');
+    if (!read_number(&p, skip_space(p + 1), &op->val))
+      unsupported();
+    if (neg)
+      op->val = -op->val;
+  }
+  *rest = p;
+}
+
+typedef struct {
+  char *name;
+  RegClass cls;
+  int reg;
+  int size;
+} RegName;
+
+static RegName gp_regs[] = {
+  {"rax", RC_GP, 0, 8}, {"rcx", RC_GP, 1, 8}, {"rdx", RC_GP, 2, 8}, {"rbx", RC_GP, 3, 8},
+  {"rsp", RC_GP, 4, 8}, {"rbp", RC_GP, 5, 8}, {"rsi", RC_GP, 6, 8}, {"rdi", RC_GP, 7, 8},
+  {"eax", RC_GP, 0, 4}, {"ecx", RC_GP, 1, 4}, {"edx", RC_GP, 2, 4}, {"ebx", RC_GP, 3, 4},
+  {"esp", RC_GP, 4, 4}, {"ebp", RC_GP, 5, 4}, {"esi", RC_GP, 6, 4}, {"edi", RC_GP, 7, 4},
+  {"ax", RC_GP, 0, 2}, {"cx", RC_GP, 1, 2}, {"dx", RC_GP, 2, 2}, {"bx", RC_GP, 3, 2},
+  {"sp", RC_GP, 4, 2}, {"bp", RC_GP, 5, 2}, {"si", RC_GP, 6, 2}, {"di", RC_GP, 7, 2},
+  {"al", RC_GP, 0, 1}, {"cl", RC_GP, 1, 1}, {"dl", RC_GP, 2, 1}, {"bl", RC_GP, 3, 1},
+  {"spl", RC_GP, 4, 1}, {"bpl", RC_GP, 5, 1}, {"sil", RC_GP, 6, 1}, {"dil", RC_GP, 7, 1},
+};
+
+static bool read_register(char **rest, char *p, Operand *op) {
+  // p points past '%'
+  char *q = p;
+  while (isalnum(*q))
+    q++;
+  int len = q - p;
+  char *name = strndup(p, len);
+
+  op->kind = OP_REG;
+  op->cls = RC_GP;
+
+  for (int i = 0; i < sizeof(gp_regs) / sizeof(*gp_regs); i++) {
+    if (!strcmp(name, gp_regs[i].name)) {
+      op->reg = gp_regs[i].reg;
+      op->size = gp_regs[i].size;
+      op->need_rex = (op->size == 1 && op->reg >= 4);
+      *rest = q;
+      return true;
+    }
+  }
+
+  if (len == 2 && strchr("acdb", name[0]) && name[1] == 'h') {
+    op->reg = 4 + (strchr("acdb", name[0]) - "acdb");
+    op->size = 1;
+    op->is_high8 = true;
+    *rest = q;
+    return true;
+  }
+
+  // r8-r15 with optional d/w/b suffix
+  if (name[0] == 'r' && isdigit(name[1])) {
+    char *end;
+    int n = strtol(name + 1, &end, 10);
+    if (8 <= n && n <= 15) {
+      op->reg = n;
+      if (!*end)
+        op->size = 8;
+      else if (!strcmp(end, "d"))
+        op->size = 4;
+      else if (!strcmp(end, "w"))
+        op->size = 2;
+      else if (!strcmp(end, "b"))
+        op->size = 1;
+      else
+        return false;
+      *rest = q;
+      return true;
+    }
+  }
+
+  if (!strncmp(name, "xmm", 3) && isdigit(name[3])) {
+    int n = atoi(name + 3);
+    if (n > 15)
+      return false;
+    op->cls = RC_XMM;
+    op->reg = n;
+    op->size = 16;
+    *rest = q;
+    return true;
+  }
+
+  if (!strcmp(name, "st")) {
+    op->cls = RC_ST;
+    op->reg = 0;
+    op->size = 10;
+    if (*q == '(') {
+      if (!isdigit(q[1]) || q[2] != ')' || q[1] > '7')
+        return false;
+      op->reg = q[1] - '0';
+      q += 3;
+    }
+    *rest = q;
+    return true;
+  }
+  return false;
+}
+
+// Parse `(base, index, scale)` of a memory operand.
+static void read_mem(char **rest, char *p, Operand *op) {
+  op->kind = OP_MEM;
+  op->base = op->index = -1;
+  op->scale = 1;
+
+  p = skip_space(p + 1);
+  if (*p == '%') {
+    if (!strncmp(p, "%rip", 4) && !isalnum(p[4])) {
+      op->rip = true;
+      p += 4;
+    } else {
+      Operand r = {0};
+      if (!read_register(&p, p + 1, &r) || r.cls != RC_GP || r.size != 8)
+        unsupported();
+      op->base = r.reg;
+    }
+  }
+
+  p = skip_space(p);
+  if (*p == ',') {
+    p = skip_space(p + 1);
+    Operand r = {0};
+    if (*p != '%' || !read_register(&p, p + 1, &r) || r.cls != RC_GP ||
+        r.size != 8 || r.reg == 4 || op->rip)
+      unsupported();
+    op->index = r.reg;
+
+    p = skip_space(p);
+    if (*p == ',') {
+      p = skip_space(p + 1);
+      op->scale = strtol(p, &p, 10);
+      if (op->scale != 1 && op->scale != 2 && op->scale != 4 && op->scale != 8)
+        unsupported();
+    }
+  }
+
+  p = skip_space(p);
+  if (*p != ')')
+    unsupported();
+  *rest = p + 1;
+}
+
+static void read_operand(char **rest, char *p, Operand *op) {
+  memset(op, 0, sizeof(*op));
+  op->seg = -1;
+  p = skip_space(p);
+
+  if (*p == '*') {
+    op->indirect = true;
+    p = skip_space(p + 1);
+  }
+
+  if (*p == '$') {
+    op->kind = OP_IMM;
+    read_expr(rest, p + 1, op);
+    return;
+  }
+
+  if (!strncmp(p, "%fs:", 4) || !strncmp(p, "%gs:", 4)) {
+    int seg = (p[1] == 'f') ? 0x64 : 0x65;
+    read_operand(rest, p + 4, op);
+    if (op->kind == OP_EXPR) {
+      op->kind = OP_MEM;
+      op->base = op->index = -1;
+    }
+    if (op->kind != OP_MEM)
+      unsupported();
+    op->seg = seg;
+    return;
+  }
+
+  if (*p == '%') {
+    if (!read_register(rest, p + 1, op))
+      unsupported();
+    return;
+  }
+
+  if (*p != '(') {
+    read_expr(&p, p, op);
+    p = skip_space(p);
+  }
+
+  if (*p == '(') {
+    Modifier mod = op->mod;
+    Symbol *sym = op->sym;
+    long val = op->val;
+    read_mem(rest, p, op);
+    op->mod = mod;
+    op->sym = sym;
+    op->val = val;
+    return;
+  }
+
+  op->kind = OP_EXPR;
+  *rest = p;
+}
+
+//
+// Instruction encoding
+//
+
+static bool is_gp(Operand *op) {
+  return op->kind == OP_REG && op->cls == RC_GP;
+}
+
+static bool is_xmm(Operand *op) {
+  return op->kind == OP_REG && op->cls == RC_XMM;
+}
+
+static bool is_st(Operand *op) {
+  return op->kind == OP_REG && op->cls == RC_ST;
+}
+
+static bool is_rm(Operand *op) {
+  return is_gp(op) || op->kind == OP_MEM;
+}
+
+static bool is_int8(long v) {
+  return v == (int8_t)v;
+}
+
+static bool is_int32(long v) {
+  return v == (int32_t)v;
+}
+
+static int mem_reloc_type(Operand *op, int opcode, bool has_rex) {
+  switch (op->mod) {
+  case MOD_NONE:
+    return op->rip ? R_X86_64_PC32 : R_X86_64_32S;
+  case MOD_GOTPCREL:
+    if (!op->rip)
+      unsupported();
+    if (opcode == 0x8b)
+      return has_rex ? R_X86_64_REX_GOTPCRELX : R_X86_64_GOTPCRELX;
+    return R_X86_64_GOTPCREL;
+  case MOD_TLSGD:
+    if (!op->rip)
+      unsupported();
+    return R_X86_64_TLSGD;
+  default:
+    unsupported();
+  }
+}
+
+// Emit an instruction of the form
+//   [seg] [66] [F2/F3/66] [REX] opcode ModRM [SIB] [disp]
+// `reg` is either a register number or an opcode extension. `trail`
+// is the number of immediate bytes that will follow.
+static void emit_modrm(int pfx, bool o16, bool rexw, int *opcode, int oplen,
+                       int reg, Operand *regop, Operand *rm, int trail) {
+  if (rm->kind != OP_REG && rm->kind != OP_MEM)
+    unsupported();
+
+  if (rm->kind == OP_MEM && rm->seg != -1)
+    emit8(rm->seg);
+  if (o16)
+    emit8(0x66);
+  if (pfx)
+    emit8(pfx);
+
+  int b = (rm->kind == OP_REG) ? rm->reg : (rm->base == -1 ? 0 : rm->base);
+  int x = (rm->kind == OP_MEM && rm->index != -1) ? rm->index : 0;
+
+  int rex = (rexw << 3) | ((reg >> 3) << 2) | ((x >> 3) << 1) | (b >> 3);
+  bool force_rex = (regop && regop->need_rex) || (rm->kind == OP_REG && rm->need_rex);
+  bool high8 = (regop && regop->is_high8) || (rm->kind == OP_REG && rm->is_high8);
+  if (rex || force_rex) {
+    if (high8)
+      unsupported();
+    emit8(0x40 | rex);
+  }
+
+  for (int i = 0; i < oplen; i++)
+    emit8(opcode[i]);
+
+  reg &= 7;
+
+  if (rm->kind == OP_REG) {
+    emit8(0xc0 | (reg << 3) | (rm->reg & 7));
+    return;
+  }
+
+  if (rm->rip) {
+    emit8(0x05 | (reg << 3));
+    if (rm->sym) {
+      add_fixup(mem_reloc_type(rm, opcode[oplen - 1], rex || force_rex),
+                rm->sym, rm->val - 4 - trail);
+      emit32(0);
+    } else {
+      emit32(rm->val);
+    }
+    return;
+  }
+
+  if (rm->mod != MOD_NONE)
+    unsupported();
+
+  int scale = (rm->scale == 8) ? 3 : (rm->scale == 4) ? 2 : (rm->scale == 2) ? 1 : 0;
+
+  // No base register: absolute address
+  if (rm->base == -1) {
+    emit8(0x04 | (reg << 3));
+    if (rm->index == -1)
+      emit8(0x25);
+    else
+      emit8((scale << 6) | ((rm->index & 7) << 3) | 5);
+    if (rm->sym) {
+      add_fixup(R_X86_64_32S, rm->sym, rm->val);
+      emit32(0);
+    } else {
+      if (!is_int32(rm->val))
+        unsupported();
+      emit32(rm->val);
+    }
+    return;
+  }
+
+  int mod;
+  if (rm->sym || !is_int32(rm->val)) {
+    if (!is_int32(rm->val))
+      unsupported();
+    mod = 2;
+  } else if (rm->val == 0 && (rm->base & 7) != 5) {
+    mod = 0;
+  } else if (is_int8(rm->val)) {
+    mod = 1;
+  } else {
+    mod = 2;
+  }
+
+  if (rm->index == -1 && (rm->base & 7) != 4) {
+    emit8((mod << 6) | (reg << 3) | (rm->base & 7));
+  } else {
+    int idx = (rm->index == -1) ? 4 : (rm->index & 7);
+    emit8((mod << 6) | (reg << 3) | 4);
+    emit8((scale << 6) | (idx << 3) | (rm->base & 7));
+  }
+
+  if (mod == 1) {
+    emit8(rm->val);
+  } else if (mod == 2) {
+    if (rm->sym)
+      add_fixup(R_X86_64_32S, rm->sym, rm->val);
+    emit32(rm->sym ? 0 : rm->val);
+  }
+}
+
+static void emit_rm1(int pfx, bool o16, bool rexw, int opcode, int reg,
+                     Operand *regop, Operand *rm, int trail) {
+  emit_modrm(pfx, o16, rexw, (int[]){opcode}, 1, reg, regop, rm, trail);
+}
+
+static void emit_rm2(int pfx, bool o16, bool rexw, int op2, int reg,
+                     Operand *regop, Operand *rm) {
+  emit_modrm(pfx, o16, rexw, (int[]){0x0f, op2}, 2, reg, regop, rm, 0);
+}
+
+static void emit_imm(Operand *op, int size, bool sext) {
+  if (op->sym) {
+    int type;
+    if (op->mod == MOD_TPOFF && size == 4)
+      type = R_X86_64_TPOFF32;
+    else if (op->mod != MOD_NONE)
+      unsupported();
+    else if (size == 8)
+      type = R_X86_64_64;
+    else if (size == 4)
+      type = sext ? R_X86_64_32S : R_X86_64_32;
+    else
+      unsupported();
+    if (op->mod == MOD_TPOFF)
+      op->sym->is_tls = true;
+    add_fixup(type, op->sym, op->val);
+    op->val = 0;
+  }
+
+  switch (size) {
+  case 1: emit8(op->val); return;
+  case 2: emit16(op->val); return;
+  case 4: emit32(op->val); return;
+  case 8: emit64(op->val); return;
+  }
+  unsupported();
+}
+
+// Emit the legacy prefix and REX for an instruction without ModRM
+// whose register operand is encoded in the low 3 bits of the opcode.
+static void emit_opreg(int size, Operand *r, int opcode) {
+  if (size == 2)
+    emit8(0x66);
+  int rex = ((size == 8) << 3) | (r->reg >> 3);
+  if (rex || r->need_rex) {
+    if (r->is_high8)
+      unsupported();
+    emit8(0x40 | rex);
+  }
+  emit8(opcode + (r->reg & 7));
+}
+
+static int suffix_size(char c) {
+  switch (c) {
+  case 'b': return 1;
+  case 'w': return 2;
+  case 'l': return 4;
+  case 'q': return 8;
+  }
+  return 0;
+}
+
+// Determine the operand size from the mnemonic suffix or
+// from the general-purpose register operands.
+static int operand_size(int suffix, Operand *ops, int nops) {
+  int size = suffix;
+  for (int i = 0; i < nops; i++) {
+    if (!is_gp(&ops[i]))
+      continue;
+    if (size && size != ops[i].size)
+      unsupported();
+    size = ops[i].size;
+  }
+  if (!size)
+    unsupported();
+  return size;
+}
+
+static int cond_code(char *s) {
+  static char *cc[] = {
+    "o", "no", "b", "ae", "e", "ne", "be", "a",
+    "s", "ns", "p", "np", "l", "ge", "le", "g",
+  };
+  static struct { char *name; int cc; } alias[] = {
+    {"c", 2}, {"nae", 2}, {"nb", 3}, {"nc", 3}, {"z", 4}, {"nz", 5},
+    {"na", 6}, {"nbe", 7}, {"pe", 10}, {"po", 11}, {"nge", 12},
+    {"nl", 13}, {"ng", 14}, {"nle", 15},
+  };
+
+  for (int i = 0; i < 16; i++)
+    if (!strcmp(s, cc[i]))
+      return i;
+  for (int i = 0; i < sizeof(alias) / sizeof(*alias); i++)
+    if (!strcmp(s, alias[i].name))
+      return alias[i].cc;
+  return -1;
+}
+
+static void check_nops(int nops, int n) {
+  if (nops != n)
+    unsupported();
+}
+
+// add, or, adc, sbb, and, sub, xor, cmp
+static void encode_alu(int grp, int size, Operand *src, Operand *dst) {
+  bool o16 = (size == 2);
+  bool w = (size == 8);
+  int base = grp * 8;
+
+  if (src->kind == OP_IMM) {
+    if (!is_rm(dst))
+      unsupported();
+
+    if (size == 1) {
+      if (is_gp(dst) && dst->reg == 0 && !dst->need_rex) {
+        emit8(base + 4);
+      } else {
+        emit_rm1(0, false, false, 0x80, grp, NULL, dst, 1);
+      }
+      emit_imm(src, 1, true);
+      return;
+    }
+
+    if (!src->sym && is_int8(src->val)) {
+      emit_rm1(0, o16, w, 0x83, grp, NULL, dst, 1);
+      emit_imm(src, 1, true);
+      return;
+    }
+
+    int isz = (size == 2) ? 2 : 4;
+    if (size == 8 && !src->sym && !is_int32(src->val))
+      unsupported();
+
+    if (is_gp(dst) && dst->reg == 0) {
+      if (o16)
+        emit8(0x66);
+      if (w)
+        emit8(0x48);
+      emit8(base + 5);
+    } else {
+      emit_rm1(0, o16, w, 0x81, grp, NULL, dst, isz);
+    }
+    emit_imm(src, isz, true);
+    return;
+  }
+
+  if (is_gp(src) && is_rm(dst)) {
+    emit_rm1(0, o16, w, base + (size == 1 ? 0 : 1), src->reg, src, dst, 0);
+    return;
+  }
+
+  if (src->kind == OP_MEM && is_gp(dst)) {
+    emit_rm1(0, o16, w, base + (size == 1 ? 2 : 3), dst->reg, dst, src, 0);
+    return;
+  }
+  unsupported();
+}
+
+static void encode_mov(int size, Operand *src, Operand *dst) {
+  bool o16 = (size == 2);
+  bool w = (size == 8);
+
+  if (src->kind == OP_IMM) {
+    if (is_gp(dst)) {
+      if (size == 8 && (src->sym || is_int32(src->val))) {
+        emit_rm1(0, false, true, 0xc7, 0, NULL, dst, 4);
+        emit_imm(src, 4, true);
+        return;
+      }
+      emit_opreg(size, dst, size == 1 ? 0xb0 : 0xb8);
+      emit_imm(src, size, false);
+      return;
+    }
+
+    if (dst->kind != OP_MEM)
+      unsupported();
+    if (size == 8 && !src->sym && !is_int32(src->val))
+      unsupported();
+    int isz = MIN(size, 4);
+    emit_rm1(0, o16, w, size == 1 ? 0xc6 : 0xc7, 0, NULL, dst, isz);
+    emit_imm(src, isz, true);
+    return;
+  }
+
+  if (is_gp(src) && is_rm(dst)) {
+    emit_rm1(0, o16, w, size == 1 ? 0x88 : 0x89, src->reg, src, dst, 0);
+    return;
+  }
+
+  if (src->kind == OP_MEM && is_gp(dst)) {
+    emit_rm1(0, o16, w, size == 1 ? 0x8a : 0x8b, dst->reg, dst, src, 0);
+    return;
+  }
+  unsupported();
+}
+
+// Instructions that take no operands
+static bool encode_simple(char *mnem, int nops) {
+  static struct { char *name; int len; unsigned char code[3]; } insns[] = {
+    {"ret", 1, {0xc3}}, {"leave", 1, {0xc9}}, {"nop", 1, {0x90}},
+    {"cqo", 2, {0x48, 0x99}}, {"cqto", 2, {0x48, 0x99}},
+    {"cdq", 1, {0x99}}, {"cltd", 1, {0x99}},
+    {"cltq", 2, {0x48, 0x98}}, {"cdqe", 2, {0x48, 0x98}},
+    {"ud2", 2, {0x0f, 0x0b}}, {"hlt", 1, {0xf4}},
+    {"fninit", 2, {0xdb, 0xe3}}, {"fchs", 2, {0xd9, 0xe0}},
+    {"fabs", 2, {0xd9, 0xe1}}, {"fldz", 2, {0xd9, 0xee}},
+    {"fld1", 2, {0xd9, 0xe8}}, {"fwait", 1, {0x9b}},
+    {"rex64", 1, {0x48}}, {"data16", 1, {0x66}},
+  };
+
+  for (int i = 0; i < sizeof(insns) / sizeof(*insns); i++) {
+    if (!strcmp(mnem, insns[i].name)) {
+      check_nops(nops, 0);
+      for (int j = 0; j < insns[i].len; j++)
+        emit8(insns[i].code[j]);
+      return true;
+    }
+  }
+  return false;
+}
+
+// x87 instructions with a memory operand
+static bool encode_x87_mem(char *mnem, Operand *ops, int nops) {
+  static struct { char *name; int opcode; int ext; } insns[] = {
+    {"flds", 0xd9, 0}, {"fldl", 0xdd, 0}, {"fldt", 0xdb, 5},
+    {"fsts", 0xd9, 2}, {"fstl", 0xdd, 2},
+    {"fstps", 0xd9, 3}, {"fstpl", 0xdd, 3}, {"fstpt", 0xdb, 7},
+    {"filds", 0xdf, 0}, {"fildl", 0xdb, 0}, {"fildll", 0xdf, 5}, {"fildq", 0xdf, 5},
+    {"fists", 0xdf, 2}, {"fistl", 0xdb, 2},
+    {"fistps", 0xdf, 3}, {"fistpl", 0xdb, 3}, {"fistpll", 0xdf, 7}, {"fistpq", 0xdf, 7},
+    {"fisttps", 0xdf, 1}, {"fisttpl", 0xdb, 1}, {"fisttpll", 0xdd, 1}, {"fisttpq", 0xdd, 1},
+    {"fnstcw", 0xd9, 7}, {"fldcw", 0xd9, 5},
+    {"fadds", 0xd8, 0}, {"faddl", 0xdc, 0}, {"fmuls", 0xd8, 1}, {"fmull", 0xdc, 1},
+    {"fsubs", 0xd8, 4}, {"fsubl", 0xdc, 4}, {"fsubrs", 0xd8, 5}, {"fsubrl", 0xdc, 5},
+    {"fdivs", 0xd8, 6}, {"fdivl", 0xdc, 6}, {"fdivrs", 0xd8, 7}, {"fdivrl", 0xdc, 7},
+  };
+
+  for (int i = 0; i < sizeof(insns) / sizeof(*insns); i++) {
+    if (!strcmp(mnem, insns[i].name)) {
+      check_nops(nops, 1);
+      if (ops[0].kind != OP_MEM)
+        unsupported();
+      emit_rm1(0, false, false, insns[i].opcode, insns[i].ext, NULL, &ops[0], 0);
+      return true;
+    }
+  }
+  return false;
+}
+
+// x87 instructions operating on %st(i)
+static bool encode_x87_reg(char *mnem, Operand *ops, int nops) {
+  // `dflt` is the register used when no operand is given.
+  static struct { char *name; int op1; int op2; int dflt; bool to_st; } insns[] = {
+    {"fld", 0xd9, 0xc0, -1, false}, {"fxch", 0xd9, 0xc8, 1, false},
+    {"fst", 0xdd, 0xd0, -1, false}, {"fstp", 0xdd, 0xd8, -1, false},
+    {"ffree", 0xdd, 0xc0, -1, false},
+    {"fucomi", 0xdb, 0xe8, 1, true}, {"fucomip", 0xdf, 0xe8, 1, true},
+    {"fcomi", 0xdb, 0xf0, 1, true}, {"fcomip", 0xdf, 0xf0, 1, true},
+    {"fucom", 0xdd, 0xe0, 1, false}, {"fucomp", 0xdd, 0xe8, 1, false},
+    {"fcmovb", 0xda, 0xc0, -1, true}, {"fcmove", 0xda, 0xc8, -1, true},
+    {"fcmovbe", 0xda, 0xd0, -1, true}, {"fcmovu", 0xda, 0xd8, -1, true},
+    {"fcmovnb", 0xdb, 0xc0, -1, true}, {"fcmovne", 0xdb, 0xc8, -1, true},
+    {"fcmovnbe", 0xdb, 0xd0, -1, true}, {"fcmovnu", 0xdb, 0xd8, -1, true},
+  };
+
+  // Pop forms of arithmetic; the operands are "%st, %st(i)".
+  // Note that AT&T mnemonics have fsub/fsubr and fdiv/fdivr
+  // swapped for these forms.
+  static struct { char *name; int op2; } pops[] = {
+    {"faddp", 0xc0}, {"fmulp", 0xc8}, {"fsubp", 0xe0},
+    {"fsubrp", 0xe8}, {"fdivp", 0xf0}, {"fdivrp", 0xf8},
+  };
+
+  for (int i = 0; i < sizeof(insns) / sizeof(*insns); i++) {
+    if (strcmp(mnem, insns[i].name))
+      continue;
+
+    int r;
+    if (nops == 0) {
+      if (insns[i].dflt == -1)
+        unsupported();
+      r = insns[i].dflt;
+    } else if (nops == 1 && is_st(&ops[0])) {
+      r = ops[0].reg;
+    } else if (nops == 2 && insns[i].to_st && is_st(&ops[0]) &&
+               is_st(&ops[1]) && ops[1].reg == 0) {
+      r = ops[0].reg;
+    } else {
+      return false;
+    }
+    emit8(insns[i].op1);
+    emit8(insns[i].op2 + r);
+    return true;
+  }
+
+  for (int i = 0; i < sizeof(pops) / sizeof(*pops); i++) {
+    if (strcmp(mnem, pops[i].name))
+      continue;
+
+    int r;
+    if (nops == 0)
+      r = 1;
+    else if (nops == 1 && is_st(&ops[0]))
+      r = ops[0].reg;
+    else if (nops == 2 && is_st(&ops[0]) && ops[0].reg == 0 && is_st(&ops[1]))
+      r = ops[1].reg;
+    else
+      unsupported();
+    emit8(0xde);
+    emit8(pops[i].op2 + r);
+    return true;
+  }
+  return false;
+}
+
+// SSE instructions of the form "op xmm/mem, xmm"
+static bool encode_sse(char *mnem, Operand *ops, int nops) {
+  static struct { char *name; int pfx; int opcode; } insns[] = {
+    {"addss", 0xf3, 0x58}, {"addsd", 0xf2, 0x58},
+    {"subss", 0xf3, 0x5c}, {"subsd", 0xf2, 0x5c},
+    {"mulss", 0xf3, 0x59}, {"mulsd", 0xf2, 0x59},
+    {"divss", 0xf3, 0x5e}, {"divsd", 0xf2, 0x5e},
+    {"minss", 0xf3, 0x5d}, {"minsd", 0xf2, 0x5d},
+    {"maxss", 0xf3, 0x5f}, {"maxsd", 0xf2, 0x5f},
+    {"sqrtss", 0xf3, 0x51}, {"sqrtsd", 0xf2, 0x51},
+    {"ucomiss", 0, 0x2e}, {"ucomisd", 0x66, 0x2e},
+    {"comiss", 0, 0x2f}, {"comisd", 0x66, 0x2f},
+    {"andps", 0, 0x54}, {"andpd", 0x66, 0x54},
+    {"orps", 0, 0x56}, {"orpd", 0x66, 0x56},
+    {"xorps", 0, 0x57}, {"xorpd", 0x66, 0x57},
+    {"pxor", 0x66, 0xef},
+    {"cvtss2sd", 0xf3, 0x5a}, {"cvtsd2ss", 0xf2, 0x5a},
+  };
+
+  // Moves have a load and a store form.
+  static struct { char *name; int pfx; int load; int store; } moves[] = {
+    {"movss", 0xf3, 0x10, 0x11}, {"movsd", 0xf2, 0x10, 0x11},
+    {"movaps", 0, 0x28, 0x29}, {"movups", 0, 0x10, 0x11},
+    {"movapd", 0x66, 0x28, 0x29}, {"movupd", 0x66, 0x10, 0x11},
+    {"movdqa", 0x66, 0x6f, 0x7f}, {"movdqu", 0xf3, 0x6f, 0x7f},
+  };
+
+  for (int i = 0; i < sizeof(insns) / sizeof(*insns); i++) {
+    if (!strcmp(mnem, insns[i].name)) {
+      check_nops(nops, 2);
+      if (!is_xmm(&ops[1]) || !(is_xmm(&ops[0]) || ops[0].kind == OP_MEM))
+        unsupported();
+      emit_rm2(insns[i].pfx, false, false, insns[i].opcode, ops[1].reg, NULL, &ops[0]);
+      return true;
+    }
+  }
+
+  for (int i = 0; i < sizeof(moves) / sizeof(*moves); i++) {
+    if (!strcmp(mnem, moves[i].name)) {
+      check_nops(nops, 2);
+      if (is_xmm(&ops[1]) && (is_xmm(&ops[0]) || ops[0].kind == OP_MEM))
+        emit_rm2(moves[i].pfx, false, false, moves[i].load, ops[1].reg, NULL, &ops[0]);
+      else if (is_xmm(&ops[0]) && ops[1].kind == OP_MEM)
+        emit_rm2(moves[i].pfx, false, false, moves[i].store, ops[0].reg, NULL, &ops[1]);
+      else
+        unsupported();
+      return true;
+    }
+  }
+
+  // int <-> float conversions
+  static struct { char *name; int pfx; int opcode; bool to_int; } cvts[] = {
+    {"cvtsi2ss", 0xf3, 0x2a, false}, {"cvtsi2sd", 0xf2, 0x2a, false},
+    {"cvttss2si", 0xf3, 0x2c, true}, {"cvttsd2si", 0xf2, 0x2c, true},
+    {"cvtss2si", 0xf3, 0x2d, true}, {"cvtsd2si", 0xf2, 0x2d, true},
+  };
+
+  for (int i = 0; i < sizeof(cvts) / sizeof(*cvts); i++) {
+    int len = strlen(cvts[i].name);
+    if (strncmp(mnem, cvts[i].name, len))
+      continue;
+    if (mnem[len] && (mnem[len + 1] || !suffix_size(mnem[len])))
+      continue;
+    check_nops(nops, 2);
+
+    int size = suffix_size(mnem[len]);
+    if (cvts[i].to_int) {
+      if (!is_gp(&ops[1]) || !(is_xmm(&ops[0]) || ops[0].kind == OP_MEM))
+        unsupported();
+      size = operand_size(size, &ops[1], 1);
+      if (size != 4 && size != 8)
+        unsupported();
+      emit_rm2(cvts[i].pfx, false, size == 8, cvts[i].opcode, ops[1].reg, NULL, &ops[0]);
+    } else {
+      if (!is_xmm(&ops[1]) || !is_rm(&ops[0]))
+        unsupported();
+      size = operand_size(size, &ops[0], 1);
+      if (size != 4 && size != 8)
+        unsupported();
+      emit_rm2(cvts[i].pfx, false, size == 8, cvts[i].opcode, ops[1].reg, NULL, &ops[0]);
+    }
+    return true;
+  }
+  return false;
+}
+
+// movd/movq between general-purpose and xmm registers
+static bool encode_movd(char *mnem, Operand *ops, int nops) {
+  if (strcmp(mnem, "movd") && strcmp(mnem, "movq"))
+    return false;
+  check_nops(nops, 2);
+
+  bool q = (mnem[3] == 'q');
+  if (is_xmm(&ops[1]) && is_rm(&ops[0])) {
+    if (q && ops[0].kind == OP_MEM) {
+      emit_rm2(0xf3, false, false, 0x7e, ops[1].reg, NULL, &ops[0]);
+      return true;
+    }
+    if (is_gp(&ops[0]) && ops[0].size != (q ? 8 : 4))
+      unsupported();
+    emit_rm2(0x66, false, q, 0x6e, ops[1].reg, NULL, &ops[0]);
+    return true;
+  }
+
+  if (is_xmm(&ops[0]) && is_rm(&ops[1])) {
+    if (q && ops[1].kind == OP_MEM) {
+      emit_rm2(0x66, false, false, 0xd6, ops[0].reg, NULL, &ops[1]);
+      return true;
+    }
+    if (is_gp(&ops[1]) && ops[1].size != (q ? 8 : 4))
+      unsupported();
+    emit_rm2(0x66, false, q, 0x7e, ops[0].reg, NULL, &ops[1]);
+    return true;
+  }
+
+  if (is_xmm(&ops[0]) && is_xmm(&ops[1]) && q) {
+    emit_rm2(0xf3, false, false, 0x7e, ops[1].reg, NULL, &ops[0]);
+    return true;
+  }
+
+  // Otherwise it's an ordinary movq/movd.
+  return false;
+}
+
+// movzbl, movsbq, movslq, ...
+static bool encode_movx(char *mnem, Operand *ops, int nops) {
+  if (strlen(mnem) != 6 || (strncmp(mnem, "movz", 4) && strncmp(mnem, "movs", 4)))
+    return false;
+
+  int from = suffix_size(mnem[4]);
+  int to = suffix_size(mnem[5]);
+  if (!from || !to || from >= to)
+    return false;
+
+  check_nops(nops, 2);
+  bool sign = (mnem[3] == 's');
+  if (!is_gp(&ops[1]) || ops[1].size != to || !is_rm(&ops[0]))
+    unsupported();
+  if (is_gp(&ops[0]) && ops[0].size != from)
+    unsupported();
+
+  if (from == 4) {
+    if (!sign || to != 8)
+      unsupported();
+    emit_rm1(0, false, true, 0x63, ops[1].reg, &ops[1], &ops[0], 0);
+    return true;
+  }
+
+  int opcode = (sign ? 0xbe : 0xb6) + (from == 2);
+  emit_rm2(0, to == 2, to == 8, opcode, ops[1].reg, NULL, &ops[0]);
+  return true;
+}
+
+static bool encode_branch(char *mnem, Operand *ops, int nops) {
+  bool is_call = !strcmp(mnem, "call") || !strcmp(mnem, "callq");
+  bool is_jmp = !strcmp(mnem, "jmp") || !strcmp(mnem, "jmpq");
+  int cc = -1;
+
+  if (!is_call && !is_jmp) {
+    if (mnem[0] != 'j' || (cc = cond_code(mnem + 1)) == -1)
+      return false;
+  }
+
+  check_nops(nops, 1);
+  Operand *op = &ops[0];
+
+  if (op->indirect) {
+    if (cc != -1 || !is_rm(op) || (is_gp(op) && op->size != 8))
+      unsupported();
+    emit_rm1(0, false, false, 0xff, is_call ? 2 : 4, NULL, op, 0);
+    return true;
+  }
+
+  if (op->kind != OP_EXPR || !op->sym || (op->mod != MOD_NONE && op->mod != MOD_PLT))
+    unsupported();
+
+  if (is_call) {
+    emit8(0xe8);
+    add_fixup(R_X86_64_PLT32, op->sym, op->val - 4);
+    emit32(0);
+    return true;
+  }
+
+  if (op->val || op->mod != MOD_NONE)
+    unsupported();
+  emit_jump(cc, op->sym);
+  return true;
+}
+
+static void encode_shift(int ext, int size, Operand *ops, int nops) {
+  bool o16 = (size == 2);
+  bool w = (size == 8);
+  int op8 = (size == 1) ? 0 : 1;
+
+  if (nops == 1) {
+    emit_rm1(0, o16, w, 0xd0 + op8, ext, NULL, &ops[0], 0);
+    return;
+  }
+
+  check_nops(nops, 2);
+  if (!is_rm(&ops[1]))
+    unsupported();
+
+  if (is_gp(&ops[0]) && ops[0].reg == 1 && ops[0].size == 1) {
+    emit_rm1(0, o16, w, 0xd2 + op8, ext, NULL, &ops[1], 0);
+    return;
+  }
+
+  if (ops[0].kind != OP_IMM || ops[0].sym)
+    unsupported();
+
+  if (ops[0].val == 1) {
+    emit_rm1(0, o16, w, 0xd0 + op8, ext, NULL, &ops[1], 0);
+    return;
+  }
+  emit_rm1(0, o16, w, 0xc0 + op8, ext, NULL, &ops[1], 1);
+  emit_imm(&ops[0], 1, false);
+}
+
+static void encode_insn(char *mnem, Operand *ops, int nops) {
+  if (encode_simple(mnem, nops) ||
+      encode_x87_mem(mnem, ops, nops) ||
+      encode_x87_reg(mnem, ops, nops) ||
+      encode_sse(mnem, ops, nops) ||
+      encode_movd(mnem, ops, nops) ||
+      encode_movx(mnem, ops, nops) ||
+      encode_branch(mnem, ops, nops))
+    return;
+
+  if (!strncmp(mnem, "set", 3) && cond_code(mnem + 3) != -1) {
+    check_nops(nops, 1);
+    if (!is_rm(&ops[0]) || (is_gp(&ops[0]) && ops[0].size != 1))
+      unsupported();
+    emit_rm2(0, false, false, 0x90 + cond_code(mnem + 3), 0, NULL, &ops[0]);
+    return;
+  }
+
+  if (!strcmp(mnem, "movabs") || !strcmp(mnem, "movabsq")) {
+    check_nops(nops, 2);
+    if (ops[0].kind != OP_IMM || !is_gp(&ops[1]) || ops[1].size != 8)
+      unsupported();
+    emit_opreg(8, &ops[1], 0xb8);
+    emit_imm(&ops[0], 8, false);
+    return;
+  }
+
+  // Strip the size suffix if there is one.
+  static char *names[] = {
+    "add", "or", "adc", "sbb", "and", "sub", "xor", "cmp",
+    "mov", "lea", "test", "xchg", "push", "pop", "imul", "mul",
+    "div", "idiv", "neg", "not", "inc", "dec",
+    "rol", "ror", "rcl", "rcr", "shl", "shr", "sal", "sar",
+  };
+
+  int suffix = 0;
+  char *name = NULL;
+  int len = strlen(mnem);
+  for (int i = 0; i < sizeof(names) / sizeof(*names); i++) {
+    if (!strcmp(mnem, names[i])) {
+      name = names[i];
+      break;
+    }
+    if (len == strlen(names[i]) + 1 && !strncmp(mnem, names[i], len - 1) &&
+        suffix_size(mnem[len - 1])) {
+      name = names[i];
+      suffix = suffix_size(mnem[len - 1]);
+      break;
+    }
+  }
+  if (!name)
+    unsupported();
+
+  for (int i = 0; i < 8; i++) {
+    if (!strcmp(name, names[i])) {
+      check_nops(nops, 2);
+      encode_alu(i, operand_size(suffix, ops, nops), &ops[0], &ops[1]);
+      return;
+    }
+  }
+
+  for (int i = 22; i < 30; i++) {
+    if (!strcmp(name, names[i])) {
+      if (nops < 1 || nops > 2)
+        unsupported();
+      Operand *dst = &ops[nops - 1];
+      encode_shift(i - 22, operand_size(suffix, dst, 1), ops, nops);
+      return;
+    }
+  }
+
+  if (!strcmp(name, "mov")) {
+    check_nops(nops, 2);
+    encode_mov(operand_size(suffix, ops, nops), &ops[0], &ops[1]);
+    return;
+  }
+
+  if (!strcmp(name, "lea")) {
+    check_nops(nops, 2);
+    if (ops[0].kind != OP_MEM || !is_gp(&ops[1]) || ops[1].size == 1)
+      unsupported();
+    int size = operand_size(suffix, &ops[1], 1);
+    emit_rm1(0, size == 2, size == 8, 0x8d, ops[1].reg, &ops[1], &ops[0], 0);
+    return;
+  }
+
+  if (!strcmp(name, "test")) {
+    check_nops(nops, 2);
+    int size = operand_size(suffix, ops, nops);
+    if (ops[0].kind == OP_IMM) {
+      if (!is_rm(&ops[1]))
+        unsupported();
+      int isz = MIN(size, 4);
+      if (is_gp(&ops[1]) && ops[1].reg == 0) {
+        if (size == 2)
+          emit8(0x66);
+        if (size == 8)
+          emit8(0x48);
+        emit8(size == 1 ? 0xa8 : 0xa9);
+      } else {
+        emit_rm1(0, size == 2, size == 8, size == 1 ? 0xf6 : 0xf7, 0, NULL, &ops[1], isz);
+      }
+      emit_imm(&ops[0], isz, true);
+      return;
+    }
+    if (!is_gp(&ops[0]) || !is_rm(&ops[1]))
+      unsupported();
+    emit_rm1(0, size == 2, size == 8, size == 1 ? 0x84 : 0x85, ops[0].reg, &ops[0], &ops[1], 0);
+    return;
+  }
+
+  if (!strcmp(name, "xchg")) {
+    check_nops(nops, 2);
+    int size = operand_size(suffix, ops, nops);
+    if (size > 1 && is_gp(&ops[0]) && is_gp(&ops[1]) &&
+        (ops[0].reg == 0 || ops[1].reg == 0) && !(ops[0].reg == 0 && ops[1].reg == 0)) {
+      emit_opreg(size, ops[0].reg ? &ops[0] : &ops[1], 0x90);
+      return;
+    }
+    if (!is_gp(&ops[0]) || !is_rm(&ops[1]))
+      unsupported();
+    emit_rm1(0, size == 2, size == 8, size == 1 ? 0x86 : 0x87, ops[0].reg, &ops[0], &ops[1], 0);
+    return;
+  }
+
+  if (!strcmp(name, "push") || !strcmp(name, "pop")) {
+    check_nops(nops, 1);
+    if (!is_gp(&ops[0]) || ops[0].size != 8 || (suffix && suffix != 8))
+      unsupported();
+    emit_opreg(4, &ops[0], name[1] == 'u' ? 0x50 : 0x58);
+    return;
+  }
+
+  if (!strcmp(name, "imul") && nops == 2) {
+    int size = operand_size(suffix, ops, nops);
+    if (!is_gp(&ops[1]) || !is_rm(&ops[0]) || size == 1)
+      unsupported();
+    emit_rm2(0, size == 2, size == 8, 0xaf, ops[1].reg, &ops[1], &ops[0]);
+    return;
+  }
+
+  // Unary group 3 and 4/5 instructions
+  static struct { char *name; int opcode; int ext; } unary[] = {
+    {"not", 0xf6, 2}, {"neg", 0xf6, 3}, {"mul", 0xf6, 4}, {"imul", 0xf6, 5},
+    {"div", 0xf6, 6}, {"idiv", 0xf6, 7}, {"inc", 0xfe, 0}, {"dec", 0xfe, 1},
+  };
+
+  for (int i = 0; i < sizeof(unary) / sizeof(*unary); i++) {
+    if (!strcmp(name, unary[i].name)) {
+      check_nops(nops, 1);
+      if (!is_rm(&ops[0]))
+        unsupported();
+      int size = operand_size(suffix, ops, nops);
+      emit_rm1(0, size == 2, size == 8, unary[i].opcode + (size != 1),
+               unary[i].ext, NULL, &ops[0], 0);
+      return;
+    }
+  }
+  unsupported();
+}
+
+//
+// Directives
+//
+
+static char *read_section_name(char **rest, char *p) {
+  char *buf;
+  size_t buflen;
+  FILE *out = open_memstream(&buf, &buflen);
+
+  p = skip_space(p);
+  while (*p && *p != ',' && *p != ' ' && *p != '\t') {
+    if (*p == '"') {
+      char *q = strchr(p + 1, '"');
+      if (!q)
+        unsupported();
+      fwrite(p + 1, 1, q - p - 1, out);
+      p = q + 1;
+      continue;
+    }
+    fputc(*p++, out);
+  }
+  fclose(out);
+  *rest = p;
+  return buf;
+}
+
+static void section_directive(char *p) {
+  char *name = read_section_name(&p, p);
+  long flags = 0;
+  int type = SHT_PROGBITS;
+
+  p = skip_space(p);
+  if (*p == ',') {
+    p = skip_space(p + 1);
+    if (*p != '"')
+      unsupported();
+    for (p++; *p != '"'; p++) {
+      switch (*p) {
+      case 'a': flags |= SHF_ALLOC; break;
+      case 'w': flags |= SHF_WRITE; break;
+      case 'x': flags |= SHF_EXECINSTR; break;
+      case 'T': flags |= SHF_TLS; break;
+      default: unsupported();
+      }
+    }
+    p = skip_space(p + 1);
+
+    if (*p == ',') {
+      p = skip_space(p + 1);
+      if (!strncmp(p, "@progbits", 9))
+        p += 9;
+      else if (!strncmp(p, "@nobits", 7))
+        type = SHT_NOBITS, p += 7;
+      else
+        unsupported();
+    }
+  } else {
+    // Well-known section names imply their attributes.
+    if (!strncmp(name, ".text", 5))
+      flags = SHF_ALLOC | SHF_EXECINSTR;
+    else if (!strncmp(name, ".data", 5))
+      flags = SHF_ALLOC | SHF_WRITE;
+    else if (!strncmp(name, ".bss", 4))
+      flags = SHF_ALLOC | SHF_WRITE, type = SHT_NOBITS;
+    else if (!strncmp(name, ".rodata", 7))
+      flags = SHF_ALLOC;
+    else
+      unsupported();
+  }
+
+  if (*skip_space(p))
+    unsupported();
+
+  Section *sec = get_section(name, type, flags);
+  if (sec->type != type || sec->flags != flags)
+    unsupported();
+  cur_sec = sec;
+}
+
+static Symbol *read_symbol_operand(char **rest, char *p) {
+  p = skip_space(p);
+  Symbol *sym = get_symbol(read_symbol_name(&p, p));
+  *rest = skip_space(p);
+  return sym;
+}
+
+static long read_int_operand(char **rest, char *p) {
+  long val;
+  if (!read_number(rest, skip_space(p), &val))
+    unsupported();
+  *rest = skip_space(*rest);
+  return val;
+}
+
+static void expect_end(char *p) {
+  if (*skip_space(p))
+    unsupported();
+}
+
+static void expect_comma(char **rest, char *p) {
+  p = skip_space(p);
+  if (*p != ',')
+    unsupported();
+  *rest = p + 1;
+}
+
+static void data_directive(char *p, int size) {
+  for (;;) {
+    Operand op = {0};
+    read_expr(&p, p, &op);
+    if (op.sym && size != 8 && size != 4)
+      unsupported();
+    if (op.mod != MOD_NONE)
+      unsupported();
+
+    if (cur_sec->type == SHT_NOBITS) {
+      if (op.sym || op.val)
+        unsupported();
+      cur_sec->last->len += size;
+    } else if (op.sym) {
+      add_fixup(size == 8 ? R_X86_64_64 : R_X86_64_32, op.sym, op.val);
+      size == 8 ? emit64(0) : emit32(0);
+    } else {
+      switch (size) {
+      case 1: emit8(op.val); break;
+      case 2: emit16(op.val); break;
+      case 4: emit32(op.val); break;
+      case 8: emit64(op.val); break;
+      }
+    }
+
+    p = skip_space(p);
+    if (!*p)
+      return;
+    expect_comma(&p, p);
+  }
+}
+
+static void zero_fill(long n) {
+  if (n < 0)
+    unsupported();
+  if (cur_sec->type == SHT_NOBITS) {
+    if (cur_sec->last->len + n > INT32_MAX)
+      unsupported();
+    cur_sec->last->len += n;
+    return;
+  }
+  for (long i = 0; i < n; i++)
+    emit8(0);
+}
+
+static void allocate_local_commons(void) {
+  if (lcomms.len == 0)
+    return;
+
+  cur_sec = get_section(".bss", SHT_NOBITS, SHF_ALLOC | SHF_WRITE);
+  for (int i = 0; i < lcomms.len; i++) {
+    Symbol *sym = get_symbol(lcomms.data[i]);
+    emit_align(sym->common_align);
+    define_symbol(sym);
+    zero_fill(sym->lcomm_size);
+    if (!sym->type)
+      sym->type = STT_OBJECT;
+    if (!sym->size)
+      sym->size = sym->lcomm_size;
+  }
+}
+
+static void directive(char *name, char *p) {
+  if (!strcmp(name, ".text")) {
+    expect_end(p);
+    cur_sec = get_section(".text", SHT_PROGBITS, SHF_ALLOC | SHF_EXECINSTR);
+    return;
+  }
+
+  if (!strcmp(name, ".data")) {
+    expect_end(p);
+    cur_sec = get_section(".data", SHT_PROGBITS, SHF_ALLOC | SHF_WRITE);
+    return;
+  }
+
+  if (!strcmp(name, ".bss")) {
+    expect_end(p);
+    cur_sec = get_section(".bss", SHT_NOBITS, SHF_ALLOC | SHF_WRITE);
+    return;
+  }
+
+  if (!strcmp(name, ".section")) {
+    section_directive(p);
+    return;
+  }
+
+  if (!strcmp(name, ".globl") || !strcmp(name, ".global")) {
+    Symbol *sym = read_symbol_operand(&p, p);
+    expect_end(p);
+    sym->is_global = true;
+    sym->is_local = false;
+    return;
+  }
+
+  if (!strcmp(name, ".local")) {
+    Symbol *sym = read_symbol_operand(&p, p);
+    expect_end(p);
+    sym->is_local = true;
+    sym->is_global = false;
+    return;
+  }
+
+  if (!strcmp(name, ".type")) {
+    Symbol *sym = read_symbol_operand(&p, p);
+    expect_comma(&p, p);
+    p = skip_space(p);
+    if (!strcmp(p, "@function"))
+      sym->type = STT_FUNC;
+    else if (!strcmp(p, "@object"))
+      sym->type = STT_OBJECT;
+    else if (!strcmp(p, "@tls_object"))
+      sym->type = STT_TLS;
+    else
+      unsupported();
+    return;
+  }
+
+  if (!strcmp(name, ".size")) {
+    Symbol *sym = read_symbol_operand(&p, p);
+    expect_comma(&p, p);
+    sym->size = read_int_operand(&p, p);
+    expect_end(p);
+    return;
+  }
+
+  if (!strcmp(name, ".align") || !strcmp(name, ".balign")) {
+    int align = read_int_operand(&p, p);
+    expect_end(p);
+    emit_align(align);
+    return;
+  }
+
+  if (!strcmp(name, ".p2align")) {
+    int n = read_int_operand(&p, p);
+    expect_end(p);
+    if (n < 0 || n > 16)
+      unsupported();
+    emit_align(1 << n);
+    return;
+  }
+
+  if (!strcmp(name, ".zero") || !strcmp(name, ".skip")) {
+    long n = read_int_operand(&p, p);
+    expect_end(p);
+    zero_fill(n);
+    return;
+  }
+
+  if (!strcmp(name, ".byte")) {
+    data_directive(p, 1);
+    return;
+  }
+
+  if (!strcmp(name, ".value") || !strcmp(name, ".short") || !strcmp(name, ".word")) {
+    data_directive(p, 2);
+    return;
+  }
+
+  if (!strcmp(name, ".long") || !strcmp(name, ".int")) {
+    data_directive(p, 4);
+    return;
+  }
+
+  if (!strcmp(name, ".quad")) {
+    data_directive(p, 8);
+    return;
+  }
+
+  if (!strcmp(name, ".comm")) {
+    Symbol *sym = read_symbol_operand(&p, p);
+    expect_comma(&p, p);
+    long size = read_int_operand(&p, p);
+    int align = 1;
+    if (*p == ',') {
+      expect_comma(&p, p);
+      align = read_int_operand(&p, p);
+    }
+    expect_end(p);
+
+    if (sym->is_defined || sym->is_common || align <= 0 || (align & (align - 1)))
+      unsupported();
+
+    // A local common symbol is allocated in .bss after everything
+    // else in that section, as GNU as does.
+    if (sym->is_local) {
+      if (sym->lcomm_size >= 0)
+        unsupported();
+      sym->lcomm_size = size;
+      sym->common_align = align;
+      strarray_push(&lcomms, sym->name);
+      return;
+    }
+
+    sym->is_common = true;
+    sym->is_global = true;
+    sym->size = size;
+    sym->common_align = align;
+    sym->type = STT_OBJECT;
+    return;
+  }
+
+  // Anything else, notably .file and .loc, isn't supported.
+  unsupported();
+}
+
+//
+// Statement parsing
+//
+
+static char *read_mnemonic(char **rest, char *p) {
+  char *q = p;
+  while (isalnum(*q) || *q == '.' || *q == '_')
+    q++;
+  if (q == p)
+    unsupported();
+  *rest = q;
+  return strndup(p, q - p);
+}
+
+// Try to read a label definition at the beginning of a statement.
+static bool read_label(char **rest, char *p) {
+  char *q = p;
+  Symbol *sym;
+
+  if (isdigit(*q)) {
+    while (isdigit(*q))
+      q++;
+    if (*skip_space(q) != ':')
+      return false;
+    if (q - p != 1)
+      unsupported();
+    int n = *p - '0';
+    local_label_cnt[n]++;
+    sym = local_label(n, false);
+  } else if (*q == '"' || is_sym_char(*q)) {
+    char *name = read_symbol_name(&q, q);
+    if (*skip_space(q) != ':')
+      return false;
+    sym = get_symbol(name);
+  } else {
+    return false;
+  }
+
+  define_symbol(sym);
+  *rest = skip_space(q) + 1;
+  return true;
+}
+
+static void statement(char *p) {
+  for (;;) {
+    p = skip_space(p);
+    if (!*p)
+      return;
+    if (!read_label(&p, p))
+      break;
+  }
+
+  char *mnem = read_mnemonic(&p, p);
+  p = skip_space(p);
+
+  if (mnem[0] == '.') {
+    directive(mnem, p);
+    return;
+  }
+
+  // Prefixes may be written on the same line as the instruction.
+  if (!strcmp(mnem, "data16") || !strcmp(mnem, "rex64")) {
+    encode_simple(mnem, 0);
+    statement(p);
+    return;
+  }
+
+  Operand ops[3];
+  int nops = 0;
+  while (*p) {
+    if (nops == 3)
+      unsupported();
+    if (nops > 0)
+      expect_comma(&p, p);
+    read_operand(&p, p, &ops[nops++]);
+    p = skip_space(p);
+    if (*p && *p != ',')
+      unsupported();
+  }
+
+  if (!cur_sec)
+    unsupported();
+  encode_insn(mnem, ops, nops);
+}
+
+// Split the input into statements. Comments start with '#' and
+// statements are separated by newlines or ';'.
+static void parse_text(char *p) {
+  char *buf = NULL;
+  int cap = 0;
+
+  while (*p) {
+    char *end = p;
+    bool in_str = false;
+    while (*end && *end != '\n' && (in_str || (*end != ';' && *end != '#'))) {
+      if (*end == '"')
+        in_str = !in_str;
+      else if (in_str && *end == '\\' && end[1])
+        end++;
+      end++;
+    }
+
+    int len = end - p;
+    if (cap <= len) {
+      cap = len * 2 + 1;
+      buf = realloc(buf, cap);
+    }
+    memcpy(buf, p, len);
+    buf[len] = '\0';
+
+    if (!cur_sec && *skip_space(buf))
+      cur_sec = get_section(".text", SHT_PROGBITS, SHF_ALLOC | SHF_EXECINSTR);
+    statement(buf);
+
+    if (*end == '#')
+      while (*end && *end != '\n')
+        end++;
+    p = *end ? end + 1 : end;
+  }
+}
+
+//
+// Layout and relocation
+//
+
+static long symbol_addr(Symbol *sym) {
+  return sym->frag->addr + sym->ofs;
+}
+
+static bool is_resolvable(Symbol *sym, Section *sec) {
+  return sym->is_defined && !sym->is_global && sym->sec == sec;
+}
+
+static int var_size(Frag *f) {
+  switch (f->kind) {
+  case FRAG_JUMP:
+    if (!f->is_long)
+      return 2;
+    return (f->cc == -1) ? 5 : 6;
+  case FRAG_ALIGN: {
+    long end = f->addr + f->len;
+    return (f->align - end % f->align) % f->align;
+  }
+  default:
+    return 0;
+  }
+}
+
+static void layout(Section *sec) {
+  long addr = 0;
+  for (Frag *f = sec->frags; f; f = f->next) {
+    f->addr = addr;
+    addr += f->len + var_size(f);
+  }
+  sec->size = addr;
+}
+
+static void relax(Section *sec) {
+  for (Frag *f = sec->frags; f; f = f->next)
+    if (f->kind == FRAG_JUMP && !is_resolvable(f->target, sec))
+      f->is_long = true;
+
+  for (;;) {
+    layout(sec);
+
+    bool changed = false;
+    for (Frag *f = sec->frags; f; f = f->next) {
+      if (f->kind != FRAG_JUMP || f->is_long)
+        continue;
+      long disp = symbol_addr(f->target) - (f->addr + f->len + 2);
+      if (!is_int8(disp)) {
+        f->is_long = true;
+        changed = true;
+      }
+    }
+    if (!changed)
+      return;
+  }
+}
+
+static void add_rela(Section *sec, long ofs, int type, Symbol *sym, long addend,
+                     bool is_section_rel) {
+  if (sec->nrelas == sec->rela_cap) {
+    sec->rela_cap = sec->rela_cap ? sec->rela_cap * 2 : 16;
+    sec->relas = realloc(sec->relas, sizeof(Rela) * sec->rela_cap);
+  }
+  sec->relas[sec->nrelas++] = (Rela){ofs, type, sym, addend, is_section_rel};
+}
+
+static void put32(char *p, long v) {
+  for (int i = 0; i < 4; i++)
+    p[i] = v >> (i * 8);
+}
+
+// Resolve a fixup at section offset `ofs` either in place or by
+// turning it into a relocation. Relocations against local symbols
+// are made against their section symbol where the relocation type
+// allows that, as other assemblers do.
+static void apply_fixup(Section *sec, long ofs, int type, Symbol *sym, long addend) {
+  if ((type == R_X86_64_PC32 || type == R_X86_64_PLT32) && is_resolvable(sym, sec)) {
+    put32(sec->data + ofs, symbol_addr(sym) + addend - ofs);
+    return;
+  }
+
+  if (!sym->is_defined && !sym->is_common && is_temp_symbol(sym))
+    unsupported();
+
+  bool adjustable = (type == R_X86_64_PC32 || type == R_X86_64_64 ||
+                     type == R_X86_64_32 || type == R_X86_64_32S);
+
+  if (sym->is_defined && !sym->is_global && adjustable) {
+    add_rela(sec, ofs, type, sym, addend + symbol_addr(sym), true);
+    return;
+  }
+
+  sym->in_symtab = true;
+  if (type == R_X86_64_TLSGD || type == R_X86_64_TPOFF32)
+    sym->is_tls = true;
+  add_rela(sec, ofs, type, sym, addend, false);
+}
+
+static int cmp_rela(const void *a, const void *b) {
+  long x = ((Rela *)a)->ofs;
+  long y = ((Rela *)b)->ofs;
+  return (x > y) - (x < y);
+}
+
+static void finalize_section(Section *sec) {
+  if (sec->type == SHT_NOBITS)
+    return;
+
+  sec->data = calloc(1, sec->size + 1);
+
+  for (Frag *f = sec->frags; f; f = f->next) {
+    unsigned char *p = (unsigned char *)sec->data + f->addr;
+    memcpy(p, f->buf, f->len);
+
+    for (Fixup *fx = f->fixups; fx; fx = fx->next)
+      apply_fixup(sec, f->addr + fx->ofs, fx->type, fx->sym, fx->addend);
+
+    p += f->len;
+
+    if (f->kind == FRAG_ALIGN) {
+      memset(p, (sec->flags & SHF_EXECINSTR) ? 0x90 : 0, var_size(f));
+      continue;
+    }
+
+    if (f->kind != FRAG_JUMP)
+      continue;
+
+    long end = f->addr + f->len + var_size(f);
+
+    if (!f->is_long) {
+      *p++ = (f->cc == -1) ? 0xeb : 0x70 + f->cc;
+      *p = symbol_addr(f->target) - end;
+      continue;
+    }
+
+    if (f->cc == -1) {
+      *p++ = 0xe9;
+    } else {
+      *p++ = 0x0f;
+      *p++ = 0x80 + f->cc;
+    }
+
+    if (is_resolvable(f->target, sec))
+      put32((char *)p, symbol_addr(f->target) - end);
+    else
+      apply_fixup(sec, (char *)p - sec->data, R_X86_64_PLT32, f->target, -4);
+  }
+
+  // Fixups were recorded in reverse order within each fragment.
+  qsort(sec->relas, sec->nrelas, sizeof(Rela), cmp_rela);
+}
+
+//
+// ELF output
+//
+
+typedef struct {
+  char *buf;
+  size_t len;
+  FILE *fp;
+} StrTab;
+
+static int strtab_add(StrTab *tab, char *s) {
+  int ofs = ftell(tab->fp);
+  fwrite(s, 1, strlen(s) + 1, tab->fp);
+  return ofs;
+}
+
+static void write_elf(FILE *out) {
+  int nsecs = 0;
+  for (Section *sec = sections; sec; sec = sec->next)
+    sec->idx = ++nsecs;
+
+  // Build the symbol table: null, section symbols, other locals,
+  // then globals.
+  StrTab strtab = {0};
+  strtab.fp = open_memstream(&strtab.buf, &strtab.len);
+  strtab_add(&strtab, "");
+
+  Elf64_Sym *syms = calloc(nsecs + symbols.used + 1, sizeof(Elf64_Sym));
+  int nsyms = 1;
+
+  for (Section *sec = sections; sec; sec = sec->next) {
+    sec->sym_idx = nsyms;
+    syms[nsyms].st_info = ELF64_ST_INFO(STB_LOCAL, STT_SECTION);
+    syms[nsyms].st_shndx = sec->idx;
+    nsyms++;
+  }
+
+  Symbol **list = calloc(symbols.used + 1, sizeof(Symbol *));
+  int nlist = 0;
+  for (int i = 0; i < symbols.capacity; i++) {
+    HashEntry *ent = &symbols.buckets[i];
+    if (ent->key && ent->key != (void *)-1)
+      list[nlist++] = ent->val;
+  }
+
+  // Keep symbols in a deterministic order.
+  for (int i = 1; i < nlist; i++) {
+    Symbol *s = list[i];
+    int j = i - 1;
+    while (j >= 0 && strcmp(list[j]->name, s->name) > 0) {
+      list[j + 1] = list[j];
+      j--;
+    }
+    list[j + 1] = s;
+  }
+
+  int first_global = 0;
+  for (int pass = 0; pass < 2; pass++) {
+    bool want_global = pass;
+    if (want_global)
+      first_global = nsyms;
+
+    for (int i = 0; i < nlist; i++) {
+      Symbol *sym = list[i];
+      bool is_undef = !sym->is_defined && !sym->is_common;
+      bool is_global = sym->is_global || is_undef;
+      if (is_global != want_global)
+        continue;
+      if (is_temp_symbol(sym) && !sym->in_symtab)
+        continue;
+      if (is_undef && !sym->is_global && !sym->is_used)
+        continue;
+
+      Elf64_Sym *es = &syms[nsyms];
+      sym->idx = nsyms++;
+      es->st_name = strtab_add(&strtab, sym->name);
+
+      int type = sym->is_tls ? STT_TLS : sym->type;
+      es->st_info = ELF64_ST_INFO(is_global ? STB_GLOBAL : STB_LOCAL, type);
+      es->st_size = sym->size;
+
+      if (sym->is_common) {
+        es->st_shndx = SHN_COMMON;
+        es->st_value = sym->common_align;
+      } else if (sym->is_defined) {
+        es->st_shndx = sym->sec->idx;
+        es->st_value = symbol_addr(sym);
+      }
+    }
+  }
+  fclose(strtab.fp);
+
+  // Section header string table
+  StrTab shstrtab = {0};
+  shstrtab.fp = open_memstream(&shstrtab.buf, &shstrtab.len);
+  strtab_add(&shstrtab, "");
+
+  int nrela = 0;
+  for (Section *sec = sections; sec; sec = sec->next)
+    if (sec->nrelas)
+      sec->rela_idx = nsecs + 1 + nrela++;
+
+  int shnum = nsecs + nrela + 4;
+  int symtab_idx = nsecs + nrela + 1;
+  Elf64_Shdr *shdrs = calloc(shnum, sizeof(Elf64_Shdr));
+
+  // Lay out the file: header, section contents, then section headers.
+  long ofs = sizeof(Elf64_Ehdr);
+
+  for (Section *sec = sections; sec; sec = sec->next) {
+    Elf64_Shdr *sh = &shdrs[sec->idx];
+    sh->sh_name = strtab_add(&shstrtab, sec->name);
+    sh->sh_type = sec->type;
+    sh->sh_flags = sec->flags;
+    sh->sh_addralign = sec->align;
+    ofs = align_to(ofs, sec->align);
+    sh->sh_offset = ofs;
+    sh->sh_size = sec->size;
+    if (sec->type != SHT_NOBITS)
+      ofs += sec->size;
+  }
+
+  Elf64_Rela **relas = calloc(shnum, sizeof(Elf64_Rela *));
+
+  for (Section *sec = sections; sec; sec = sec->next) {
+    if (!sec->nrelas)
+      continue;
+
+    Elf64_Shdr *sh = &shdrs[sec->rela_idx];
+    sh->sh_name = strtab_add(&shstrtab, format(".rela%s", sec->name));
+    sh->sh_type = SHT_RELA;
+    sh->sh_flags = SHF_INFO_LINK;
+    sh->sh_addralign = 8;
+    sh->sh_entsize = sizeof(Elf64_Rela);
+    sh->sh_link = symtab_idx;
+    sh->sh_info = sec->idx;
+    ofs = align_to(ofs, 8);
+    sh->sh_offset = ofs;
+    sh->sh_size = sec->nrelas * sizeof(Elf64_Rela);
+    ofs += sh->sh_size;
+
+    Elf64_Rela *r = calloc(sec->nrelas, sizeof(Elf64_Rela));
+    for (int i = 0; i < sec->nrelas; i++) {
+      Rela *rel = &sec->relas[i];
+      int symidx = rel->is_section_rel ? rel->sym->sec->sym_idx : rel->sym->idx;
+      r[i].r_offset = rel->ofs;
+      r[i].r_info = ELF64_R_INFO(symidx, rel->type);
+      r[i].r_addend = rel->addend;
+    }
+    relas[sec->rela_idx] = r;
+  }
+
+  Elf64_Shdr *sh = &shdrs[symtab_idx];
+  sh->sh_name = strtab_add(&shstrtab, ".symtab");
+  sh->sh_type = SHT_SYMTAB;
+  sh->sh_addralign = 8;
+  sh->sh_entsize = sizeof(Elf64_Sym);
+  sh->sh_link = symtab_idx + 1;
+  sh->sh_info = first_global;
+  ofs = align_to(ofs, 8);
+  sh->sh_offset = ofs;
+  sh->sh_size = nsyms * sizeof(Elf64_Sym);
+  ofs += sh->sh_size;
+
+  sh = &shdrs[symtab_idx + 1];
+  sh->sh_name = strtab_add(&shstrtab, ".strtab");
+  sh->sh_type = SHT_STRTAB;
+  sh->sh_addralign = 1;
+  sh->sh_offset = ofs;
+  sh->sh_size = strtab.len;
+  ofs += sh->sh_size;
+
+  sh = &shdrs[symtab_idx + 2];
+  sh->sh_name = strtab_add(&shstrtab, ".shstrtab");
+  fclose(shstrtab.fp);
+  sh->sh_type = SHT_STRTAB;
+  sh->sh_addralign = 1;
+  sh->sh_offset = ofs;
+  sh->sh_size = shstrtab.len;
+  ofs += sh->sh_size;
+
+  ofs = align_to(ofs, 8);
+
+  Elf64_Ehdr eh = {0};
+  memcpy(eh.e_ident, ELFMAG, SELFMAG);
+  eh.e_ident[EI_CLASS] = ELFCLASS64;
+  eh.e_ident[EI_DATA] = ELFDATA2LSB;
+  eh.e_ident[EI_VERSION] = EV_CURRENT;
+  eh.e_ident[EI_OSABI] = ELFOSABI_NONE;
+  eh.e_type = ET_REL;
+  eh.e_machine = EM_X86_64;
+  eh.e_version = EV_CURRENT;
+  eh.e_shoff = ofs;
+  eh.e_ehsize = sizeof(Elf64_Ehdr);
+  eh.e_shentsize = sizeof(Elf64_Shdr);
+  eh.e_shnum = shnum;
+  eh.e_shstrndx = symtab_idx + 2;
+
+  // Write everything out.
+  long pos = 0;
+  fwrite(&eh, sizeof(eh), 1, out);
+  pos += sizeof(eh);
+
+  for (int i = 1; i < shnum; i++) {
+    Elf64_Shdr *sh = &shdrs[i];
+    if (sh->sh_type == SHT_NOBITS || sh->sh_size == 0)
+      continue;
+    for (; pos < sh->sh_offset; pos++)
+      fputc(0, out);
+
+    char *data;
+    if (sh->sh_type == SHT_RELA)
+      data = (char *)relas[i];
+    else if (sh->sh_type == SHT_SYMTAB)
+      data = (char *)syms;
+    else if (i == symtab_idx + 1)
+      data = strtab.buf;
+    else if (i == symtab_idx + 2)
+      data = shstrtab.buf;
+    else
+      data = NULL;
+
+    if (!data) {
+      for (Section *sec = sections; sec; sec = sec->next)
+        if (sec->idx == i)
+          data = sec->data;
+    }
+
+    fwrite(data, 1, sh->sh_size, out);
+    pos += sh->sh_size;
+  }
+
+  for (; pos < ofs; pos++)
+    fputc(0, out);
+  fwrite(shdrs, sizeof(Elf64_Shdr), shnum, out);
+}
+
+static void reset(void) {
+  sections = NULL;
+  cur_sec = NULL;
+  symbols = (HashMap){0};
+  lcomms = (StringArray){0};
+  memset(local_label_cnt, 0, sizeof(local_label_cnt));
+}
+
+// Assemble `text` and write a relocatable object to `out`.
+// Returns false if the input uses something we can't encode, in
+// which case nothing is written.
+bool emit_elf_object(char *text, FILE *out) {
+  reset();
+
+  if (setjmp(bailout)) {
+    reset();
+    return false;
+  }
+
+  parse_text(text);
+  allocate_local_commons();
+
+  // Relocations may refer to other sections, so lay out everything
+  // before resolving them.
+  for (Section *sec = sections; sec; sec = sec->next)
+    relax(sec);
+  for (Section *sec = sections; sec; sec = sec->next)
+    finalize_section(sec);
+
+  write_elf(out);
+  reset();
+  return true;
+}
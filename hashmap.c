@@ -14,7 +14,7 @@
 // Represents a deleted hash entry
 #define TOMBSTONE ((void *)-1)
 
-static uint64_t fnv_hash(char *s, int len) {
+uint64_t fnv_hash(char *s, int len) {
   uint64_t hash = 0xcbf29ce484222325;
   for (int i = 0; i < len; i++) {
     hash *= 0x100000001b3;
@@ -40,6 +40,7 @@ static void rehash(HashMap *map) {
   // Create a new hashmap and copy all key-values.
   HashMap map2 = {0};
   map2.buckets = calloc(cap, sizeof(HashEntry));
+  count_alloc(MEM_HASHMAP, cap * sizeof(HashEntry));
   map2.capacity = cap;
 
   for (int i = 0; i < map->capacity; i++) {
@@ -52,17 +53,21 @@ static void rehash(HashMap *map) {
   *map = map2;
 }
 
+// Interned strings are usually looked up with the same pointer as
+// they were inserted, so compare pointers before contents. The same
+// pointer may still name a different key if only a prefix of it was
+// inserted, so the lengths must agree as well.
 static bool match(HashEntry *ent, char *key, int keylen) {
+  if (ent->key == key && ent->keylen == keylen)
+    return true;
   return ent->key && ent->key != TOMBSTONE &&
          ent->keylen == keylen && memcmp(ent->key, key, keylen) == 0;
 }
 
-static HashEntry *get_entry(HashMap *map, char *key, int keylen) {
+static HashEntry *get_entry(HashMap *map, char *key, int keylen, uint64_t hash) {
   if (!map->buckets)
     return NULL;
 
-  uint64_t hash = fnv_hash(key, keylen);
-
   for (int i = 0; i < map->capacity; i++) {
     HashEntry *ent = &map->buckets[(hash + i) % map->capacity];
     if (match(ent, key, keylen))
@@ -76,6 +81,7 @@ static HashEntry *get_entry(HashMap *map, char *key, int keylen) {
 static HashEntry *get_or_insert_entry(HashMap *map, char *key, int keylen) {
   if (!map->buckets) {
     map->buckets = calloc(INIT_SIZE, sizeof(HashEntry));
+    count_alloc(MEM_HASHMAP, INIT_SIZE * sizeof(HashEntry));
     map->capacity = INIT_SIZE;
   } else if ((map->used * 100) / map->capacity >= HIGH_WATERMARK) {
     rehash(map);
@@ -104,7 +110,14 @@ void *hashmap_get(HashMap *map, char *key) {
 }
 
 void *hashmap_get2(HashMap *map, char *key, int keylen) {
-  HashEntry *ent = get_entry(map, key, keylen);
+  if (!map->buckets)
+    return NULL;
+  return hashmap_get3(map, key, keylen, fnv_hash(key, keylen));
+}
+
+// Same as hashmap_get2() but takes a precomputed hash of the key.
+void *hashmap_get3(HashMap *map, char *key, int keylen, uint64_t hash) {
+  HashEntry *ent = get_entry(map, key, keylen, hash);
   return ent ? ent->val : NULL;
 }
 
@@ -122,11 +135,34 @@ void hashmap_delete(HashMap *map, char *key) {
 }
 
 void hashmap_delete2(HashMap *map, char *key, int keylen) {
-  HashEntry *ent = get_entry(map, key, keylen);
+  HashEntry *ent = get_entry(map, key, keylen, fnv_hash(key, keylen));
   if (ent)
     ent->key = TOMBSTONE;
 }
 
+// Returns a copy of a given hashmap. Keys and values are shared
+// with the original.
+HashMap hashmap_copy(HashMap *map) {
+  HashMap map2 = *map;
+  if (map->buckets) {
+    map2.buckets = calloc(map->capacity, sizeof(HashEntry));
+    count_alloc(MEM_HASHMAP, map->capacity * sizeof(HashEntry));
+    memcpy(map2.buckets, map->buckets, map->capacity * sizeof(HashEntry));
+  }
+  return map2;
+}
+
+// Iterates over the entries of a given hashmap. `*i` should be 0 for
+// the first call. Returns NULL after the last entry.
+HashEntry *hashmap_next(HashMap *map, int *i) {
+  while (*i < map->capacity) {
+    HashEntry *ent = &map->buckets[(*i)++];
+    if (ent->key && ent->key != TOMBSTONE)
+      return ent;
+  }
+  return NULL;
+}
+
 void hashmap_test(void) {
   HashMap *map = calloc(1, sizeof(HashMap));
 
@@ -155,5 +191,11 @@ void hashmap_test(void) {
     hashmap_put(map, format("key %d", i), (void *)(size_t)i);
 
   assert(hashmap_get(map, "no such key") == NULL);
+
+  // A prefix of an inserted key shares its pointer but is a different key.
+  char *key = "prefix key";
+  hashmap_put2(map, key, 6, (void *)1);
+  assert(hashmap_get2(map, key, 10) == NULL);
+  assert(hashmap_get2(map, key, 6) == (void *)1);
   printf("OK\n");
 }
@@ -1,7 +1,7 @@
 #include "widcc.h"
 
 typedef enum {
-  FILE_NONE, FILE_C, FILE_ASM, FILE_OBJ, FILE_AR, FILE_DSO, FILE_PP_ASM
+  FILE_NONE, FILE_C, FILE_C_HEADER, FILE_ASM, FILE_OBJ, FILE_AR, FILE_DSO, FILE_PP_ASM
 } FileType;
 
 StringArray include_paths;
@@ -11,6 +11,8 @@ bool opt_g;
 bool opt_func_sections;
 bool opt_data_sections;
 bool opt_cc1_asm_pp;
+bool opt_cc1_pch;
+bool opt_H;
 StdVer opt_std;
 
 static StringArray opt_include;
@@ -23,6 +25,13 @@ static bool opt_MP;
 static bool opt_S;
 static bool opt_c;
 static bool opt_cc1;
+static bool opt_integrated_cc1 = true;
+static bool opt_integrated_as = true;
+static bool opt_cc1_obj;
+static bool opt_pipe;
+static char *opt_cache_dir;
+static bool opt_batch_cc1;
+static int opt_j = 1;
 static bool opt_hash_hash_hash;
 static bool opt_static;
 static bool opt_shared;
@@ -35,8 +44,11 @@ static StringArray std_include_paths;
 
 char *base_file;
 static char *output_file;
+static char *driver_path;
 
 static StringArray input_paths;
+static StringArray cc1_inputs;
+static StringArray cc1_outputs;
 static StringArray tmpfiles;
 
 static void usage(int status) {
@@ -46,7 +58,7 @@ static void usage(int status) {
 
 static bool take_arg(char *arg) {
   char *x[] = {
-    "-o", "-I", "-idirafter", "-include", "-x", "-MF", "-MT", "-Xlinker",
+    "-o", "-I", "-idirafter", "-include", "-x", "-MF", "-MT", "-Xlinker", "-j",
   };
 
   for (int i = 0; i < sizeof(x) / sizeof(*x); i++)
@@ -80,6 +92,8 @@ static void define(char *str) {
 static FileType parse_opt_x(char *s) {
   if (!strcmp(s, "c"))
     return FILE_C;
+  if (!strcmp(s, "c-header"))
+    return FILE_C_HEADER;
   if (!strcmp(s, "assembler"))
     return FILE_ASM;
   if (!strcmp(s, "assembler-with-cpp"))
@@ -132,6 +146,79 @@ static char *quote_makefile(char *s) {
   return buf;
 }
 
+// Read arguments from a response file. Arguments are separated by
+// whitespace and may be quoted with single or double quotes. A
+// backslash escapes the next character.
+static void read_response_file(StringArray *arr, char *path, int depth) {
+  FILE *fp = fopen(path, "r");
+  if (!fp)
+    error("%s: %s", path, strerror(errno));
+
+  char *buf;
+  size_t buflen;
+  FILE *out = NULL;
+  int quote = 0;
+
+  for (int c = fgetc(fp); c != EOF; c = fgetc(fp)) {
+    if (!quote && isspace(c)) {
+      if (out) {
+        fclose(out);
+        out = NULL;
+        if (buf[0] == '@' && depth < 10)
+          read_response_file(arr, buf + 1, depth + 1);
+        else
+          strarray_push(arr, buf);
+      }
+      continue;
+    }
+
+    if (!out)
+      out = open_memstream(&buf, &buflen);
+
+    if (c == '\\') {
+      c = fgetc(fp);
+      if (c != EOF)
+        fputc(c, out);
+    } else if (quote && c == quote) {
+      quote = 0;
+    } else if (!quote && (c == '\'' || c == '"')) {
+      quote = c;
+    } else {
+      fputc(c, out);
+    }
+  }
+
+  if (out) {
+    fclose(out);
+    if (buf[0] == '@' && depth < 10)
+      read_response_file(arr, buf + 1, depth + 1);
+    else
+      strarray_push(arr, buf);
+  }
+  fclose(fp);
+}
+
+// Replace @file arguments with the contents of the files.
+static char **expand_response_files(int *argc, char **argv) {
+  bool found = false;
+  for (int i = 1; i < *argc; i++)
+    if (argv[i][0] == '@')
+      found = true;
+  if (!found)
+    return argv;
+
+  StringArray arr = {0};
+  for (int i = 0; i < *argc; i++) {
+    if (i > 0 && argv[i][0] == '@')
+      read_response_file(&arr, argv[i] + 1, 0);
+    else
+      strarray_push(&arr, argv[i]);
+  }
+  strarray_push(&arr, NULL);
+  *argc = arr.len - 1;
+  return arr.data;
+}
+
 static void parse_args(int argc, char **argv) {
   // Make sure that all command line options that take an argument
   // have an argument.
@@ -153,6 +240,31 @@ static void parse_args(int argc, char **argv) {
       continue;
     }
 
+    if (!strcmp(argv[i], "-fintegrated-cc1")) {
+      opt_integrated_cc1 = true;
+      continue;
+    }
+
+    if (!strcmp(argv[i], "-fno-integrated-cc1")) {
+      opt_integrated_cc1 = false;
+      continue;
+    }
+
+    if (!strcmp(argv[i], "-fintegrated-as")) {
+      opt_integrated_as = true;
+      continue;
+    }
+
+    if (!strcmp(argv[i], "-fno-integrated-as")) {
+      opt_integrated_as = false;
+      continue;
+    }
+
+    if (!strcmp(argv[i], "-pipe")) {
+      opt_pipe = true;
+      continue;
+    }
+
     if (!strcmp(argv[i], "--help"))
       usage(0);
 
@@ -171,6 +283,15 @@ static void parse_args(int argc, char **argv) {
       continue;
     }
 
+    if (!strncmp(argv[i], "-j", 2)) {
+      char *arg = argv[i][2] ? argv[i] + 2 : argv[++i];
+      char *end;
+      opt_j = strtol(arg, &end, 10);
+      if (*end || opt_j < 1)
+        error("-j: invalid number of jobs: %s", arg);
+      continue;
+    }
+
     if (!strcmp(argv[i], "-fcommon")) {
       opt_fcommon = true;
       continue;
@@ -196,6 +317,11 @@ static void parse_args(int argc, char **argv) {
       continue;
     }
 
+    if (!strcmp(argv[i], "-H")) {
+      opt_H = true;
+      continue;
+    }
+
     if (!strcmp(argv[i], "-I")) {
       strarray_push(&include_paths, argv[++i]);
       continue;
@@ -311,11 +437,23 @@ static void parse_args(int argc, char **argv) {
 
     if (!strcmp(argv[i], "-cc1-input")) {
       base_file = argv[++i];
+      strarray_push(&cc1_inputs, base_file);
       continue;
     }
 
     if (!strcmp(argv[i], "-cc1-output")) {
       output_file = argv[++i];
+      strarray_push(&cc1_outputs, output_file);
+      continue;
+    }
+
+    if (!strcmp(argv[i], "-fbatch-cc1")) {
+      opt_batch_cc1 = true;
+      continue;
+    }
+
+    if (!strcmp(argv[i], "-fno-batch-cc1")) {
+      opt_batch_cc1 = false;
       continue;
     }
 
@@ -325,6 +463,16 @@ static void parse_args(int argc, char **argv) {
       continue;
     }
 
+    if (!strcmp(argv[i], "-cc1-obj")) {
+      opt_cc1_obj = true;
+      continue;
+    }
+
+    if (!strcmp(argv[i], "-cc1-pch")) {
+      opt_cc1_pch = true;
+      continue;
+    }
+
     if (!strcmp(argv[i], "-idirafter")) {
       strarray_push(&idirafter, argv[i++]);
       continue;
@@ -403,6 +551,31 @@ static void parse_args(int argc, char **argv) {
       continue;
     }
 
+    if (!strncmp(argv[i], "-fcache-dir=", 12)) {
+      opt_cache_dir = argv[i] + 12;
+      continue;
+    }
+
+    if (!strcmp(argv[i], "-ftime-report")) {
+      opt_time_report = REPORT_TEXT;
+      continue;
+    }
+
+    if (!strcmp(argv[i], "-ftime-report=json")) {
+      opt_time_report = REPORT_JSON;
+      continue;
+    }
+
+    if (!strcmp(argv[i], "-fmem-report")) {
+      opt_mem_report = REPORT_TEXT;
+      continue;
+    }
+
+    if (!strcmp(argv[i], "-fmem-report=json")) {
+      opt_mem_report = REPORT_JSON;
+      continue;
+    }
+
     if (!strcmp(argv[i], "-ffunction-sections")) {
       opt_func_sections = true;
       continue;
@@ -489,30 +662,87 @@ static char *create_tmpfile(void) {
   return path;
 }
 
-static void run_subprocess(char **argv) {
+static void print_command(char **argv) {
+  fprintf(stderr, "%s", argv[0]);
+  for (int i = 1; argv[i]; i++)
+    fprintf(stderr, " %s", argv[i]);
+  fprintf(stderr, "\n");
+}
+
+static void wait_subprocess(void) {
+  // Wait for the child process to finish.
+  int status;
+  phase_start(PHASE_WAIT);
+  while (wait(&status) > 0);
+  phase_end();
+  if (status != 0)
+    exit(1);
+}
+
+// Start a subprocess without waiting for it. If `in` or `out` is not
+// -1, it becomes the subprocess's standard input or output.
+static void spawn_subprocess(char **argv, int in, int out) {
   // If -### is given, dump the subprocess's command line.
-  if (opt_hash_hash_hash) {
-    fprintf(stderr, "%s", argv[0]);
-    for (int i = 1; argv[i]; i++)
-      fprintf(stderr, " %s", argv[i]);
-    fprintf(stderr, "\n");
-  }
+  if (opt_hash_hash_hash)
+    print_command(argv);
+
+  fflush(NULL);
+  stats.subprocesses++;
 
   if (fork() == 0) {
     // Child process. Run a new command.
+    if (in != -1)
+      dup2(in, STDIN_FILENO);
+    if (out != -1)
+      dup2(out, STDOUT_FILENO);
     execvp(argv[0], argv);
     fprintf(stderr, "exec failed: %s: %s\n", argv[0], strerror(errno));
     _exit(1);
   }
+}
 
-  // Wait for the child process to finish.
-  int status;
-  while (wait(&status) > 0);
-  if (status != 0)
-    exit(1);
+static void run_subprocess(char **argv) {
+  spawn_subprocess(argv, -1, -1);
+  wait_subprocess();
 }
 
-static void run_cc1(int argc, char **argv, char *input, char *output, char *option) {
+static void cc1(void);
+
+// Run cc1 in a forked copy of the driver. The driver has already
+// parsed the command line and initialized predefined macros, so the
+// child can start compiling right away instead of re-executing
+// itself with -cc1. Errors still only terminate the child.
+static void spawn_cc1_integrated(char *input, char *output, char *option, int out) {
+  fflush(NULL);
+  stats.subprocesses++;
+
+  if (fork() == 0) {
+    // Temporary files belong to the driver.
+    tmpfiles.len = 0;
+    init_time_report();
+
+    if (out != -1)
+      dup2(out, STDOUT_FILENO);
+
+    base_file = input;
+    output_file = output;
+    if (option && !strcmp(option, "-cc1-asm-pp"))
+      opt_E = opt_cc1_asm_pp = true;
+    if (option && !strcmp(option, "-cc1-obj"))
+      opt_cc1_obj = true;
+    if (option && !strcmp(option, "-cc1-pch"))
+      opt_cc1_pch = true;
+
+    add_default_include_paths(driver_path);
+    cc1();
+    print_time_report(input);
+    print_mem_report(input);
+    exit(0);
+  }
+}
+
+static void spawn_cc1(int argc, char **argv, char *input, char *output,
+                      char *option, int out) {
   char **args = calloc(argc + 10, sizeof(char *));
   memcpy(args, argv, argc * sizeof(char *));
   args[argc++] = "-cc1";
@@ -530,7 +760,84 @@ static void run_cc1(int argc, char **argv, char *input, char *output, char *opti
   if (option)
     args[argc++] = option;
 
-  run_subprocess(args);
+  if (!opt_integrated_cc1) {
+    spawn_subprocess(args, -1, out);
+    return;
+  }
+
+  if (opt_hash_hash_hash)
+    print_command(args);
+  spawn_cc1_integrated(input, output, option, out);
+}
+
+static void run_cc1(int argc, char **argv, char *input, char *output, char *option) {
+  spawn_cc1(argc, argv, input, output, option, -1);
+  wait_subprocess();
+}
+
+static void make_pipe(int fds[2]) {
+  if (pipe(fds) == -1)
+    error("pipe failed: %s", strerror(errno));
+
+  // Only the ends passed to spawn_*() as stdin or stdout should
+  // survive in a child that execs.
+  fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+  fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+}
+
+// Wait for all subprocesses. If any of them failed, remove the output
+// file, which may have been written from incomplete input, and exit.
+static void wait_pipeline(char *output) {
+  bool failed = false;
+  int status;
+  phase_start(PHASE_WAIT);
+  while (wait(&status) > 0)
+    if (status != 0)
+      failed = true;
+  phase_end();
+
+  if (failed) {
+    unlink(output);
+    exit(1);
+  }
+}
+
+// With -pipe, cc1 writes assembly to the assembler's standard input
+// instead of to a temporary file.
+static void run_cc1_pipe(int argc, char **argv, char *input, char *output, char *option) {
+  int fds[2];
+  make_pipe(fds);
+
+  char *cmd[] = {"as", "-o", output, "-", NULL};
+  spawn_subprocess(cmd, fds[0], -1);
+  close(fds[0]);
+
+  spawn_cc1(argc, argv, input, "-", option, fds[1]);
+  close(fds[1]);
+
+  wait_pipeline(output);
+}
+
+static void assemble(char *input, char *output) {
+  char *cmd[] = {"as", input, "-o", output, NULL};
+  // char *cmd[] = {"clang", "-c", "-xassembler", input, "-o", output, NULL};
+  run_subprocess(cmd);
+}
+
+// Feed assembly text in memory to the assembler through a pipe.
+static void assemble_text(char *buf, size_t len, char *output) {
+  int fds[2];
+  make_pipe(fds);
+
+  char *cmd[] = {"as", "-o", output, "-", NULL};
+  spawn_subprocess(cmd, fds[0], -1);
+  close(fds[0]);
+
+  FILE *out = fdopen(fds[1], "w");
+  fwrite(buf, len, 1, out);
+  fclose(out);
+
+  wait_pipeline(output);
 }
 
 // Print tokens to stdout. Used for -E.
@@ -618,11 +925,83 @@ static Token *must_tokenize_file(char *path, Token **end) {
   return tok;
 }
 
+static void compile(Token *tok) {
+  phase_start(PHASE_PARSE);
+  Obj *prog = parse(tok);
+  phase_end();
+
+  // Traverse the AST to emit assembly.
+  if (!opt_cc1_obj) {
+    FILE *out = open_file(output_file);
+    phase_start(PHASE_CODEGEN);
+    codegen(prog, out);
+    phase_end();
+    fclose(out);
+    return;
+  }
+
+  // If -cc1-obj is given, write an object file directly. Fall back
+  // to the system assembler if the integrated one can't handle the
+  // output, e.g. for -g or unusual inline assembly.
+  char *buf;
+  size_t buflen;
+  FILE *output_buf = open_memstream(&buf, &buflen);
+  phase_start(PHASE_CODEGEN);
+  codegen(prog, output_buf);
+  phase_end();
+  fclose(output_buf);
+
+  FILE *out = open_file(output_file);
+  phase_start(PHASE_ASSEMBLE);
+  bool ok = emit_elf_object(buf, out);
+  phase_end();
+  fclose(out);
+  if (ok)
+    return;
+
+  if (opt_pipe) {
+    assemble_text(buf, buflen, output_file);
+    return;
+  }
+
+  char *tmp = create_tmpfile();
+  out = open_file(tmp);
+  fwrite(buf, buflen, 1, out);
+  fclose(out);
+  assemble(tmp, output_file);
+}
+
+static char *find_include_file(char *incl) {
+  if (file_exists(incl))
+    return incl;
+  char *path = search_include_paths(incl);
+  if (!path)
+    error("-include: %s: %s", incl, strerror(errno));
+  return path;
+}
+
 static void cc1(void) {
   Token head = {0};
   Token *cur = &head;
+  int first_include = 0;
 
-  if (!opt_E) {
+  if (opt_cc1_pch)
+    begin_pch(opt_include.len);
+
+  // A precompiled header for the first -include file replaces the
+  // built-in declarations as well as the file.
+  if (!opt_E && !opt_cc1_pch && opt_include.len) {
+    Token *end;
+    Token *tok = read_pch(find_include_file(opt_include.data[0]), &end);
+    if (tok) {
+      head.next = tok;
+      if (end)
+        cur = end;
+      first_include = 1;
+    }
+  }
+
+  if (!opt_E && !first_include) {
     Token *end;
     head.next = tokenize(add_input_file("widcc_builtins",
     "typedef struct {"
@@ -635,18 +1014,8 @@ static void cc1(void) {
   }
 
   // Process -include option
-  for (int i = 0; i < opt_include.len; i++) {
-    char *incl = opt_include.data[i];
-
-    char *path;
-    if (file_exists(incl)) {
-      path = incl;
-    } else {
-      path = search_include_paths(incl);
-      if (!path)
-        error("-include: %s: %s", incl, strerror(errno));
-    }
-
+  for (int i = first_include; i < opt_include.len; i++) {
+    char *path = find_include_file(opt_include.data[i]);
     Token *end = NULL;
     cur->next = must_tokenize_file(path, &end);
     if (end)
@@ -654,7 +1023,9 @@ static void cc1(void) {
   }
 
   // Tokenize and parse.
-  cur->next = must_tokenize_file(base_file, NULL);
+  cur->next = tokenize_file_lazy(base_file, NULL);
+  if (!cur->next)
+    error("%s: %s", base_file, strerror(errno));
   Token *tok = preprocess(head.next);
 
   // If -M or -MD are given, print file dependencies.
@@ -670,27 +1041,53 @@ static void cc1(void) {
     return;
   }
 
-  Obj *prog = parse(tok);
+  if (opt_cc1_pch) {
+    write_pch(output_file, tok);
+    return;
+  }
 
-  // Open a temporary output buffer.
-  char *buf;
-  size_t buflen;
-  FILE *output_buf = open_memstream(&buf, &buflen);
+  // If -fcache-dir is given, we may have compiled the same token
+  // stream with the same options before.
+  if (opt_cache_dir && cache_lookup(opt_cache_dir, tok, opt_cc1_obj, output_file))
+    return;
 
-  // Traverse the AST to emit assembly.
-  codegen(prog, output_buf);
-  fclose(output_buf);
+  compile(tok);
 
-  // Write the asembly text to a file.
-  FILE *out = open_file(output_file);
-  fwrite(buf, buflen, 1, out);
-  fclose(out);
+  if (opt_cache_dir)
+    cache_store(opt_cache_dir, output_file);
 }
 
-static void assemble(char *input, char *output) {
-  char *cmd[] = {"as", input, "-o", output, NULL};
-  // char *cmd[] = {"clang", "-c", "-xassembler", input, "-o", output, NULL};
-  run_subprocess(cmd);
+// Compile each pair of -cc1-input and -cc1-output in turn in this
+// process. Translation units don't affect each other because the
+// global state of each stage is reset in between, but files read by
+// an earlier translation unit are not read and tokenized again.
+static void cc1_batch(void) {
+  if (cc1_inputs.len != cc1_outputs.len)
+    error("-cc1-input and -cc1-output must be given in pairs");
+
+  reuse_tokens = true;
+  save_macros();
+
+  // The parser turns off stack reuse if setjmp is called.
+  bool reuse_stack = !dont_reuse_stack;
+
+  for (int i = 0; i < cc1_inputs.len; i++) {
+    if (i > 0) {
+      reset_input_files();
+      reset_preprocess();
+      arena_free(&ast_arena);
+      reset_parse();
+      reset_codegen();
+      dont_reuse_stack = !reuse_stack;
+    }
+
+    base_file = cc1_inputs.data[i];
+    output_file = cc1_outputs.data[i];
+    init_time_report();
+    cc1();
+    print_time_report(base_file);
+    print_mem_report(base_file);
+  }
 }
 
 static char *find_file(char *pattern) {
@@ -724,6 +1121,363 @@ static char *find_gcc_libpath(void) {
   error("gcc library path is not found");
 }
 
+// A job is the sequence of subprocesses needed to turn one input file
+// into its output: cc1, as, or cc1 followed by as.
+typedef struct {
+  char *input;
+  char *cc1_output;
+  char *cc1_option;
+  char *as_input;
+  char *as_output;
+
+  pid_t pid;
+  int status;
+  char *stdout_log;
+  char *stderr_log;
+} Job;
+
+static Job *jobs;
+static int njobs;
+static int jobs_capacity;
+
+static Job *new_job(char *input) {
+  if (njobs == jobs_capacity) {
+    jobs_capacity = jobs_capacity ? jobs_capacity * 2 : 8;
+    jobs = realloc(jobs, sizeof(Job) * jobs_capacity);
+  }
+  Job *job = &jobs[njobs++];
+  *job = (Job){0};
+  job->input = input;
+  return job;
+}
+
+static void add_cc1_job(char *input, char *output, char *option) {
+  Job *job = new_job(input);
+  job->cc1_output = output;
+  job->cc1_option = option;
+}
+
+static void add_as_job(char *input, char *output) {
+  Job *job = new_job(input);
+  job->as_input = input;
+  job->as_output = output;
+}
+
+// With -pipe, cc1's output goes to as through a pipe, so we don't
+// need a temporary file in between.
+static void add_cc1_as_job(char *input, char *output, char *option) {
+  Job *job = new_job(input);
+  job->cc1_option = option;
+  job->as_output = output;
+  if (!opt_pipe)
+    job->cc1_output = job->as_input = create_tmpfile();
+}
+
+static void run_job(int argc, char **argv, Job *job) {
+  if (!job->cc1_output && !job->as_input) {
+    run_cc1_pipe(argc, argv, job->input, job->as_output, job->cc1_option);
+    return;
+  }
+
+  if (job->cc1_output)
+    run_cc1(argc, argv, job->input, job->cc1_output, job->cc1_option);
+  if (job->as_output)
+    assemble(job->as_input, job->as_output);
+}
+
+// Returns true if a job consists of cc1 alone and writes to a file,
+// so that it can share a cc1 process with other jobs.
+static bool is_batchable(Job *job) {
+  return job->cc1_output && !job->as_output && strcmp(job->cc1_output, "-") &&
+         (!job->cc1_option || !strcmp(job->cc1_option, "-cc1-obj"));
+}
+
+static bool same_option(char *a, char *b) {
+  return a == b || (a && b && !strcmp(a, b));
+}
+
+// With -fbatch-cc1, run consecutive cc1 jobs in a single cc1 process.
+static void run_cc1_batch(int argc, char **argv, Job *jobs, int n) {
+  char **args = calloc(argc + n * 4 + 3, sizeof(char *));
+  memcpy(args, argv, argc * sizeof(char *));
+  args[argc++] = "-cc1";
+  for (int i = 0; i < n; i++) {
+    args[argc++] = "-cc1-input";
+    args[argc++] = jobs[i].input;
+    args[argc++] = "-cc1-output";
+    args[argc++] = jobs[i].cc1_output;
+  }
+  if (jobs[0].cc1_option)
+    args[argc++] = jobs[0].cc1_option;
+
+  if (!opt_integrated_cc1) {
+    run_subprocess(args);
+    return;
+  }
+
+  if (opt_hash_hash_hash)
+    print_command(args);
+
+  fflush(NULL);
+  stats.subprocesses++;
+
+  if (fork() == 0) {
+    tmpfiles.len = 0;
+    for (int i = 0; i < n; i++) {
+      strarray_push(&cc1_inputs, jobs[i].input);
+      strarray_push(&cc1_outputs, jobs[i].cc1_output);
+    }
+    if (jobs[0].cc1_option)
+      opt_cc1_obj = true;
+
+    add_default_include_paths(driver_path);
+    cc1_batch();
+    exit(0);
+  }
+  wait_subprocess();
+}
+
+static void copy_file(char *path, FILE *out) {
+  FILE *in = fopen(path, "r");
+  if (!in)
+    return;
+
+  char buf[4096];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), in)) > 0)
+    fwrite(buf, 1, n, out);
+  fclose(in);
+}
+
+static void redirect(char *path, int fd) {
+  int fd2 = open(path, O_WRONLY | O_TRUNC);
+  if (fd2 == -1 || dup2(fd2, fd) == -1)
+    _exit(1);
+  close(fd2);
+}
+
+// If we are run by GNU make with -j, MAKEFLAGS tells us how to reach
+// its jobserver, a pipe or fifo preloaded with one byte per job slot.
+// Like any other make child, we implicitly own one slot and have to
+// read a byte from the jobserver before using each additional one.
+static int jobserver_rfd = -1;
+static int jobserver_wfd = -1;
+static char *jobserver_tokens;
+static int jobserver_ntokens;
+static int sigchld_pipe[2] = {-1, -1};
+
+static int open_cloexec(char *path, int flags) {
+  int fd = open(path, flags);
+  if (fd != -1)
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+  return fd;
+}
+
+static void init_jobserver(void) {
+  char *flags = getenv("MAKEFLAGS");
+  if (!flags)
+    return;
+
+  // If the option is given more than once, the last one wins.
+  char *arg = NULL;
+  for (char *p = flags; (p = strstr(p, "--jobserver-")); p++) {
+    if (!strncmp(p, "--jobserver-auth=", 17))
+      arg = p + 17;
+    else if (!strncmp(p, "--jobserver-fds=", 16))
+      arg = p + 16;
+  }
+  if (!arg)
+    return;
+  arg = strndup(arg, strcspn(arg, " "));
+
+  if (!strncmp(arg, "fifo:", 5)) {
+    jobserver_rfd = open_cloexec(arg + 5, O_RDONLY | O_NONBLOCK);
+    jobserver_wfd = open_cloexec(arg + 5, O_WRONLY);
+  } else {
+    int rfd, wfd;
+    if (sscanf(arg, "%d,%d", &rfd, &wfd) != 2)
+      return;
+
+    // make doesn't pass the pipe to commands it doesn't think are
+    // recursive invocations of make.
+    if (fcntl(rfd, F_GETFD) == -1 || fcntl(wfd, F_GETFD) == -1)
+      return;
+
+    // Reopen the pipe so that we can make our end non-blocking
+    // without affecting other processes sharing it.
+    jobserver_rfd = open_cloexec(format("/proc/self/fd/%d", rfd), O_RDONLY | O_NONBLOCK);
+    jobserver_wfd = wfd;
+  }
+
+  if (jobserver_rfd == -1 || jobserver_wfd == -1) {
+    jobserver_rfd = jobserver_wfd = -1;
+    return;
+  }
+  jobserver_tokens = calloc(opt_j, 1);
+}
+
+// Try to take a job slot from the jobserver without blocking.
+static bool jobserver_acquire(void) {
+  if (jobserver_rfd == -1)
+    return true;
+
+  char c;
+  if (read(jobserver_rfd, &c, 1) != 1)
+    return false;
+  jobserver_tokens[jobserver_ntokens++] = c;
+  return true;
+}
+
+static void jobserver_release(void) {
+  if (jobserver_rfd == -1 || jobserver_ntokens == 0)
+    return;
+
+  char c = jobserver_tokens[--jobserver_ntokens];
+  while (write(jobserver_wfd, &c, 1) == -1 && errno == EINTR);
+}
+
+static void handle_sigchld(int sig) {
+  int saved = errno;
+  while (write(sigchld_pipe[1], "", 1) == -1 && errno == EINTR);
+  errno = saved;
+}
+
+// Block until a job finishes or, if we are waiting for a job slot,
+// the jobserver may have one for us.
+static pid_t wait_job(int *status, bool want_token) {
+  if (jobserver_rfd == -1 || !want_token)
+    return wait(status);
+
+  for (;;) {
+    pid_t pid = waitpid(-1, status, WNOHANG);
+    if (pid != 0)
+      return pid;
+
+    struct pollfd fds[2] = {
+      {.fd = jobserver_rfd, .events = POLLIN},
+      {.fd = sigchld_pipe[0], .events = POLLIN},
+    };
+    if (poll(fds, 2, -1) == -1 && errno != EINTR)
+      error("poll failed: %s", strerror(errno));
+
+    if (fds[1].revents & POLLIN) {
+      char buf[64];
+      while (read(sigchld_pipe[0], buf, sizeof(buf)) > 0);
+    }
+    if (fds[0].revents & POLLIN)
+      return 0;
+  }
+}
+
+// Run up to opt_j jobs at once. Each job's stdout and stderr are
+// written to temporary files and replayed in input order once all
+// jobs have finished, so the output is the same as if the jobs had
+// been run one by one. As in the sequential case, we stop at the
+// first job that failed; jobs that haven't started by the time a
+// failure is noticed are not started at all.
+static void run_jobs(int argc, char **argv) {
+  if (opt_j == 1 || njobs <= 1) {
+    for (int i = 0; i < njobs;) {
+      int n = 1;
+      if (opt_batch_cc1 && is_batchable(&jobs[i]))
+        while (i + n < njobs && is_batchable(&jobs[i + n]) &&
+               same_option(jobs[i].cc1_option, jobs[i + n].cc1_option))
+          n++;
+
+      if (n > 1)
+        run_cc1_batch(argc, argv, &jobs[i], n);
+      else
+        run_job(argc, argv, &jobs[i]);
+      i += n;
+    }
+    return;
+  }
+
+  for (int i = 0; i < njobs; i++) {
+    jobs[i].stdout_log = create_tmpfile();
+    jobs[i].stderr_log = create_tmpfile();
+  }
+
+  init_jobserver();
+  if (jobserver_rfd != -1) {
+    make_pipe(sigchld_pipe);
+    for (int i = 0; i < 2; i++)
+      fcntl(sigchld_pipe[i], F_SETFL, O_NONBLOCK);
+
+    struct sigaction sa = {0};
+    sa.sa_handler = handle_sigchld;
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGCHLD, &sa, NULL);
+  }
+
+  fflush(NULL);
+
+  int started = 0;
+  int running = 0;
+  bool failed = false;
+
+  for (;;) {
+    bool want_token = false;
+
+    while (!failed && started < njobs && running < opt_j) {
+      // The first job runs in our own job slot.
+      if (running > 0 && !jobserver_acquire()) {
+        want_token = true;
+        break;
+      }
+
+      Job *job = &jobs[started++];
+      job->pid = fork();
+      if (job->pid == -1)
+        error("fork failed: %s", strerror(errno));
+
+      if (job->pid == 0) {
+        // Temporary files belong to the parent.
+        tmpfiles.len = 0;
+        signal(SIGCHLD, SIG_DFL);
+        redirect(job->stdout_log, STDOUT_FILENO);
+        redirect(job->stderr_log, STDERR_FILENO);
+        run_job(argc, argv, job);
+        exit(0);
+      }
+      running++;
+    }
+
+    if (running == 0)
+      break;
+
+    int status;
+    phase_start(PHASE_WAIT);
+    pid_t pid = wait_job(&status, want_token);
+    phase_end();
+    if (pid == 0)
+      continue;
+    if (pid == -1)
+      error("wait failed: %s", strerror(errno));
+
+    for (int i = 0; i < started; i++) {
+      if (jobs[i].pid == pid) {
+        jobs[i].status = status;
+        running--;
+        jobserver_release();
+        if (status != 0)
+          failed = true;
+      }
+    }
+  }
+
+  if (jobserver_rfd != -1)
+    signal(SIGCHLD, SIG_DFL);
+
+  for (int i = 0; i < started; i++) {
+    copy_file(jobs[i].stdout_log, stdout);
+    fflush(stdout);
+    copy_file(jobs[i].stderr_log, stderr);
+    if (jobs[i].status != 0)
+      exit(1);
+  }
+}
+
 static void run_linker(StringArray *inputs, char *output) {
   StringArray arr = {0};
 
@@ -800,6 +1554,8 @@ static FileType get_file_type(char *filename) {
     return FILE_OBJ;
   if (endswith(filename, ".c"))
     return FILE_C;
+  if (endswith(filename, ".h"))
+    return FILE_C_HEADER;
   if (endswith(filename, ".s"))
     return FILE_ASM;
   if (endswith(filename, ".S"))
@@ -820,14 +1576,23 @@ static FileType get_file_type(char *filename) {
   error("<command line>: unknown file extension: %s", filename);
 }
 
-int main(int argc, char **argv) {
+int run_driver(int argc, char **argv) {
   atexit(cleanup);
+  driver_path = argv[0];
+  argv = expand_response_files(&argc, argv);
   init_macros();
   parse_args(argc, argv);
+  init_time_report();
 
   if (opt_cc1) {
-    add_default_include_paths(argv[0]);
+    add_default_include_paths(driver_path);
+    if (cc1_inputs.len > 1) {
+      cc1_batch();
+      return 0;
+    }
     cc1();
+    print_time_report(base_file);
+    print_mem_report(base_file);
     return 0;
   }
 
@@ -890,12 +1655,12 @@ int main(int argc, char **argv) {
         continue;
 
       if (opt_c) {
-        assemble(input, output);
+        add_as_job(input, output);
         continue;
       }
 
       char *tmp = create_tmpfile();
-      assemble(input, tmp);
+      add_as_job(input, tmp);
       strarray_push(&ld_args, tmp);
       run_ld = true;
       continue;
@@ -904,57 +1669,83 @@ int main(int argc, char **argv) {
     // Handle .S
     if (type == FILE_PP_ASM) {
       if (opt_S || opt_E || opt_M) {
-        run_cc1(argc, argv, input, (opt_o ? opt_o : "-"), "-cc1-asm-pp");
+        add_cc1_job(input, (opt_o ? opt_o : "-"), "-cc1-asm-pp");
         continue;
       }
       if (opt_c) {
-        char *tmp = create_tmpfile();
-        run_cc1(argc, argv, input, tmp, "-cc1-asm-pp");
-        assemble(tmp, output);
+        add_cc1_as_job(input, output, "-cc1-asm-pp");
         continue;
       }
-      char *tmp1 = create_tmpfile();
-      char *tmp2 = create_tmpfile();
-      run_cc1(argc, argv, input, tmp1, "-cc1-asm-pp");
-      assemble(tmp1, tmp2);
-      strarray_push(&ld_args, tmp2);
+      char *tmp = create_tmpfile();
+      add_cc1_as_job(input, tmp, "-cc1-asm-pp");
+      strarray_push(&ld_args, tmp);
       run_ld = true;
       continue;
     }
 
-    assert(type == FILE_C);
+    assert(type == FILE_C || type == FILE_C_HEADER);
 
     // Just preprocess
     if (opt_E || opt_M) {
-      run_cc1(argc, argv, input, (opt_o ? opt_o : "-"), NULL);
+      add_cc1_job(input, (opt_o ? opt_o : "-"), NULL);
+      continue;
+    }
+
+    // Precompile a header
+    if (type == FILE_C_HEADER) {
+      add_cc1_job(input, (opt_o ? opt_o : format("%s.pch", input)), "-cc1-pch");
       continue;
     }
 
     // Compile
     if (opt_S) {
-      run_cc1(argc, argv, input, output, NULL);
+      add_cc1_job(input, output, NULL);
       continue;
     }
 
     // Compile and assemble
+    if (opt_c && opt_integrated_as) {
+      add_cc1_job(input, output, "-cc1-obj");
+      continue;
+    }
+
     if (opt_c) {
-      char *tmp = create_tmpfile();
-      run_cc1(argc, argv, input, tmp, NULL);
-      assemble(tmp, output);
+      add_cc1_as_job(input, output, NULL);
       continue;
     }
 
     // Compile, assemble and link
-    char *tmp1 = create_tmpfile();
-    char *tmp2 = create_tmpfile();
-    run_cc1(argc, argv, input, tmp1, NULL);
-    assemble(tmp1, tmp2);
-    strarray_push(&ld_args, tmp2);
+    char *tmp = create_tmpfile();
+    if (opt_integrated_as)
+      add_cc1_job(input, tmp, "-cc1-obj");
+    else
+      add_cc1_as_job(input, tmp, NULL);
+    strarray_push(&ld_args, tmp);
     run_ld = true;
     continue;
   }
 
+  run_jobs(argc, argv);
+
   if (run_ld)
     run_linker(&ld_args, opt_o ? opt_o : "a.out");
+
+  print_time_report("driver");
   return 0;
 }
+
+int main(int argc, char **argv) {
+  if (argc == 3 && !strcmp(argv[1], "--server"))
+    run_server(argv[2]);
+
+  // Let a compile server run the command if there is one. This returns
+  // if there isn't, in which case we compile by ourselves.
+  bool is_cc1 = false;
+  for (int i = 1; i < argc; i++)
+    if (!strcmp(argv[i], "-cc1"))
+      is_cc1 = true;
+  if (!is_cc1)
+    run_client(argc, argv);
+
+  return run_driver(argc, argv);
+}
@@ -148,7 +148,8 @@ static int align_down(int n, int align) {
 }
 
 static void enter_scope(void) {
-  Scope *sc = calloc(1, sizeof(Scope));
+  Scope *sc = arena_calloc(&ast_arena, sizeof(Scope));
+  count_alloc(MEM_SCOPE, sizeof(Scope));
   sc->parent = scope;
   sc->sibling_next = scope->children;
   scope = scope->children = sc;
@@ -163,10 +164,12 @@ static void leave_scope(void) {
   scope = scope->parent;
 }
 
-// Find a variable by name.
+// Find a variable by name. Names are looked up by their atoms, whose
+// hash is computed only once when they are interned.
 static VarScope *find_var(Token *tok) {
+  Atom *a = get_atom(tok->atom);
   for (Scope *sc = scope; sc; sc = sc->parent) {
-    VarScope *sc2 = hashmap_get2(&sc->vars, tok->loc, tok->len);
+    VarScope *sc2 = hashmap_get3(&sc->vars, a->name, a->len, a->hash);
     if (sc2)
       return sc2;
   }
@@ -174,8 +177,9 @@ static VarScope *find_var(Token *tok) {
 }
 
 static Type *find_tag(Token *tok) {
+  Atom *a = get_atom(tok->atom);
   for (Scope *sc = scope; sc; sc = sc->parent) {
-    Type *ty = hashmap_get2(&sc->tags, tok->loc, tok->len);
+    Type *ty = hashmap_get3(&sc->tags, a->name, a->len, a->hash);
     if (ty)
       return ty;
   }
@@ -183,7 +187,9 @@ static Type *find_tag(Token *tok) {
 }
 
 static Node *new_node(NodeKind kind, Token *tok) {
-  Node *node = calloc(1, sizeof(Node));
+  Node *node = arena_calloc(&ast_arena, sizeof(Node));
+  count_alloc(MEM_NODE, sizeof(Node));
+  stats.nodes++;
   node->kind = kind;
   node->tok = tok;
   return node;
@@ -230,7 +236,9 @@ static Node *new_var_node(Obj *var, Token *tok) {
 
 Node *new_cast(Node *expr, Type *ty) {
   add_type(expr);
-  Node *node = calloc(1, sizeof(Node));
+  Node *node = arena_calloc(&ast_arena, sizeof(Node));
+  count_alloc(MEM_NODE, sizeof(Node));
+  stats.nodes++;
   node->kind = ND_CAST;
   node->tok = expr->tok;
   node->lhs = expr;
@@ -243,13 +251,14 @@ static Node *to_bool(Node *expr) {
 }
 
 static VarScope *push_scope(char *name) {
-  VarScope *sc = calloc(1, sizeof(VarScope));
+  VarScope *sc = arena_calloc(&ast_arena, sizeof(VarScope));
+  count_alloc(MEM_SCOPE, sizeof(VarScope));
   hashmap_put(&scope->vars, name, sc);
   return sc;
 }
 
 static Initializer *new_initializer(Type *ty, bool is_flexible) {
-  Initializer *init = calloc(1, sizeof(Initializer));
+  Initializer *init = arena_calloc(&ast_arena, sizeof(Initializer));
   init->ty = ty;
 
   if (ty->kind == TY_ARRAY) {
@@ -274,7 +283,7 @@ static Initializer *new_initializer(Type *ty, bool is_flexible) {
 
     for (Member *mem = ty->members; mem; mem = mem->next) {
       if (is_flexible && ty->is_flexible && !mem->next) {
-        Initializer *child = calloc(1, sizeof(Initializer));
+        Initializer *child = arena_calloc(&ast_arena, sizeof(Initializer));
         child->ty = mem->ty;
         child->is_flexible = true;
         init->children[mem->idx] = child;
@@ -289,7 +298,8 @@ static Initializer *new_initializer(Type *ty, bool is_flexible) {
 }
 
 static Obj *new_var(char *name, Type *ty) {
-  Obj *var = calloc(1, sizeof(Obj));
+  Obj *var = arena_calloc(&ast_arena, sizeof(Obj));
+  count_alloc(MEM_OBJ, sizeof(Obj));
   var->name = name;
   var->ty = ty;
   if (name)
@@ -312,9 +322,10 @@ static Obj *new_gvar(char *name, Type *ty) {
   return var;
 }
 
+static int unique_id;
+
 static char *new_unique_name(void) {
-  static int id = 0;
-  return format(".L..%d", id++);
+  return format(".L..%d", unique_id++);
 }
 
 static Obj *new_anon_gvar(Type *ty) {
@@ -339,7 +350,7 @@ static Obj *new_static_lvar(Type *ty) {
 static char *get_ident(Token *tok) {
   if (tok->kind != TK_IDENT)
     error_tok(tok, "expected an identifier");
-  return strndup(tok->loc, tok->len);
+  return get_atom(tok->atom)->name;
 }
 
 static Type *find_typedef(Token *tok) {
@@ -352,7 +363,8 @@ static Type *find_typedef(Token *tok) {
 }
 
 static void push_tag_scope(Token *tok, Type *ty) {
-  hashmap_put2(&scope->tags, tok->loc, tok->len, ty);
+  Atom *a = get_atom(tok->atom);
+  hashmap_put2(&scope->tags, a->name, a->len, ty);
 }
 
 static void chain_expr(Node **lhs, Node *rhs) {
@@ -360,16 +372,16 @@ static void chain_expr(Node **lhs, Node *rhs) {
     *lhs = !*lhs ? rhs : new_binary(ND_CHAIN, *lhs, rhs, rhs->tok);
 }
 
-static bool comma_list(Token **rest, Token **tok_rest, char *end, bool skip_comma) {
+static bool comma_list(Token **rest, Token **tok_rest, int end, bool skip_comma) {
   Token *tok = *tok_rest;
-  if (consume(rest, tok, end))
+  if (consume_atom(rest, tok, end))
     return false;
 
   if (skip_comma) {
-    tok = skip(tok, ",");
+    tok = skip_atom(tok, AT_COMMA);
 
     // curly brackets allow trailing comma
-    if (!strcmp(end, "}") && consume(rest, tok, "}"))
+    if (end == AT_RBRACE && consume_atom(rest, tok, AT_RBRACE))
       return false;
 
     *tok_rest = tok;
@@ -421,18 +433,18 @@ static Type *declspec(Token **rest, Token *tok, VarAttr *attr) {
 
   while (is_typename(tok)) {
     // Handle storage class specifiers.
-    if (equal(tok, "typedef") || equal(tok, "static") || equal(tok, "extern") ||
-        equal(tok, "inline") || equal(tok, "_Thread_local") || equal(tok, "__thread")) {
+    if (tok->atom == AT_TYPEDEF || tok->atom == AT_STATIC || tok->atom == AT_EXTERN ||
+        tok->atom == AT_INLINE || tok->atom == AT__THREAD_LOCAL || tok->atom == AT___THREAD) {
       if (!attr)
         error_tok(tok, "storage class specifier is not allowed in this context");
 
-      if (equal(tok, "typedef"))
+      if (tok->atom == AT_TYPEDEF)
         attr->is_typedef = true;
-      else if (equal(tok, "static"))
+      else if (tok->atom == AT_STATIC)
         attr->is_static = true;
-      else if (equal(tok, "extern"))
+      else if (tok->atom == AT_EXTERN)
         attr->is_extern = true;
-      else if (equal(tok, "inline"))
+      else if (tok->atom == AT_INLINE)
         attr->is_inline = true;
       else
         attr->is_tls = true;
@@ -446,26 +458,33 @@ static Type *declspec(Token **rest, Token *tok, VarAttr *attr) {
     }
 
     // These keywords are recognized but ignored.
-    if (consume(&tok, tok, "const") || consume(&tok, tok, "volatile") ||
-        consume(&tok, tok, "auto") || consume(&tok, tok, "register") ||
-        consume(&tok, tok, "restrict") || consume(&tok, tok, "__restrict") ||
-        consume(&tok, tok, "__restrict__") || consume(&tok, tok, "_Noreturn"))
+    switch (tok->atom) {
+    case AT_CONST:
+    case AT_VOLATILE:
+    case AT_AUTO:
+    case AT_REGISTER:
+    case AT_RESTRICT:
+    case AT___RESTRICT:
+    case AT___RESTRICT__:
+    case AT__NORETURN:
+      tok = tok->next;
       continue;
+    }
 
     // Handle user-defined types.
     Type *ty2 = find_typedef(tok);
-    if (equal(tok, "struct") || equal(tok, "union") || equal(tok, "enum") ||
-        equal(tok, "typeof") || equal(tok, "__typeof") || equal(tok, "__typeof__") || ty2) {
+    if (tok->atom == AT_STRUCT || tok->atom == AT_UNION || tok->atom == AT_ENUM ||
+        tok->atom == AT_TYPEOF || tok->atom == AT___TYPEOF || tok->atom == AT___TYPEOF__ || ty2) {
       if (counter)
         break;
 
-      if (equal(tok, "struct")) {
+      if (tok->atom == AT_STRUCT) {
         ty = struct_union_decl(&tok, tok->next, TY_STRUCT);
-      } else if (equal(tok, "union")) {
+      } else if (tok->atom == AT_UNION) {
         ty = struct_union_decl(&tok, tok->next, TY_UNION);
-      } else if (equal(tok, "enum")) {
+      } else if (tok->atom == AT_ENUM) {
         ty = enum_specifier(&tok, tok->next);
-      } else if (equal(tok, "typeof") || equal(tok, "__typeof") || equal(tok, "__typeof__")) {
+      } else if (tok->atom == AT_TYPEOF || tok->atom == AT___TYPEOF || tok->atom == AT___TYPEOF__) {
         ty = typeof_specifier(&tok, tok->next);
       } else {
         ty = ty2;
@@ -477,25 +496,25 @@ static Type *declspec(Token **rest, Token *tok, VarAttr *attr) {
     }
 
     // Handle built-in types.
-    if (equal(tok, "void"))
+    if (tok->atom == AT_VOID)
       counter += VOID;
-    else if (equal(tok, "_Bool"))
+    else if (tok->atom == AT__BOOL)
       counter += BOOL;
-    else if (equal(tok, "char"))
+    else if (tok->atom == AT_CHAR)
       counter += CHAR;
-    else if (equal(tok, "short"))
+    else if (tok->atom == AT_SHORT)
       counter += SHORT;
-    else if (equal(tok, "int"))
+    else if (tok->atom == AT_INT)
       counter += INT;
-    else if (equal(tok, "long"))
+    else if (tok->atom == AT_LONG)
       counter += LONG;
-    else if (equal(tok, "float"))
+    else if (tok->atom == AT_FLOAT)
       counter += FLOAT;
-    else if (equal(tok, "double"))
+    else if (tok->atom == AT_DOUBLE)
       counter += DOUBLE;
-    else if (equal(tok, "signed"))
+    else if (tok->atom == AT_SIGNED)
       counter |= SIGNED;
-    else if (equal(tok, "unsigned"))
+    else if (tok->atom == AT_UNSIGNED)
       counter |= UNSIGNED;
     else
       internal_error();
@@ -607,15 +626,16 @@ static Type *func_params_old_style(Token **rest, Token *tok, Type *fn_ty) {
                                      new_var_node(promoted, tok), tok));
       }
       chain_expr(&expr, compute_vla_size(ty, tok));
-    } while (comma_list(&tok, &tok, ";", true));
+    } while (comma_list(&tok, &tok, AT_SEMICOLON, true));
   }
   *rest = tok;
 
   Obj head = {0};
   Obj *cur = &head;
 
-  for (tok = start; comma_list(&tok, &tok, ")", cur != &head);) {
-    VarScope *sc = hashmap_get2(&fn_ty->scopes->vars, tok->loc, tok->len);
+  for (tok = start; comma_list(&tok, &tok, AT_RPAREN, cur != &head);) {
+    Atom *a = get_atom(tok->atom);
+    VarScope *sc = hashmap_get3(&fn_ty->scopes->vars, a->name, a->len, a->hash);
 
     Obj *nxt;
     if (!sc)
@@ -641,11 +661,11 @@ static Type *func_params_old_style(Token **rest, Token *tok, Type *fn_ty) {
 static Type *func_params(Token **rest, Token *tok, Type *ty) {
   Type *fn_ty = func_type(ty);
 
-  if (equal(tok, "...") && consume(rest, tok->next, ")")) {
+  if (tok->atom == AT_ELLIPSIS && consume_atom(rest, tok->next, AT_RPAREN)) {
     fn_ty->is_variadic = true;
     return fn_ty;
   }
-  if (equal(tok, "void") && consume(rest, tok->next, ")"))
+  if (tok->atom == AT_VOID && consume_atom(rest, tok->next, AT_RPAREN))
     return fn_ty;
 
   if (!is_typename(tok))
@@ -658,10 +678,10 @@ static Type *func_params(Token **rest, Token *tok, Type *ty) {
   enter_scope();
   fn_ty->scopes = scope;
 
-  while (comma_list(rest, &tok, ")", cur != &head)) {
-    if (equal(tok, "...")) {
+  while (comma_list(rest, &tok, AT_RPAREN, cur != &head)) {
+    if (tok->atom == AT_ELLIPSIS) {
       fn_ty->is_variadic = true;
-      *rest = skip(tok->next, ")");
+      *rest = skip_atom(tok->next, AT_RPAREN);
       break;
     }
 
@@ -692,9 +712,9 @@ static Type *func_params(Token **rest, Token *tok, Type *ty) {
 
 // array-dimensions = ("static" | "restrict")* const-expr? "]" type-suffix
 static Type *array_dimensions(Token **rest, Token *tok, Type *ty) {
-  if (consume(&tok, tok, "]") ||
-      (equal(tok, "*") && consume(&tok, tok->next, "]"))) {
-    if (equal(tok, "["))
+  if (consume_atom(&tok, tok, AT_RBRACKET) ||
+      (tok->atom == AT_STAR && consume_atom(&tok, tok->next, AT_RBRACKET))) {
+    if (tok->atom == AT_LBRACKET)
       ty = array_dimensions(&tok, tok->next, ty);
     *rest = tok;
     return array_of(ty, -1);
@@ -702,9 +722,9 @@ static Type *array_dimensions(Token **rest, Token *tok, Type *ty) {
 
   Node *expr = assign(&tok, tok);
   add_type(expr);
-  tok = skip(tok, "]");
+  tok = skip_atom(tok, AT_RBRACKET);
 
-  if (equal(tok, "["))
+  if (tok->atom == AT_LBRACKET)
     ty = array_dimensions(&tok, tok->next, ty);
   *rest = tok;
 
@@ -721,12 +741,12 @@ static Type *array_dimensions(Token **rest, Token *tok, Type *ty) {
 //             | "[" array-dimensions
 //             | ε
 static Type *type_suffix(Token **rest, Token *tok, Type *ty) {
-  if (equal(tok, "("))
+  if (tok->atom == AT_LPAREN)
     return func_params(rest, tok->next, ty);
 
-  if (consume(&tok, tok, "[")) {
-    while (equal(tok, "static") || equal(tok, "const") || equal(tok, "volatile") ||
-           equal(tok, "restrict") || equal(tok, "__restrict") || equal(tok, "__restrict__"))
+  if (consume_atom(&tok, tok, AT_LBRACKET)) {
+    while (tok->atom == AT_STATIC || tok->atom == AT_CONST || tok->atom == AT_VOLATILE ||
+           tok->atom == AT_RESTRICT || tok->atom == AT___RESTRICT || tok->atom == AT___RESTRICT__)
       tok = tok->next;
     return array_dimensions(rest, tok, ty);
   }
@@ -736,10 +756,10 @@ static Type *type_suffix(Token **rest, Token *tok, Type *ty) {
 
 // pointers = ("*" ("const" | "volatile" | "restrict")*)*
 static Type *pointers(Token **rest, Token *tok, Type *ty) {
-  while (consume(&tok, tok, "*")) {
+  while (consume_atom(&tok, tok, AT_STAR)) {
     ty = pointer_to(ty);
-    while (equal(tok, "const") || equal(tok, "volatile") || equal(tok, "restrict") ||
-           equal(tok, "__restrict") || equal(tok, "__restrict__"))
+    while (tok->atom == AT_CONST || tok->atom == AT_VOLATILE || tok->atom == AT_RESTRICT ||
+           tok->atom == AT___RESTRICT || tok->atom == AT___RESTRICT__)
       tok = tok->next;
   }
   *rest = tok;
@@ -750,15 +770,15 @@ Token *skip_paren(Token *tok) {
   int level = 0;
   Token *start = tok;
   for (;;) {
-    if (level == 0 && equal(tok, ")"))
+    if (level == 0 && tok->atom == AT_RPAREN)
       break;
 
     if (tok->kind == TK_EOF)
       error_tok(start, "unterminated list");
 
-    if (equal(tok, "("))
+    if (tok->atom == AT_LPAREN)
       level++;
-    else if (equal(tok, ")"))
+    else if (tok->atom == AT_RPAREN)
       level--;
 
     tok = tok->next;
@@ -769,8 +789,8 @@ Token *skip_paren(Token *tok) {
 static Type *declarator(Token **rest, Token *tok, Type *ty, Token **name_tok) {
   ty = pointers(&tok, tok, ty);
 
-  if (consume(&tok, tok, "(")) {
-    if (is_typename(tok) || equal(tok, ")"))
+  if (consume_atom(&tok, tok, AT_LPAREN)) {
+    if (is_typename(tok) || tok->atom == AT_RPAREN)
       return func_params(rest, tok, ty);
 
     ty = type_suffix(rest, skip_paren(tok), ty);
@@ -791,7 +811,7 @@ static Type *typename(Token **rest, Token *tok) {
 }
 
 static bool is_end(Token *tok) {
-  return equal(tok, "}") || (equal(tok, ",") && equal(tok->next, "}"));
+  return tok->atom == AT_RBRACE || (tok->atom == AT_COMMA && tok->next->atom == AT_RBRACE);
 }
 
 // enum-specifier = ident? "{" enum-list? "}"
@@ -808,7 +828,7 @@ static Type *enum_specifier(Token **rest, Token *tok) {
     tok = tok->next;
   }
 
-  if (tag && !equal(tok, "{")) {
+  if (tag && tok->atom != AT_LBRACE) {
     Type *ty = find_tag(tag);
     if (!ty)
       error_tok(tag, "unknown enum type");
@@ -818,16 +838,16 @@ static Type *enum_specifier(Token **rest, Token *tok) {
     return ty;
   }
 
-  tok = skip(tok, "{");
+  tok = skip_atom(tok, AT_LBRACE);
 
   // Read an enum-list.
   int val = 0;
   bool first = true;
-  for (; comma_list(rest, &tok, "}", !first); first = false) {
+  for (; comma_list(rest, &tok, AT_RBRACE, !first); first = false) {
     char *name = get_ident(tok);
     tok = tok->next;
 
-    if (equal(tok, "="))
+    if (tok->atom == AT_ASSIGN)
       val = const_expr(&tok, tok->next);
 
     VarScope *sc = push_scope(name);
@@ -842,7 +862,7 @@ static Type *enum_specifier(Token **rest, Token *tok) {
 
 // typeof-specifier = "(" (expr | typename) ")"
 static Type *typeof_specifier(Token **rest, Token *tok) {
-  tok = skip(tok, "(");
+  tok = skip_atom(tok, AT_LPAREN);
 
   Type *ty;
   if (is_typename(tok)) {
@@ -852,7 +872,7 @@ static Type *typeof_specifier(Token **rest, Token *tok) {
     add_type(node);
     ty = node->ty;
   }
-  *rest = skip(tok, ")");
+  *rest = skip_atom(tok, AT_RPAREN);
   return ty;
 }
 
@@ -895,7 +915,7 @@ static Node *declaration(Token **rest, Token *tok, Type *basety, VarAttr *attr)
   Node *expr = NULL;
 
   bool first = true;
-  for (; comma_list(rest, &tok, ";", !first); first = false) {
+  for (; comma_list(rest, &tok, AT_SEMICOLON, !first); first = false) {
     Token *name = NULL;
     Type *ty = declarator(&tok, tok, basety, &name);
     if (ty->kind == TY_FUNC) {
@@ -924,13 +944,13 @@ static Node *declaration(Token **rest, Token *tok, Type *basety, VarAttr *attr)
 
       push_scope(get_ident(name))->var = var;
 
-      if (equal(tok, "="))
+      if (tok->atom == AT_ASSIGN)
         gvar_initializer(&tok, tok->next, var);
       continue;
     }
 
     if (ty->kind == TY_VLA) {
-      if (equal(tok, "="))
+      if (tok->atom == AT_ASSIGN)
         error_tok(tok, "variable-sized object may not be initialized");
 
       // Variable length arrays (VLAs) are translated to alloca() calls.
@@ -946,7 +966,7 @@ static Node *declaration(Token **rest, Token *tok, Type *basety, VarAttr *attr)
     }
 
     Obj *var = new_lvar(get_ident(name), ty);
-    if (equal(tok, "="))
+    if (tok->atom == AT_ASSIGN)
       chain_expr(&expr, lvar_initializer(&tok, tok->next, var));
 
     if (var->ty->size < 0)
@@ -958,9 +978,9 @@ static Node *declaration(Token **rest, Token *tok, Type *basety, VarAttr *attr)
 }
 
 static Token *skip_excess_element(Token *tok) {
-  if (equal(tok, "{")) {
+  if (tok->atom == AT_LBRACE) {
     tok = skip_excess_element(tok->next);
-    return skip(tok, "}");
+    return skip_atom(tok, AT_RBRACE);
   }
 
   assign(&tok, tok);
@@ -970,25 +990,25 @@ static Token *skip_excess_element(Token *tok) {
 // string-initializer = string-literal
 static void string_initializer(Token *tok, Initializer *init) {
   if (init->is_flexible)
-    *init = *new_initializer(array_of(init->ty->base, tok->ty->array_len), false);
+    *init = *new_initializer(array_of(init->ty->base, tok->extra->ty->array_len), false);
 
-  int len = MIN(init->ty->array_len, tok->ty->array_len);
+  int len = MIN(init->ty->array_len, tok->extra->ty->array_len);
 
   switch (init->ty->base->size) {
   case 1: {
-    char *str = tok->str;
+    char *str = tok->extra->str;
     for (int i = 0; i < len; i++)
       init->children[i]->expr = new_num(str[i], tok);
     break;
   }
   case 2: {
-    uint16_t *str = (uint16_t *)tok->str;
+    uint16_t *str = (uint16_t *)tok->extra->str;
     for (int i = 0; i < len; i++)
       init->children[i]->expr = new_num(str[i], tok);
     break;
   }
   case 4: {
-    uint32_t *str = (uint32_t *)tok->str;
+    uint32_t *str = (uint32_t *)tok->extra->str;
     for (int i = 0; i < len; i++)
       init->children[i]->expr = new_num(str[i], tok);
     break;
@@ -999,8 +1019,8 @@ static void string_initializer(Token *tok, Initializer *init) {
 }
 
 static bool is_str_tok(Token **rest, Token *tok, Token **str_tok) {
-  if (equal(tok, "(") && is_str_tok(&tok, tok->next, str_tok) &&
-    consume(rest, tok, ")"))
+  if (tok->atom == AT_LPAREN && is_str_tok(&tok, tok->next, str_tok) &&
+    consume_atom(rest, tok, AT_RPAREN))
     return true;
 
   if (tok->kind == TK_STR) {
@@ -1041,7 +1061,7 @@ static void array_designator(Token **rest, Token *tok, Type *ty, int *begin, int
   if (*begin >= ty->array_len)
     error_tok(tok, "array designator index exceeds array bounds");
 
-  if (equal(tok, "...")) {
+  if (tok->atom == AT_ELLIPSIS) {
     *end = const_expr(&tok, tok->next);
     if (*end >= ty->array_len)
       error_tok(tok, "array designator index exceeds array bounds");
@@ -1051,7 +1071,7 @@ static void array_designator(Token **rest, Token *tok, Type *ty, int *begin, int
     *end = *begin;
   }
 
-  *rest = skip(tok, "]");
+  *rest = skip_atom(tok, AT_RBRACKET);
 }
 
 // struct-designator = "." ident
@@ -1069,7 +1089,7 @@ static Member *struct_designator(Token **rest, Token *tok, Type *ty) {
 
 // designation = ("[" const-expr "]" | "." ident)* "="? initializer
 static void designation(Token **rest, Token *tok, Initializer *init) {
-  if (equal(tok, "[")) {
+  if (tok->atom == AT_LBRACKET) {
     if (init->ty->kind != TY_ARRAY)
       error_tok(tok, "array index in non-array initializer");
 
@@ -1083,7 +1103,7 @@ static void designation(Token **rest, Token *tok, Initializer *init) {
     return;
   }
 
-  if (equal(tok, ".") && init->ty->kind == TY_STRUCT) {
+  if (tok->atom == AT_DOT && init->ty->kind == TY_STRUCT) {
     Member *mem = struct_designator(&tok, tok->next, init->ty);
     designation(&tok, tok, init->children[mem->idx]);
     init->expr = NULL;
@@ -1091,17 +1111,17 @@ static void designation(Token **rest, Token *tok, Initializer *init) {
     return;
   }
 
-  if (equal(tok, ".") && init->ty->kind == TY_UNION) {
+  if (tok->atom == AT_DOT && init->ty->kind == TY_UNION) {
     Member *mem = struct_designator(&tok, tok->next, init->ty);
     init->mem = mem;
     designation(rest, tok, init->children[mem->idx]);
     return;
   }
 
-  if (equal(tok, "."))
+  if (tok->atom == AT_DOT)
     error_tok(tok, "field name not in struct or union initializer");
 
-  if (equal(tok, "="))
+  if (tok->atom == AT_ASSIGN)
     tok = tok->next;
   initializer2(rest, tok, init);
 }
@@ -1114,12 +1134,12 @@ static int count_array_init_elements(Token *tok, Type *ty) {
 
   int i = 0, max = 0;
 
-  while (comma_list(&tok, &tok, "}", i)) {
-    if (equal(tok, "[")) {
+  while (comma_list(&tok, &tok, AT_RBRACE, i)) {
+    if (tok->atom == AT_LBRACKET) {
       i = const_expr(&tok, tok->next);
-      if (equal(tok, "..."))
+      if (tok->atom == AT_ELLIPSIS)
         i = const_expr(&tok, tok->next);
-      tok = skip(tok, "]");
+      tok = skip_atom(tok, AT_RBRACKET);
       designation(&tok, tok, dummy);
     } else {
       initializer2(&tok, tok, dummy);
@@ -1133,7 +1153,7 @@ static int count_array_init_elements(Token *tok, Type *ty) {
 
 // array-initializer1 = "{" initializer ("," initializer)* ","? "}"
 static void array_initializer1(Token **rest, Token *tok, Initializer *init) {
-  tok = skip(tok, "{");
+  tok = skip_atom(tok, AT_LBRACE);
 
   if (init->is_flexible) {
     int len = count_array_init_elements(tok, init->ty);
@@ -1142,8 +1162,8 @@ static void array_initializer1(Token **rest, Token *tok, Initializer *init) {
 
   int i = 0;
   bool first = true;
-  for (; comma_list(rest, &tok, "}", !first); first = false, i++) {
-    if (equal(tok, "[")) {
+  for (; comma_list(rest, &tok, AT_RBRACE, !first); first = false, i++) {
+    if (tok->atom == AT_LBRACKET) {
       int begin, end;
       array_designator(&tok, tok, init->ty, &begin, &end);
 
@@ -1171,9 +1191,9 @@ static void array_initializer2(Token **rest, Token *tok, Initializer *init, int
   for (; i < init->ty->array_len && !is_end(tok); i++) {
     Token *start = tok;
     if (i > 0)
-      tok = skip(tok, ",");
+      tok = skip_atom(tok, AT_COMMA);
 
-    if (equal(tok, "[") || equal(tok, ".")) {
+    if (tok->atom == AT_LBRACKET || tok->atom == AT_DOT) {
       *rest = start;
       return;
     }
@@ -1185,13 +1205,13 @@ static void array_initializer2(Token **rest, Token *tok, Initializer *init, int
 
 // struct-initializer1 = "{" initializer ("," initializer)* ","? "}"
 static void struct_initializer1(Token **rest, Token *tok, Initializer *init) {
-  tok = skip(tok, "{");
+  tok = skip_atom(tok, AT_LBRACE);
 
   Member *mem = init->ty->members;
 
   bool first = true;
-  for (; comma_list(rest, &tok, "}", !first); first = false) {
-    if (equal(tok, ".")) {
+  for (; comma_list(rest, &tok, AT_RBRACE, !first); first = false) {
+    if (tok->atom == AT_DOT) {
       mem = struct_designator(&tok, tok->next, init->ty);
       designation(&tok, tok, init->children[mem->idx]);
       mem = mem->next;
@@ -1215,10 +1235,10 @@ static void struct_initializer2(Token **rest, Token *tok, Initializer *init, Mem
     Token *start = tok;
 
     if (!first || post_desig)
-      tok = skip(tok, ",");
+      tok = skip_atom(tok, AT_COMMA);
     first = false;
 
-    if (equal(tok, "[") || equal(tok, ".")) {
+    if (tok->atom == AT_LBRACKET || tok->atom == AT_DOT) {
       *rest = start;
       return;
     }
@@ -1229,11 +1249,11 @@ static void struct_initializer2(Token **rest, Token *tok, Initializer *init, Mem
 }
 
 static void union_initializer(Token **rest, Token *tok, Initializer *init) {
-  tok = skip(tok, "{");
+  tok = skip_atom(tok, AT_LBRACE);
 
   bool first = true;
-  for (; comma_list(rest, &tok, "}", !first); first = false) {
-    if (equal(tok, ".")) {
+  for (; comma_list(rest, &tok, AT_RBRACE, !first); first = false) {
+    if (tok->atom == AT_DOT) {
       init->mem = struct_designator(&tok, tok->next, init->ty);
       designation(&tok, tok, init->children[init->mem->idx]);
       continue;
@@ -1255,8 +1275,8 @@ static void initializer2(Token **rest, Token *tok, Initializer *init) {
   if (init->ty->kind == TY_ARRAY && is_integer(init->ty->base)) {
     Token *start = tok;
     Token *str_tok;
-    if (equal(tok, "{") && is_str_tok(&tok, tok->next, &str_tok)) {
-      if (consume(rest, tok, "}")) {
+    if (tok->atom == AT_LBRACE && is_str_tok(&tok, tok->next, &str_tok)) {
+      if (consume_atom(rest, tok, AT_RBRACE)) {
         string_initializer(str_tok, init);
         return;
       }
@@ -1269,7 +1289,7 @@ static void initializer2(Token **rest, Token *tok, Initializer *init) {
   }
 
   if (init->ty->kind == TY_ARRAY) {
-    if (equal(tok, "{"))
+    if (tok->atom == AT_LBRACE)
       array_initializer1(rest, tok, init);
     else
       array_initializer2(rest, tok, init, 0);
@@ -1277,7 +1297,7 @@ static void initializer2(Token **rest, Token *tok, Initializer *init) {
   }
 
   if (init->ty->kind == TY_STRUCT) {
-    if (equal(tok, "{")) {
+    if (tok->atom == AT_LBRACE) {
       struct_initializer1(rest, tok, init);
       return;
     }
@@ -1300,7 +1320,7 @@ static void initializer2(Token **rest, Token *tok, Initializer *init) {
   }
 
   if (init->ty->kind == TY_UNION) {
-    if (equal(tok, "{")) {
+    if (tok->atom == AT_LBRACE) {
       union_initializer(rest, tok, init);
       return;
     }
@@ -1319,11 +1339,11 @@ static void initializer2(Token **rest, Token *tok, Initializer *init) {
     return;
   }
 
-  if (equal(tok, "{")) {
+  if (tok->atom == AT_LBRACE) {
     // An initializer for a scalar variable can be surrounded by
     // braces. E.g. `int x = {3};`. Handle that case.
     initializer2(&tok, tok->next, init);
-    *rest = skip(tok, "}");
+    *rest = skip_atom(tok, AT_RBRACE);
     return;
   }
 
@@ -1340,7 +1360,7 @@ static Initializer *initializer(Token **rest, Token *tok, Type *ty, Type **new_t
     Member head = {0};
     Member *cur = &head;
     for (Member *mem = ty->members; mem; mem = mem->next) {
-      Member *m = calloc(1, sizeof(Member));
+      Member *m = arena_calloc(&ast_arena, sizeof(Member));
       *m = *mem;
       cur = cur->next = m;
     }
@@ -1518,7 +1538,7 @@ write_gvar_data(Relocation *cur, Initializer *init, Type *ty, char *buf, int off
     return cur;
   }
 
-  Relocation *rel = calloc(1, sizeof(Relocation));
+  Relocation *rel = arena_calloc(&ast_arena, sizeof(Relocation));
   rel->offset = offset;
   rel->label = label;
   rel->addend = val;
@@ -1542,40 +1562,36 @@ static void gvar_initializer(Token **rest, Token *tok, Obj *var) {
 
 // Returns true if a given token represents a type.
 static bool is_typename(Token *tok) {
-  static HashMap map;
-
-  if (map.capacity == 0) {
-    static char *kw[] = {
-      "void", "_Bool", "char", "short", "int", "long", "struct", "union",
-      "typedef", "enum", "static", "extern", "signed", "unsigned",
-      "const", "volatile", "auto", "register", "restrict", "__restrict",
-      "__restrict__", "_Noreturn", "float", "double", "inline",
-      "_Thread_local", "__thread", "__typeof", "__typeof__"
-    };
-
-    for (int i = 0; i < sizeof(kw) / sizeof(*kw); i++)
-      hashmap_put(&map, kw[i], (void *)1);
-
+  switch (tok->atom) {
+  case AT_VOID: case AT__BOOL: case AT_CHAR: case AT_SHORT: case AT_INT:
+  case AT_LONG: case AT_STRUCT: case AT_UNION: case AT_TYPEDEF:
+  case AT_ENUM: case AT_STATIC: case AT_EXTERN: case AT_SIGNED:
+  case AT_UNSIGNED: case AT_CONST: case AT_VOLATILE: case AT_AUTO:
+  case AT_REGISTER: case AT_RESTRICT: case AT___RESTRICT:
+  case AT___RESTRICT__: case AT__NORETURN: case AT_FLOAT: case AT_DOUBLE:
+  case AT_INLINE: case AT__THREAD_LOCAL: case AT___THREAD:
+  case AT___TYPEOF: case AT___TYPEOF__:
+    return true;
+  case AT_TYPEOF:
     if (opt_std == STD_NONE || opt_std >= STD_C23)
-      hashmap_put(&map, "typeof", (void *)1);
+      return true;
   }
-
-  return hashmap_get2(&map, tok->loc, tok->len) || find_typedef(tok);
+  return find_typedef(tok);
 }
 
 static void static_assertion(Token **rest, Token *tok) {
-  tok = skip(tok, "(");
+  tok = skip_atom(tok, AT_LPAREN);
   int64_t result = const_expr(&tok, tok);
   if (!result)
     error_tok(tok, "static assertion failed");
 
-  if (equal(tok, ",")) {
+  if (tok->atom == AT_COMMA) {
     if (tok->next->kind != TK_STR)
       error_tok(tok, "expected string literal");
     tok = tok->next->next;
   }
-  tok = skip(tok, ")");
-  *rest = skip(tok, ";");
+  tok = skip_atom(tok, AT_RPAREN);
+  *rest = skip_atom(tok, AT_SEMICOLON);
 }
 
 // asm-stmt = "__asm__" ("volatile" | "inline")* "(" string-literal ")"
@@ -1583,17 +1599,17 @@ static Node *asm_stmt(Token **rest, Token *tok) {
   Node *node = new_node(ND_ASM, tok);
   tok = tok->next;
 
-  while (equal(tok, "volatile") || equal(tok, "inline"))
+  while (tok->atom == AT_VOLATILE || tok->atom == AT_INLINE)
     tok = tok->next;
 
-  tok = skip(tok, "(");
-  if (tok->kind != TK_STR || tok->ty->base->kind != TY_PCHAR)
+  tok = skip_atom(tok, AT_LPAREN);
+  if (tok->kind != TK_STR || tok->extra->ty->base->kind != TY_PCHAR)
     error_tok(tok, "expected string literal");
 
-  if (equal(tok->next, ")"))
-    node->asm_str = tok->str;
+  if (tok->next->atom == AT_RPAREN)
+    node->asm_str = tok->extra->str;
 
-  *rest = skip(skip_paren(tok->next), ";");
+  *rest = skip_atom(skip_paren(tok->next), AT_SEMICOLON);
   return node;
 }
 
@@ -1631,13 +1647,13 @@ static void loop_body(Token **rest, Token *tok, Node *node) {
 //      | "{" compound-stmt
 //      | expr-stmt
 static Node *stmt(Token **rest, Token *tok, bool chained) {
-  if (equal(tok, "return")) {
+  if (tok->atom == AT_RETURN) {
     Node *node = new_node(ND_RETURN, tok);
-    if (consume(rest, tok->next, ";"))
+    if (consume_atom(rest, tok->next, AT_SEMICOLON))
       return node;
 
     Node *exp = expr(&tok, tok->next);
-    *rest = skip(tok, ";");
+    *rest = skip_atom(tok, AT_SEMICOLON);
 
     add_type(exp);
     Type *ty = current_fn->ty->return_ty;
@@ -1648,26 +1664,26 @@ static Node *stmt(Token **rest, Token *tok, bool chained) {
     return node;
   }
 
-  if (equal(tok, "if")) {
+  if (tok->atom == AT_IF) {
     Node *node = new_node(ND_IF, tok);
-    tok = skip(tok->next, "(");
+    tok = skip_atom(tok->next, AT_LPAREN);
     node->cond = to_bool(expr(&tok, tok));
-    tok = skip(tok, ")");
+    tok = skip_atom(tok, AT_RPAREN);
     node->then = stmt(&tok, tok, true);
-    if (equal(tok, "else"))
+    if (tok->atom == AT_ELSE)
       node->els = stmt(&tok, tok->next, true);
     *rest = tok;
     return node;
   }
 
-  if (equal(tok, "switch")) {
+  if (tok->atom == AT_SWITCH) {
     Node *node = new_node(ND_SWITCH, tok);
-    tok = skip(tok->next, "(");
+    tok = skip_atom(tok->next, AT_LPAREN);
     node->cond = expr(&tok, tok);
     add_type(node->cond);
     if (!is_integer(node->cond->ty))
       error_tok(tok, "controlling expression not integer");
-    tok = skip(tok, ")");
+    tok = skip_atom(tok, AT_RPAREN);
 
     Node *sw = current_switch;
     current_switch = node;
@@ -1686,7 +1702,7 @@ static Node *stmt(Token **rest, Token *tok, bool chained) {
     return node;
   }
 
-  if (equal(tok, "case")) {
+  if (tok->atom == AT_CASE) {
     if (!current_switch)
       error_tok(tok, "stray case");
     if (current_vla != brk_vla)
@@ -1699,7 +1715,7 @@ static Node *stmt(Token **rest, Token *tok, bool chained) {
     int64_t end;
 
     // [GNU] Case ranges, e.g. "case 1 ... 5:"
-    if (equal(tok, "..."))
+    if (tok->atom == AT_ELLIPSIS)
       end = const_expr(&tok, tok->next);
     else
       end = begin;
@@ -1715,7 +1731,7 @@ static Node *stmt(Token **rest, Token *tok, bool chained) {
       ((cond_ty->is_unsigned && ((uint64_t)end < begin))))
       error_tok(tok, "empty case range specified");
 
-    tok = skip(tok, ":");
+    tok = skip_atom(tok, AT_COLON);
     if (chained)
       node->lhs = stmt(rest, tok, true);
     else
@@ -1727,7 +1743,7 @@ static Node *stmt(Token **rest, Token *tok, bool chained) {
     return node;
   }
 
-  if (equal(tok, "default")) {
+  if (tok->atom == AT_DEFAULT) {
     if (!current_switch)
       error_tok(tok, "stray default");
     if (current_vla != brk_vla)
@@ -1736,7 +1752,7 @@ static Node *stmt(Token **rest, Token *tok, bool chained) {
     Node *node = new_node(ND_CASE, tok);
     node->label = new_unique_name();
 
-    tok = skip(tok->next, ":");
+    tok = skip_atom(tok->next, AT_COLON);
     if (chained)
       node->lhs = stmt(rest, tok, true);
     else
@@ -1745,9 +1761,9 @@ static Node *stmt(Token **rest, Token *tok, bool chained) {
     return node;
   }
 
-  if (equal(tok, "for")) {
+  if (tok->atom == AT_FOR) {
     Node *node = new_node(ND_FOR, tok);
-    tok = skip(tok->next, "(");
+    tok = skip_atom(tok->next, AT_LPAREN);
 
     node->target_vla = current_vla;
     enter_tmp_scope();
@@ -1763,13 +1779,13 @@ static Node *stmt(Token **rest, Token *tok, bool chained) {
       node->init = expr_stmt(&tok, tok);
     }
 
-    if (!equal(tok, ";"))
+    if (tok->atom != AT_SEMICOLON)
       node->cond = to_bool(expr(&tok, tok));
-    tok = skip(tok, ";");
+    tok = skip_atom(tok, AT_SEMICOLON);
 
-    if (!equal(tok, ")"))
+    if (tok->atom != AT_RPAREN)
       node->inc = expr(&tok, tok);
-    tok = skip(tok, ")");
+    tok = skip_atom(tok, AT_RPAREN);
 
     loop_body(rest, tok, node);
 
@@ -1779,39 +1795,39 @@ static Node *stmt(Token **rest, Token *tok, bool chained) {
     return node;
   }
 
-  if (equal(tok, "while")) {
+  if (tok->atom == AT_WHILE) {
     Node *node = new_node(ND_FOR, tok);
-    tok = skip(tok->next, "(");
+    tok = skip_atom(tok->next, AT_LPAREN);
     node->cond = to_bool(expr(&tok, tok));
-    tok = skip(tok, ")");
+    tok = skip_atom(tok, AT_RPAREN);
 
     loop_body(rest, tok, node);
     return node;
   }
 
-  if (equal(tok, "do")) {
+  if (tok->atom == AT_DO) {
     Node *node = new_node(ND_DO, tok);
 
     loop_body(&tok, tok->next, node);
 
-    tok = skip(tok, "while");
-    tok = skip(tok, "(");
+    tok = skip_atom(tok, AT_WHILE);
+    tok = skip_atom(tok, AT_LPAREN);
     node->cond = to_bool(expr(&tok, tok));
-    tok = skip(tok, ")");
-    *rest = skip(tok, ";");
+    tok = skip_atom(tok, AT_RPAREN);
+    *rest = skip_atom(tok, AT_SEMICOLON);
     return node;
   }
 
   if (tok->kind == TK_KEYWORD &&
-    (equal(tok, "asm") || equal(tok, "__asm") || equal(tok, "__asm__")))
+    (tok->atom == AT_ASM || tok->atom == AT___ASM || tok->atom == AT___ASM__))
     return asm_stmt(rest, tok);
 
-  if (equal(tok, "goto")) {
-    if (equal(tok->next, "*")) {
+  if (tok->atom == AT_GOTO) {
+    if (tok->next->atom == AT_STAR) {
       // [GNU] `goto *ptr` jumps to the address specified by `ptr`.
       Node *node = new_node(ND_GOTO_EXPR, tok);
       node->lhs = expr(&tok, tok->next->next);
-      *rest = skip(tok, ";");
+      *rest = skip_atom(tok, AT_SEMICOLON);
       return node;
     }
 
@@ -1820,33 +1836,33 @@ static Node *stmt(Token **rest, Token *tok, bool chained) {
     node->goto_next = gotos;
     node->top_vla = current_vla;
     gotos = node;
-    *rest = skip(tok->next->next, ";");
+    *rest = skip_atom(tok->next->next, AT_SEMICOLON);
     return node;
   }
 
-  if (equal(tok, "break")) {
+  if (tok->atom == AT_BREAK) {
     if (!brk_label)
       error_tok(tok, "stray break");
     Node *node = new_node(ND_GOTO, tok);
     node->unique_label = brk_label;
     node->target_vla = brk_vla;
     node->top_vla = current_vla;
-    *rest = skip(tok->next, ";");
+    *rest = skip_atom(tok->next, AT_SEMICOLON);
     return node;
   }
 
-  if (equal(tok, "continue")) {
+  if (tok->atom == AT_CONTINUE) {
     if (!cont_label)
       error_tok(tok, "stray continue");
     Node *node = new_node(ND_GOTO, tok);
     node->unique_label = cont_label;
     node->target_vla = cont_vla;
     node->top_vla = current_vla;
-    *rest = skip(tok->next, ";");
+    *rest = skip_atom(tok->next, AT_SEMICOLON);
     return node;
   }
 
-  if (tok->kind == TK_IDENT && equal(tok->next, ":")) {
+  if (tok->kind == TK_IDENT && tok->next->atom == AT_COLON) {
     Node *node = new_node(ND_LABEL, tok);
     node->label = strndup(tok->loc, tok->len);
 
@@ -1862,7 +1878,7 @@ static Node *stmt(Token **rest, Token *tok, bool chained) {
     return node;
   }
 
-  if (equal(tok, "{"))
+  if (tok->atom == AT_LBRACE)
     return compound_stmt(rest, tok->next, ND_BLOCK);
 
   return expr_stmt(rest, tok);
@@ -1877,13 +1893,13 @@ static Node *compound_stmt(Token **rest, Token *tok, NodeKind kind) {
   node->target_vla = current_vla;
   enter_scope();
 
-  while (!equal(tok, "}")) {
+  while (tok->atom != AT_RBRACE) {
     if (equal(tok, "_Static_assert")) {
       static_assertion(&tok, tok->next);
       continue;
     }
 
-    if (is_typename(tok) && !equal(tok->next, ":")) {
+    if (is_typename(tok) && tok->next->atom != AT_COLON) {
       VarAttr attr = {0};
       Type *basety = declspec(&tok, tok, &attr);
 
@@ -1934,12 +1950,12 @@ static Node *compound_stmt(Token **rest, Token *tok, NodeKind kind) {
 
 // expr-stmt = expr? ";"
 static Node *expr_stmt(Token **rest, Token *tok) {
-  if (consume(rest, tok, ";"))
+  if (consume_atom(rest, tok, AT_SEMICOLON))
     return new_node(ND_BLOCK, tok);
 
   Node *node = new_node(ND_EXPR_STMT, tok);
   node->lhs = expr(&tok, tok);
-  *rest = skip(tok, ";");
+  *rest = skip_atom(tok, AT_SEMICOLON);
   return node;
 }
 
@@ -1947,7 +1963,7 @@ static Node *expr_stmt(Token **rest, Token *tok) {
 static Node *expr(Token **rest, Token *tok) {
   Node *node = assign(&tok, tok);
 
-  if (equal(tok, ","))
+  if (tok->atom == AT_COMMA)
     return new_binary(ND_COMMA, node, expr(rest, tok->next), tok);
 
   *rest = tok;
@@ -2261,37 +2277,37 @@ static Node *to_assign(Node *binary) {
 static Node *assign(Token **rest, Token *tok) {
   Node *node = conditional(&tok, tok);
 
-  if (equal(tok, "="))
+  if (tok->atom == AT_ASSIGN)
     return new_binary(ND_ASSIGN, node, assign(rest, tok->next), tok);
 
-  if (equal(tok, "+="))
+  if (tok->atom == AT_ADD_ASSIGN)
     return to_assign(new_add(node, assign(rest, tok->next), tok));
 
-  if (equal(tok, "-="))
+  if (tok->atom == AT_SUB_ASSIGN)
     return to_assign(new_sub(node, assign(rest, tok->next), tok));
 
-  if (equal(tok, "*="))
+  if (tok->atom == AT_MUL_ASSIGN)
     return to_assign(new_binary(ND_MUL, node, assign(rest, tok->next), tok));
 
-  if (equal(tok, "/="))
+  if (tok->atom == AT_DIV_ASSIGN)
     return to_assign(new_binary(ND_DIV, node, assign(rest, tok->next), tok));
 
-  if (equal(tok, "%="))
+  if (tok->atom == AT_MOD_ASSIGN)
     return to_assign(new_binary(ND_MOD, node, assign(rest, tok->next), tok));
 
-  if (equal(tok, "&="))
+  if (tok->atom == AT_AND_ASSIGN)
     return to_assign(new_binary(ND_BITAND, node, assign(rest, tok->next), tok));
 
-  if (equal(tok, "|="))
+  if (tok->atom == AT_OR_ASSIGN)
     return to_assign(new_binary(ND_BITOR, node, assign(rest, tok->next), tok));
 
-  if (equal(tok, "^="))
+  if (tok->atom == AT_XOR_ASSIGN)
     return to_assign(new_binary(ND_BITXOR, node, assign(rest, tok->next), tok));
 
-  if (equal(tok, "<<="))
+  if (tok->atom == AT_SHL_ASSIGN)
     return to_assign(new_binary(ND_SHL, node, assign(rest, tok->next), tok));
 
-  if (equal(tok, ">>=")) {
+  if (tok->atom == AT_SHR_ASSIGN) {
     add_type(node);
     if (node->ty->is_unsigned)
       return to_assign(new_binary(ND_SHR, node, assign(rest, tok->next), tok));
@@ -2307,12 +2323,12 @@ static Node *assign(Token **rest, Token *tok) {
 static Node *conditional(Token **rest, Token *tok) {
   Node *cond = log_or(&tok, tok);
 
-  if (!equal(tok, "?")) {
+  if (tok->atom != AT_QUESTION) {
     *rest = tok;
     return cond;
   }
 
-  if (equal(tok->next, ":")) {
+  if (tok->next->atom == AT_COLON) {
     // [GNU] Compile `a ?: b` as `tmp = a, tmp ? tmp : b`.
     add_type(cond);
     enter_tmp_scope();
@@ -2329,7 +2345,7 @@ static Node *conditional(Token **rest, Token *tok) {
   Node *node = new_node(ND_COND, tok);
   node->cond = to_bool(cond);
   node->then = expr(&tok, tok->next);
-  tok = skip(tok, ":");
+  tok = skip_atom(tok, AT_COLON);
   node->els = conditional(rest, tok);
   return node;
 }
@@ -2337,7 +2353,7 @@ static Node *conditional(Token **rest, Token *tok) {
 // logor = logand ("||" logand)*
 static Node *log_or(Token **rest, Token *tok) {
   Node *node = log_and(&tok, tok);
-  while (equal(tok, "||")) {
+  while (tok->atom == AT_LOGOR) {
     Token *start = tok;
     node = new_binary(ND_LOGOR, to_bool(node),
                       to_bool(log_and(&tok, tok->next)), start);
@@ -2349,7 +2365,7 @@ static Node *log_or(Token **rest, Token *tok) {
 // logand = bitor ("&&" bitor)*
 static Node *log_and(Token **rest, Token *tok) {
   Node *node = bit_or(&tok, tok);
-  while (equal(tok, "&&")) {
+  while (tok->atom == AT_LOGAND) {
     Token *start = tok;
     node = new_binary(ND_LOGAND, to_bool(node),
                       to_bool(bit_or(&tok, tok->next)), start);
@@ -2361,7 +2377,7 @@ static Node *log_and(Token **rest, Token *tok) {
 // bitor = bitxor ("|" bitxor)*
 static Node *bit_or(Token **rest, Token *tok) {
   Node *node = bit_xor(&tok, tok);
-  while (equal(tok, "|")) {
+  while (tok->atom == AT_OR) {
     Token *start = tok;
     node = new_binary(ND_BITOR, node, bit_xor(&tok, tok->next), start);
   }
@@ -2372,7 +2388,7 @@ static Node *bit_or(Token **rest, Token *tok) {
 // bitxor = bitand ("^" bitand)*
 static Node *bit_xor(Token **rest, Token *tok) {
   Node *node = bit_and(&tok, tok);
-  while (equal(tok, "^")) {
+  while (tok->atom == AT_XOR) {
     Token *start = tok;
     node = new_binary(ND_BITXOR, node, bit_and(&tok, tok->next), start);
   }
@@ -2383,7 +2399,7 @@ static Node *bit_xor(Token **rest, Token *tok) {
 // bitand = equality ("&" equality)*
 static Node *bit_and(Token **rest, Token *tok) {
   Node *node = equality(&tok, tok);
-  while (equal(tok, "&")) {
+  while (tok->atom == AT_AMP) {
     Token *start = tok;
     node = new_binary(ND_BITAND, node, equality(&tok, tok->next), start);
   }
@@ -2398,12 +2414,12 @@ static Node *equality(Token **rest, Token *tok) {
   for (;;) {
     Token *start = tok;
 
-    if (equal(tok, "==")) {
+    if (tok->atom == AT_EQ) {
       node = new_binary(ND_EQ, node, relational(&tok, tok->next), start);
       continue;
     }
 
-    if (equal(tok, "!=")) {
+    if (tok->atom == AT_NE) {
       node = new_binary(ND_NE, node, relational(&tok, tok->next), start);
       continue;
     }
@@ -2420,22 +2436,22 @@ static Node *relational(Token **rest, Token *tok) {
   for (;;) {
     Token *start = tok;
 
-    if (equal(tok, "<")) {
+    if (tok->atom == AT_LT) {
       node = new_binary(ND_LT, node, shift(&tok, tok->next), start);
       continue;
     }
 
-    if (equal(tok, "<=")) {
+    if (tok->atom == AT_LE) {
       node = new_binary(ND_LE, node, shift(&tok, tok->next), start);
       continue;
     }
 
-    if (equal(tok, ">")) {
+    if (tok->atom == AT_GT) {
       node = new_binary(ND_GT, node, shift(&tok, tok->next), start);
       continue;
     }
 
-    if (equal(tok, ">=")) {
+    if (tok->atom == AT_GE) {
       node = new_binary(ND_GE, node, shift(&tok, tok->next), start);
       continue;
     }
@@ -2452,12 +2468,12 @@ static Node *shift(Token **rest, Token *tok) {
   for (;;) {
     Token *start = tok;
 
-    if (equal(tok, "<<")) {
+    if (tok->atom == AT_SHL) {
       node = new_binary(ND_SHL, node, add(&tok, tok->next), start);
       continue;
     }
 
-    if (equal(tok, ">>")) {
+    if (tok->atom == AT_SHR) {
       add_type(node);
       if (node->ty->is_unsigned)
         node = new_binary(ND_SHR, node, add(&tok, tok->next), start);
@@ -2543,12 +2559,12 @@ static Node *add(Token **rest, Token *tok) {
   for (;;) {
     Token *start = tok;
 
-    if (equal(tok, "+")) {
+    if (tok->atom == AT_PLUS) {
       node = new_add(node, mul(&tok, tok->next), start);
       continue;
     }
 
-    if (equal(tok, "-")) {
+    if (tok->atom == AT_MINUS) {
       node = new_sub(node, mul(&tok, tok->next), start);
       continue;
     }
@@ -2565,17 +2581,17 @@ static Node *mul(Token **rest, Token *tok) {
   for (;;) {
     Token *start = tok;
 
-    if (equal(tok, "*")) {
+    if (tok->atom == AT_STAR) {
       node = new_binary(ND_MUL, node, cast(&tok, tok->next), start);
       continue;
     }
 
-    if (equal(tok, "/")) {
+    if (tok->atom == AT_SLASH) {
       node = new_binary(ND_DIV, node, cast(&tok, tok->next), start);
       continue;
     }
 
-    if (equal(tok, "%")) {
+    if (tok->atom == AT_PERCENT) {
       node = new_binary(ND_MOD, node, cast(&tok, tok->next), start);
       continue;
     }
@@ -2587,13 +2603,13 @@ static Node *mul(Token **rest, Token *tok) {
 
 // cast = "(" type-name ")" cast | unary
 static Node *cast(Token **rest, Token *tok) {
-  if (equal(tok, "(") && is_typename(tok->next)) {
+  if (tok->atom == AT_LPAREN && is_typename(tok->next)) {
     Token *start = tok;
     Type *ty = typename(&tok, tok->next);
-    tok = skip(tok, ")");
+    tok = skip_atom(tok, AT_RPAREN);
 
     // compound literal
-    if (equal(tok, "{"))
+    if (tok->atom == AT_LBRACE)
       return unary(rest, start);
 
     // type cast
@@ -2610,13 +2626,13 @@ static Node *cast(Token **rest, Token *tok) {
 //       | "&&" ident
 //       | postfix
 static Node *unary(Token **rest, Token *tok) {
-  if (equal(tok, "+"))
+  if (tok->atom == AT_PLUS)
     return new_unary(ND_POS, cast(rest, tok->next), tok);
 
-  if (equal(tok, "-"))
+  if (tok->atom == AT_MINUS)
     return new_unary(ND_NEG, cast(rest, tok->next), tok);
 
-  if (equal(tok, "&")) {
+  if (tok->atom == AT_AMP) {
     Node *lhs = cast(rest, tok->next);
     add_type(lhs);
     if (is_bitfield(lhs))
@@ -2624,7 +2640,7 @@ static Node *unary(Token **rest, Token *tok) {
     return new_unary(ND_ADDR, lhs, tok);
   }
 
-  if (equal(tok, "*")) {
+  if (tok->atom == AT_STAR) {
     // [https://www.sigbus.info/n1570#6.5.3.2p4] This is an oddity
     // in the C spec, but dereferencing a function shouldn't do
     // anything. If foo is a function, `*foo`, `**foo` or `*****foo`
@@ -2636,22 +2652,22 @@ static Node *unary(Token **rest, Token *tok) {
     return new_unary(ND_DEREF, node, tok);
   }
 
-  if (equal(tok, "!"))
+  if (tok->atom == AT_NOT)
     return new_unary(ND_NOT, to_bool(cast(rest, tok->next)), tok);
 
-  if (equal(tok, "~"))
+  if (tok->atom == AT_TILDE)
     return new_unary(ND_BITNOT, cast(rest, tok->next), tok);
 
   // Read ++i as i+=1
-  if (equal(tok, "++"))
+  if (tok->atom == AT_INC)
     return to_assign(new_add(unary(rest, tok->next), new_num(1, tok), tok));
 
   // Read --i as i-=1
-  if (equal(tok, "--"))
+  if (tok->atom == AT_DEC)
     return to_assign(new_sub(unary(rest, tok->next), new_num(1, tok), tok));
 
   // [GNU] labels-as-values
-  if (equal(tok, "&&")) {
+  if (tok->atom == AT_LOGAND) {
     Node *node = new_node(ND_LABEL_VAL, tok);
     node->label = get_ident(tok->next);
     node->goto_next = gotos;
@@ -2669,7 +2685,7 @@ static void struct_members(Token **rest, Token *tok, Type *ty) {
   Member head = {0};
   Member *cur = &head;
 
-  while (!equal(tok, "}")) {
+  while (tok->atom != AT_RBRACE) {
     if (equal(tok, "_Static_assert")) {
       static_assertion(&tok, tok->next);
       continue;
@@ -2680,8 +2696,8 @@ static void struct_members(Token **rest, Token *tok, Type *ty) {
 
     // Anonymous struct member
     if ((basety->kind == TY_STRUCT || basety->kind == TY_UNION) &&
-        consume(&tok, tok, ";")) {
-      Member *mem = calloc(1, sizeof(Member));
+        consume_atom(&tok, tok, AT_SEMICOLON)) {
+      Member *mem = arena_calloc(&ast_arena, sizeof(Member));
       mem->ty = basety;
       cur = cur->next = mem;
       continue;
@@ -2689,8 +2705,8 @@ static void struct_members(Token **rest, Token *tok, Type *ty) {
 
     // Regular struct members
     bool first = true;
-    for (; comma_list(&tok, &tok, ";", !first); first = false) {
-      Member *mem = calloc(1, sizeof(Member));
+    for (; comma_list(&tok, &tok, AT_SEMICOLON, !first); first = false) {
+      Member *mem = arena_calloc(&ast_arena, sizeof(Member));
       Token *name = NULL;
       mem->ty = declarator(&tok, tok, basety, &name);
       mem->name = name;
@@ -2699,7 +2715,7 @@ static void struct_members(Token **rest, Token *tok, Type *ty) {
         if (t->kind == TY_VLA)
           error_tok(tok, "members cannot be of variably-modified type");
 
-      if (consume(&tok, tok, ":")) {
+      if (consume_atom(&tok, tok, AT_COLON)) {
         mem->is_bitfield = true;
         mem->bit_width = const_expr(&tok, tok);
         if (mem->bit_width < 0)
@@ -2724,7 +2740,8 @@ static void struct_members(Token **rest, Token *tok, Type *ty) {
 }
 
 static void attr_packed(Token *tok, Type *ty) {
-  for (Token *lst = tok->attr_next; lst; lst = lst->attr_next) {
+  Token *lst = tok->extra ? tok->extra->attr_next : NULL;
+  for (; lst; lst = lst->extra->attr_next) {
     if (equal(lst, "packed") || equal(lst, "__packed__")) {
       ty->is_packed = true;
       continue;
@@ -2744,7 +2761,7 @@ static Type *struct_union_decl(Token **rest, Token *tok, TypeKind kind) {
     tok = tok->next;
   }
 
-  if (tag && !equal(tok, "{")) {
+  if (tag && tok->atom != AT_LBRACE) {
     *rest = tok;
 
     Type *ty2 = find_tag(tag);
@@ -2754,7 +2771,7 @@ static Type *struct_union_decl(Token **rest, Token *tok, TypeKind kind) {
     push_tag_scope(tag, ty);
     return ty;
   }
-  tok = skip(tok, "{");
+  tok = skip_atom(tok, AT_LBRACE);
 
   // Construct a struct object.
   struct_members(&tok, tok, ty);
@@ -2770,7 +2787,8 @@ static Type *struct_union_decl(Token **rest, Token *tok, TypeKind kind) {
   if (!tag)
     return ty;
 
-  Type *ty2 = hashmap_get2(&scope->tags, tag->loc, tag->len);
+  Atom *a = get_atom(tag->atom);
+  Type *ty2 = hashmap_get3(&scope->tags, a->name, a->len, a->hash);
   if (ty2) {
     *ty2 = *ty;
     return ty2;
@@ -2946,27 +2964,27 @@ static Node *postfix(Token **rest, Token *tok) {
   Node *node = primary(&tok, tok);
 
   for (;;) {
-    if (equal(tok, "(")) {
+    if (tok->atom == AT_LPAREN) {
       node = funcall(&tok, tok->next, node);
       continue;
     }
 
-    if (equal(tok, "[")) {
+    if (tok->atom == AT_LBRACKET) {
       // x[y] is short for *(x+y)
       Token *start = tok;
       Node *idx = expr(&tok, tok->next);
-      tok = skip(tok, "]");
+      tok = skip_atom(tok, AT_RBRACKET);
       node = new_unary(ND_DEREF, new_add(node, idx, start), start);
       continue;
     }
 
-    if (equal(tok, ".")) {
+    if (tok->atom == AT_DOT) {
       node = struct_ref(node, tok->next);
       tok = tok->next->next;
       continue;
     }
 
-    if (equal(tok, "->")) {
+    if (tok->atom == AT_ARROW) {
       // x->y is short for (*x).y
       node = new_unary(ND_DEREF, node, tok);
       node = struct_ref(node, tok->next);
@@ -2974,13 +2992,13 @@ static Node *postfix(Token **rest, Token *tok) {
       continue;
     }
 
-    if (equal(tok, "++")) {
+    if (tok->atom == AT_INC) {
       node = new_inc_dec(node, tok, 1);
       tok = tok->next;
       continue;
     }
 
-    if (equal(tok, "--")) {
+    if (tok->atom == AT_DEC) {
       node = new_inc_dec(node, tok, -1);
       tok = tok->next;
       continue;
@@ -3007,7 +3025,7 @@ static Node *funcall(Token **rest, Token *tok, Node *fn) {
 
   enter_tmp_scope();
 
-  while (comma_list(rest, &tok, ")", cur != &head)) {
+  while (comma_list(rest, &tok, AT_RPAREN, cur != &head)) {
     Node *arg = assign(&tok, tok);
     add_type(arg);
 
@@ -3059,13 +3077,13 @@ static Node *funcall(Token **rest, Token *tok, Node *fn) {
 static Node *primary(Token **rest, Token *tok) {
   Token *start = tok;
 
-  if (equal(tok, "(") && is_typename(tok->next)) {
+  if (tok->atom == AT_LPAREN && is_typename(tok->next)) {
     // Compound literal
     Token *start = tok;
     Type *ty = typename(&tok, tok->next);
     if (ty->kind == TY_VLA)
       error_tok(tok, "compound literals cannot be VLA");
-    tok = skip(tok, ")");
+    tok = skip_atom(tok, AT_RPAREN);
 
     if (scope->parent == NULL) {
       Obj *var = new_anon_gvar(ty);
@@ -3086,26 +3104,26 @@ static Node *primary(Token **rest, Token *tok) {
     return new_binary(ND_CHAIN, lhs, rhs, start);
   }
 
-  if (equal(tok, "(") && equal(tok->next, "{")) {
+  if (tok->atom == AT_LPAREN && tok->next->atom == AT_LBRACE) {
     if (scope->parent == NULL)
       error_tok(tok, "statement expresssion at file scope");
 
     Node *node = compound_stmt(&tok, tok->next->next, ND_STMT_EXPR);
-    *rest = skip(tok, ")");
+    *rest = skip_atom(tok, AT_RPAREN);
     return node;
   }
 
-  if (equal(tok, "(")) {
+  if (tok->atom == AT_LPAREN) {
     Node *node = expr(&tok, tok->next);
-    *rest = skip(tok, ")");
+    *rest = skip_atom(tok, AT_RPAREN);
     return node;
   }
 
-  if (equal(tok, "sizeof")) {
+  if (tok->atom == AT_SIZEOF) {
     Type *ty;
-    if (equal(tok->next, "(") && is_typename(tok->next->next)) {
+    if (tok->next->atom == AT_LPAREN && is_typename(tok->next->next)) {
       ty = typename(&tok, tok->next->next);
-      *rest = skip(tok, ")");
+      *rest = skip_atom(tok, AT_RPAREN);
     } else {
       Node *node = unary(rest, tok->next);
       add_type(node);
@@ -3129,48 +3147,48 @@ static Node *primary(Token **rest, Token *tok) {
     return new_ulong(ty->size, start);
   }
 
-  if (equal(tok, "_Alignof")) {
-    tok = skip(tok->next, "(");
+  if (tok->atom == AT__ALIGNOF) {
+    tok = skip_atom(tok->next, AT_LPAREN);
     if (!is_typename(tok))
       error_tok(tok, "expected type name");
     Type *ty = typename(&tok, tok);
     while (ty->kind == TY_VLA || ty->kind == TY_ARRAY)
       ty = ty->base;
-    *rest = skip(tok, ")");
+    *rest = skip_atom(tok, AT_RPAREN);
     return new_ulong(ty->align, tok);
   }
 
   if (equal(tok, "__builtin_alloca")) {
     Node *node = new_node(ND_ALLOCA, tok);
-    tok = skip(tok->next, "(");
+    tok = skip_atom(tok->next, AT_LPAREN);
     node->lhs = assign(&tok, tok);
-    *rest = skip(tok, ")");
+    *rest = skip_atom(tok, AT_RPAREN);
     node->ty = pointer_to(ty_void);
     return node;
   }
 
   if (equal(tok, "__builtin_constant_p")) {
     Node *node = new_node(ND_NUM, tok);
-    tok = skip(tok->next, "(");
+    tok = skip_atom(tok->next, AT_LPAREN);
     node->val = is_const_expr(expr(&tok, tok), NULL);
     node->ty = ty_int;
-    *rest = skip(tok, ")");
+    *rest = skip_atom(tok, AT_RPAREN);
     return node;
   }
 
   if (equal(tok, "__builtin_expect")) {
-    tok = skip(tok->next, "(");
+    tok = skip_atom(tok->next, AT_LPAREN);
     Node *node = new_cast(assign(&tok, tok), ty_long);
-    tok = skip(tok, ",");
+    tok = skip_atom(tok, AT_COMMA);
     assign(&tok, tok);
-    *rest = skip(tok, ")");
+    *rest = skip_atom(tok, AT_RPAREN);
     return node;
   }
 
   if (equal(tok, "__builtin_offsetof")) {
-    tok = skip(tok->next, "(");
+    tok = skip_atom(tok->next, AT_LPAREN);
     Type *ty = typename(&tok, tok);
-    tok = skip(tok, ",");
+    tok = skip_atom(tok, AT_COMMA);
 
     Node *node = NULL;
     int offset = 0;
@@ -3182,7 +3200,7 @@ static Node *primary(Token **rest, Token *tok) {
         ty = mem->ty;
       } while (!mem->name);
 
-      for (; ty->base && consume(&tok, tok, "["); tok = skip(tok, "]")) {
+      for (; ty->base && consume_atom(&tok, tok, AT_LBRACKET); tok = skip_atom(tok, AT_RBRACKET)) {
         ty = ty->base;
         Node *expr = conditional(&tok, tok);
         int64_t val;
@@ -3195,9 +3213,9 @@ static Node *primary(Token **rest, Token *tok) {
         else
           node = new_binary(ND_ADD, node, new_binary(ND_MUL, expr, new_long(ty->size, tok), tok), tok);
       }
-    } while (consume(&tok, tok, "."));
+    } while (consume_atom(&tok, tok, AT_DOT));
 
-    *rest = skip(tok, ")");
+    *rest = skip_atom(tok, AT_RPAREN);
     if (!node)
       return new_ulong(offset, tok);
     return new_binary(ND_ADD, node, new_ulong(offset, tok), tok);
@@ -3205,44 +3223,44 @@ static Node *primary(Token **rest, Token *tok) {
 
   if (equal(tok, "__builtin_va_start")) {
     Node *node = new_node(ND_VA_START, tok);
-    tok = skip(tok->next, "(");
+    tok = skip_atom(tok->next, AT_LPAREN);
     node->lhs = conditional(&tok, tok);
-    if (equal(tok, ","))
+    if (tok->atom == AT_COMMA)
       assign(&tok, tok->next);
-    *rest = skip(tok, ")");
+    *rest = skip_atom(tok, AT_RPAREN);
     return node;
   }
 
   if (equal(tok, "__builtin_va_copy")) {
     Node *node = new_node(ND_VA_COPY, tok);
-    tok = skip(tok->next, "(");
+    tok = skip_atom(tok->next, AT_LPAREN);
     node->lhs = conditional(&tok, tok);
-    tok = skip(tok, ",");
+    tok = skip_atom(tok, AT_COMMA);
     node->rhs = conditional(&tok, tok);
-    *rest = skip(tok, ")");
+    *rest = skip_atom(tok, AT_RPAREN);
     return node;
   }
 
   if (equal(tok, "__builtin_va_end")) {
-    tok = skip(tok->next, "(");
+    tok = skip_atom(tok->next, AT_LPAREN);
     Node *node = conditional(&tok, tok);
-    *rest = skip(tok, ")");
+    *rest = skip_atom(tok, AT_RPAREN);
     return node;
   }
 
   if (equal(tok, "__builtin_va_arg")) {
     Node *node = new_node(ND_VA_ARG, tok);
-    tok = skip(tok->next, "(");
+    tok = skip_atom(tok->next, AT_LPAREN);
 
     Node *ap_arg = conditional(&tok, tok);
     add_type(ap_arg);
     node->lhs = ap_arg;
-    tok = skip(tok, ",");
+    tok = skip_atom(tok, AT_COMMA);
 
     node->var = new_lvar(NULL, typename(&tok, tok));
     node->ty = node->var->ty;
     chain_expr(&node, new_var_node(node->var, tok));
-    *rest = skip(tok, ")");
+    *rest = skip_atom(tok, AT_RPAREN);
     return node;
   }
 
@@ -3280,7 +3298,8 @@ static Node *primary(Token **rest, Token *tok) {
     // [GNU] __FUNCTION__ is yet another name of __func__.
     if (current_fn && (equal(tok, "__func__") || equal(tok, "__FUNCTION__"))) {
       char *name = current_fn->name;
-      VarScope *vsc = calloc(1, sizeof(VarScope));
+      VarScope *vsc = arena_calloc(&ast_arena, sizeof(VarScope));
+      count_alloc(MEM_SCOPE, sizeof(VarScope));
       vsc->var = new_static_lvar(array_of(ty_pchar, strlen(name) + 1));
       vsc->var->init_data = name;
       hashmap_put(&current_fn->ty->scopes->vars, "__func__", vsc);
@@ -3288,7 +3307,7 @@ static Node *primary(Token **rest, Token *tok) {
       return new_var_node(vsc->var, tok);
     }
 
-    if (equal(tok->next, "("))
+    if (tok->next->atom == AT_LPAREN)
       error_tok(tok, "implicit declaration of a function");
     error_tok(tok, "undefined variable");
   }
@@ -3296,11 +3315,11 @@ static Node *primary(Token **rest, Token *tok) {
   if (tok->kind == TK_STR) {
     Obj *var;
     if (!current_fn)
-      var = new_anon_gvar(tok->ty);
+      var = new_anon_gvar(tok->extra->ty);
     else
-      var = new_static_lvar(tok->ty);
+      var = new_static_lvar(tok->extra->ty);
 
-    var->init_data = tok->str;
+    var->init_data = tok->extra->str;
     *rest = tok->next;
     Node *n = new_var_node(var, tok);
     add_type(n);
@@ -3312,14 +3331,14 @@ static Node *primary(Token **rest, Token *tok) {
 
   if (tok->kind == TK_NUM) {
     Node *node;
-    if (is_flonum(tok->ty)) {
+    if (is_flonum(tok->extra->ty)) {
       node = new_node(ND_NUM, tok);
-      node->fval = tok->fval;
+      node->fval = tok->extra->fval;
     } else {
-      node = new_num(tok->val, tok);
+      node = new_num(tok->extra->val, tok);
     }
 
-    node->ty = tok->ty;
+    node->ty = tok->extra->ty;
     *rest = tok->next;
     return node;
   }
@@ -3330,7 +3349,7 @@ static Node *primary(Token **rest, Token *tok) {
 static Node *parse_typedef(Token **rest, Token *tok, Type *basety) {
   Node *node = NULL;
   bool first = true;
-  for (; comma_list(rest, &tok, ";", !first); first = false) {
+  for (; comma_list(rest, &tok, AT_SEMICOLON, !first); first = false) {
     Token *name = NULL;
     Type *ty = declarator(&tok, tok, basety, &name);
     if (!name)
@@ -3444,7 +3463,7 @@ static void func_definition(Token **rest, Token *tok, Type *ty, VarAttr *attr, T
 
 static Token *global_declaration(Token *tok, Type *basety, VarAttr *attr) {
   bool first = true;
-  for (; comma_list(&tok, &tok, ";", !first); first = false) {
+  for (; comma_list(&tok, &tok, AT_SEMICOLON, !first); first = false) {
     Token *name = NULL;
     Type *ty = declarator(&tok, tok, basety, &name);
 
@@ -3452,7 +3471,7 @@ static Token *global_declaration(Token *tok, Type *basety, VarAttr *attr) {
       if (!name)
         error_tok(tok, "function name omitted");
 
-      if (equal(tok, "{")) {
+      if (tok->atom == AT_LBRACE) {
         if (!first || scope->parent)
           error_tok(tok, "function definition is not allowed here");
         func_definition(&tok, tok, ty, attr, name);
@@ -3466,7 +3485,7 @@ static Token *global_declaration(Token *tok, Type *basety, VarAttr *attr) {
       error_tok(tok, "variable name omitted");
 
     bool is_definition = !attr->is_extern;
-    if (!is_definition && equal(tok, "="))
+    if (!is_definition && tok->atom == AT_ASSIGN)
       is_definition = true;
 
     VarScope *sc = find_var(name);
@@ -3486,7 +3505,7 @@ static Token *global_declaration(Token *tok, Type *basety, VarAttr *attr) {
     var->is_static = attr->is_static;
     var->is_tls = attr->is_tls;
 
-    if (equal(tok, "="))
+    if (tok->atom == AT_ASSIGN)
       gvar_initializer(&tok, tok->next, var);
     else if (is_definition && !attr->is_tls)
       var->is_tentative = true;
@@ -3494,6 +3513,12 @@ static Token *global_declaration(Token *tok, Type *basety, VarAttr *attr) {
   return tok;
 }
 
+// Reset the parser for the next translation unit.
+void reset_parse(void) {
+  scope = arena_calloc(&ast_arena, sizeof(Scope));
+  unique_id = 0;
+}
+
 // program = (typedef | function-definition | global-variable)*
 Obj *parse(Token *tok) {
   globals = NULL;
@@ -0,0 +1,465 @@
+// This file implements precompiled headers.
+//
+// Compiling a header, i.e. a file ending in .h or one given after
+// `-x c-header`, writes `<header>.pch` instead of an object file. It
+// contains the preprocessed tokens of the header together with the
+// preprocessor state the header leaves behind: the macros it defined
+// or undefined, the #pragma once and include guard tables and the
+// value of __COUNTER__. When the header is later given as the first
+// -include option, cc1 loads that file instead of reading, tokenizing
+// and preprocessing the header and everything it includes.
+//
+// Declarations are not saved in parsed form. The parser runs over the
+// loaded tokens as if they came from the header, so the result is the
+// same as without a precompiled header.
+//
+// A precompiled header is used only if it was written by the same
+// compiler binary with the same predefined macros, include paths and
+// language options, and if none of the files it was made from has
+// changed since. Otherwise the header is included as usual.
+//
+// The file is written under a temporary name and renamed into place,
+// and its size is recorded after the key. A precompiled header that is
+// being replaced, or one that has been cut short, is never half read.
+
+#include "widcc.h"
+
+#define PCH_MAGIC "widcc pch 2\n"
+
+static char *key;
+static size_t keylen;
+
+// Files referred to by the saved tokens, and the lengths of their
+// contents
+static File **files;
+static size_t *file_lens;
+static int nfiles;
+
+// The origin of the last token written or read. Tokens expanded from
+// the same macro come in runs, so an origin is written only when it
+// changes.
+static Token *last_origin;
+
+// The buffer being read
+static char *pch_path;
+static char *pos;
+static char *buf_end;
+
+void pch_write_int(FILE *out, int64_t val) {
+  fwrite(&val, sizeof(val), 1, out);
+}
+
+// Strings are written with a terminating '\0' so that the reader
+// can use them in place.
+void pch_write_str(FILE *out, char *s, int len) {
+  pch_write_int(out, len);
+  fwrite(s, 1, len, out);
+  fputc('\0', out);
+}
+
+int64_t pch_read_int(void) {
+  if (buf_end - pos < sizeof(int64_t))
+    error("%s: invalid precompiled header", pch_path);
+  int64_t val;
+  memcpy(&val, pos, sizeof(val));
+  pos += sizeof(val);
+  return val;
+}
+
+char *pch_read_str(void) {
+  int64_t len = pch_read_int();
+  if (len < 0 || buf_end - pos < len + 1)
+    error("%s: invalid precompiled header", pch_path);
+  char *s = pos;
+  pos += len + 1;
+  return s;
+}
+
+// The key identifies the compiler and the state cc1 is in before it
+// reads the header. It has to be computed before the header changes
+// the macro table.
+static void make_key(int nincludes) {
+  FILE *out = open_memstream(&key, &keylen);
+  fputs(PCH_MAGIC, out);
+  write_compiler_id(out);
+  pch_write_int(out, opt_std);
+  pch_write_int(out, ty_pchar->is_unsigned);
+  pch_write_int(out, nincludes);
+  for (int i = 0; i < include_paths.len; i++)
+    pch_write_str(out, include_paths.data[i], strlen(include_paths.data[i]));
+  pch_write_int(out, -1);
+  write_macro_config(out);
+  fclose(out);
+}
+
+// Called before a header to be precompiled is preprocessed.
+// `nincludes` is the number of -include files preceding it.
+void begin_pch(int nincludes) {
+  save_macros();
+  make_key(nincludes);
+}
+
+//
+// Writer
+//
+
+static int add_file(File *file) {
+  files = realloc(files, sizeof(File *) * (nfiles + 1));
+  file_lens = realloc(file_lens, sizeof(size_t) * (nfiles + 1));
+  files[nfiles] = file;
+  file_lens[nfiles] = file->contents ? strlen(file->contents) : 0;
+  return nfiles++;
+}
+
+static int find_file(File *file) {
+  static int last;
+  if (last < nfiles && files[last] == file)
+    return last;
+  for (int i = 0; i < nfiles; i++)
+    if (files[i] == file)
+      return last = i;
+  return last = add_file(file);
+}
+
+static void write_loc(FILE *out, Token *tok) {
+  File *file = tok->file;
+  int idx = find_file(file);
+
+  // Most tokens point into a source file, but some are made up on
+  // the fly, e.g. by `##`, and their text lives elsewhere. Such text
+  // is saved as a file of its own.
+  char *p = file->contents;
+  if (!p || tok->loc < p || tok->loc + tok->len > p + file_lens[idx]) {
+    File *file2 = new_file(file->name, file->file_no, strndup(tok->loc, tok->len));
+    file2->display_file = file->display_file;
+    file2->line_delta = file->line_delta;
+    pch_write_int(out, add_file(file2));
+    pch_write_int(out, 0);
+    return;
+  }
+
+  pch_write_int(out, idx);
+  pch_write_int(out, tok->loc - p);
+}
+
+static int type_index(Token *tok, Type *ty) {
+  Type *types[] = {ty_pchar, ty_ushort, ty_int, ty_uint, ty_long};
+  for (int i = 0; i < sizeof(types) / sizeof(*types); i++)
+    if (types[i] == ty)
+      return i;
+  error_tok(tok, "cannot save this token in a precompiled header");
+}
+
+static void write_token(FILE *out, Token *tok) {
+  pch_write_int(out, tok->kind);
+  write_loc(out, tok);
+  pch_write_int(out, tok->len);
+  pch_write_int(out, tok->line_no);
+  pch_write_int(out, tok->at_bol | tok->has_space << 1 | tok->dont_expand << 2);
+
+  if (tok->kind == TK_STR) {
+    pch_write_int(out, type_index(tok, tok->extra->ty->base));
+    pch_write_int(out, tok->extra->ty->array_len);
+    pch_write_str(out, tok->extra->str, tok->extra->ty->size);
+  } else if (tok->kind == TK_NUM) {
+    pch_write_int(out, type_index(tok, tok->extra->ty));
+    pch_write_int(out, tok->extra->val);
+  }
+
+  if (!tok->origin) {
+    pch_write_int(out, 0);
+  } else if (tok->origin == last_origin) {
+    pch_write_int(out, 1);
+  } else {
+    pch_write_int(out, 2);
+    last_origin = tok->origin;
+    write_token(out, tok->origin);
+  }
+}
+
+// Writes a list of tokens up to and including the EOF token.
+void pch_write_tokens(FILE *out, Token *tok) {
+  for (;; tok = tok->next) {
+    write_token(out, tok);
+    if (tok->kind == TK_EOF)
+      return;
+  }
+}
+
+// Write tokens that have been preprocessed by preprocess() along with
+// the state of the preprocessor.
+void write_pch(char *path, Token *tok) {
+  File **inputs = get_input_files();
+  for (int i = 0; inputs[i]; i++)
+    add_file(inputs[i]);
+  int ninputs = nfiles;
+
+  char *body;
+  size_t bodylen;
+  FILE *out = open_memstream(&body, &bodylen);
+  pch_write_tokens(out, tok);
+  write_pch_state(out);
+  fclose(out);
+
+  char *tmp = format("%s.%d.tmp", path, (int)getpid());
+  out = fopen(tmp, "w");
+  if (!out)
+    error("cannot open output file: %s: %s", tmp, strerror(errno));
+  fwrite(key, 1, keylen, out);
+
+  // The file size, which is filled in at the end
+  pch_write_int(out, 0);
+
+  // The files a precompiled header depends on
+
+  for (int i = 0; i < ninputs; i++) {
+    if (files[i]->non_input)
+      continue;
+
+    struct stat st;
+    if (stat(files[i]->name, &st))
+      error("%s: %s", files[i]->name, strerror(errno));
+    pch_write_int(out, 1);
+    pch_write_str(out, files[i]->name, strlen(files[i]->name));
+    pch_write_int(out, st.st_dev);
+    pch_write_int(out, st.st_ino);
+    pch_write_int(out, st.st_size);
+    pch_write_int(out, st.st_mtim.tv_sec);
+    pch_write_int(out, st.st_mtim.tv_nsec);
+  }
+  pch_write_int(out, 0);
+
+  // Files referred to by tokens. Looking up display files may add
+  // more files to the table.
+  int *display = NULL;
+  for (int i = 0; i < nfiles; i++) {
+    int idx = find_file(files[i]->display_file);
+    display = realloc(display, sizeof(int) * (i + 1));
+    display[i] = idx;
+  }
+
+  pch_write_int(out, ninputs);
+  pch_write_int(out, nfiles);
+  for (int i = 0; i < nfiles; i++) {
+    File *file = files[i];
+    pch_write_str(out, file->name, strlen(file->name));
+    pch_write_int(out, file->file_no);
+    pch_write_int(out, !!file->contents);
+    if (file->contents)
+      pch_write_str(out, file->contents, file_lens[i]);
+    pch_write_int(out, display[i]);
+    pch_write_int(out, file->line_delta);
+    pch_write_int(out, file->non_input);
+  }
+
+  fwrite(body, 1, bodylen, out);
+  free(body);
+
+  long size = ftell(out);
+  fseek(out, keylen, SEEK_SET);
+  pch_write_int(out, size);
+
+  if (fclose(out) || rename(tmp, path)) {
+    unlink(tmp);
+    error("cannot write output file: %s: %s", path, strerror(errno));
+  }
+}
+
+//
+// Reader
+//
+
+static char *read_whole_file(char *path, size_t *len) {
+  int fd = open(path, O_RDONLY);
+  if (fd == -1)
+    return NULL;
+
+  struct stat st;
+  if (fstat(fd, &st)) {
+    close(fd);
+    return NULL;
+  }
+
+  char *buf = malloc(st.st_size);
+  size_t n = 0;
+  while (n < st.st_size) {
+    ssize_t r = read(fd, buf + n, st.st_size - n);
+    if (r <= 0)
+      break;
+    n += r;
+  }
+  close(fd);
+
+  if (n != st.st_size) {
+    free(buf);
+    return NULL;
+  }
+  *len = n;
+  return buf;
+}
+
+// Returns true if none of the files the header was made from has
+// changed.
+static bool check_deps(void) {
+  while (pch_read_int()) {
+    char *name = pch_read_str();
+    struct stat st;
+    if (stat(name, &st))
+      return false;
+    if (pch_read_int() != st.st_dev || pch_read_int() != st.st_ino ||
+        pch_read_int() != st.st_size || pch_read_int() != st.st_mtim.tv_sec ||
+        pch_read_int() != st.st_mtim.tv_nsec)
+      return false;
+  }
+  return true;
+}
+
+static void read_files(void) {
+  int ninputs = pch_read_int();
+  nfiles = pch_read_int();
+  if (nfiles < ninputs)
+    error("%s: invalid precompiled header", pch_path);
+
+  int *display = calloc(nfiles, sizeof(int));
+  files = calloc(nfiles, sizeof(File *));
+  file_lens = calloc(nfiles, sizeof(size_t));
+
+  for (int i = 0; i < nfiles; i++) {
+    char *name = pch_read_str();
+    int file_no = pch_read_int();
+    char *contents = NULL;
+    if (pch_read_int()) {
+      contents = pch_read_str();
+      file_lens[i] = strlen(contents);
+    }
+    display[i] = pch_read_int();
+    int line_delta = pch_read_int();
+    bool non_input = pch_read_int();
+
+    // Files that were read while making the precompiled header are
+    // registered in the same order, so that they get the same file
+    // numbers as before.
+    if (i < ninputs) {
+      files[i] = add_input_file(name, contents, non_input);
+      if (files[i]->file_no != file_no)
+        error("%s: precompiled header must be the first input", pch_path);
+    } else {
+      files[i] = new_file(name, file_no, contents);
+    }
+    files[i]->line_delta = line_delta;
+  }
+
+  for (int i = 0; i < nfiles; i++) {
+    if (display[i] < 0 || display[i] >= nfiles)
+      error("%s: invalid precompiled header", pch_path);
+    files[i]->display_file = files[display[i]];
+  }
+  free(display);
+}
+
+static Token *read_token(void) {
+  Token *tok = arena_calloc(&token_arena, sizeof(Token));
+  count_alloc(MEM_TOKEN, sizeof(Token));
+
+  tok->kind = pch_read_int();
+  int64_t idx = pch_read_int();
+  int64_t off = pch_read_int();
+  tok->len = pch_read_int();
+  if (idx < 0 || idx >= nfiles || !files[idx]->contents ||
+      off < 0 || tok->len < 0 || off + tok->len > file_lens[idx])
+    error("%s: invalid precompiled header", pch_path);
+  tok->file = files[idx];
+  tok->loc = tok->file->contents + off;
+  tok->line_no = pch_read_int();
+
+  int flags = pch_read_int();
+  tok->at_bol = flags & 1;
+  tok->has_space = flags & 2;
+  tok->dont_expand = flags & 4;
+
+  if (tok->kind == TK_IDENT || tok->kind == TK_PUNCT)
+    tok->atom = intern(tok->loc, tok->len);
+
+  Type *types[] = {ty_pchar, ty_ushort, ty_int, ty_uint, ty_long};
+  if (tok->kind == TK_STR || tok->kind == TK_NUM) {
+    int64_t ty = pch_read_int();
+    if (ty < 0 || ty >= sizeof(types) / sizeof(*types))
+      error("%s: invalid precompiled header", pch_path);
+
+    TokenExtra *x = new_extra(tok);
+    if (tok->kind == TK_STR) {
+      x->ty = string_type(types[ty], pch_read_int());
+      x->str = pch_read_str();
+    } else {
+      x->ty = types[ty];
+      x->val = pch_read_int();
+    }
+  }
+
+  switch (pch_read_int()) {
+  case 0:
+    break;
+  case 1:
+    tok->origin = last_origin;
+    break;
+  default:
+    last_origin = read_token();
+    tok->origin = last_origin;
+  }
+  return tok;
+}
+
+// Reads a list of tokens written by pch_write_tokens().
+Token *pch_read_tokens(void) {
+  Token head = {0};
+  Token *cur = &head;
+  do {
+    cur = cur->next = read_token();
+  } while (cur->kind != TK_EOF);
+  return head.next;
+}
+
+// Loads the precompiled header for a given header file if there is
+// a usable one. The returned tokens stand for the built-in
+// declarations as well as the header. Like tokenize(), the last token
+// before EOF is returned in `end`.
+Token *read_pch(char *header, Token **end) {
+  pch_path = format("%s.pch", header);
+
+  size_t len;
+  char *buf = read_whole_file(pch_path, &len);
+  if (!buf)
+    return NULL;
+
+  make_key(0);
+  if (len < keylen + sizeof(int64_t) || memcmp(buf, key, keylen)) {
+    free(buf);
+    return NULL;
+  }
+
+  pos = buf + keylen;
+  buf_end = buf + len;
+  if (pch_read_int() != len || !check_deps()) {
+    free(buf);
+    return NULL;
+  }
+
+  read_files();
+  Token *tok = pch_read_tokens();
+
+  // The tokens have been preprocessed already. Make sure that the
+  // preprocessor passes them through as they are.
+  *end = NULL;
+  for (Token *t = tok; t->kind != TK_EOF; t = t->next) {
+    *end = t;
+    if (t->kind == TK_IDENT)
+      t->dont_expand = true;
+    else if (t->kind == TK_PUNCT && t->atom == AT_HASH)
+      t->at_bol = false;
+  }
+
+  read_pch_state();
+  if (pos != buf_end)
+    error("%s: invalid precompiled header", pch_path);
+  return tok;
+}
@@ -16,6 +16,7 @@
 // the next token following its expansion ("stop_tok") is reached.
 
 #include "widcc.h"
+#include <dirent.h>
 
 typedef struct MacroParam MacroParam;
 struct MacroParam {
@@ -23,14 +24,48 @@ struct MacroParam {
   char *name;
 };
 
-typedef struct MacroArg MacroArg;
-struct MacroArg {
-  MacroArg *next;
-  char *name;
-  bool is_va_args;
+typedef struct {
   bool omit_comma;
   Token *tok;
   Token *expanded;
+} MacroArg;
+
+// The body of a function-like macro is compiled into operations when
+// the macro is defined, so that an expansion doesn't have to look for
+// parameters, `#` and `##` by name. Parameters are numbered from 0 in
+// order. A variadic argument comes last.
+typedef enum {
+  OP_TOKEN,     // Copy `tok`
+  OP_PARAM,     // Insert an argument
+  OP_STRINGIZE, // `#` and an argument
+  OP_PASTE,     // `##` and `rhs`
+  OP_PASTE_ARG, // `##` and an argument
+  OP_COMMA_VA,  // `,` of `, ## __VA_ARGS__`, which is followed by the argument
+  OP_ERROR,     // Report `msg` at `tok`
+  OP_END,       // `tok` is the EOF token
+} MacroOpKind;
+
+typedef struct MacroOp MacroOp;
+struct MacroOp {
+  MacroOpKind kind;
+  Token *tok;
+  MacroOp *next;
+
+  // The argument, which is the parameter at index `slot` or, if
+  // `va_opt` is set, __VA_OPT__(...) whose contents are the operations
+  // from `va_opt` to `va_opt_end`. For __VA_OPT__, `slot` is the
+  // variadic parameter's index or -1.
+  int slot;
+  MacroOp *va_opt;
+  MacroOp *va_opt_end;
+  bool raw; // The argument is an operand of a following `##`
+
+  // The right-hand side of `##`, and where to continue instead of
+  // `next` if the left-hand side is a placemarker
+  Token *rhs;
+  MacroOp *alt;
+
+  char *msg;
 };
 
 typedef Token *macro_handler_fn(Token *);
@@ -43,7 +78,9 @@ struct Macro {
   Macro *locked_next;
   MacroParam *params;
   char *va_args_name;
+  int nargs;
   Token *body;
+  MacroOp *ops;
   macro_handler_fn *handler;
 };
 
@@ -54,6 +91,10 @@ struct CondIncl {
   enum { IN_THEN, IN_ELIF, IN_ELSE } ctx;
   Token *tok;
   bool included;
+
+  // If this conditional may guard the whole file, the macro that
+  // controls it
+  char *guard_name;
 };
 
 // A linked list of locked macros. Since macro nesting happens in
@@ -62,16 +103,31 @@ struct CondIncl {
 static Macro *locked_macros;
 
 static HashMap macros;
+static HashMap saved_macros;
 static CondIncl *cond_incl;
 static HashMap pragma_once;
-static int include_next_idx;
 static HashMap include_guards;
 
+// The multiple-include optimization: a file whose contents are all
+// inside "#ifndef X ... #endif" or "#if !defined(X) ... #endif" need
+// not be read again while X is defined. Only #pragma lines and null
+// directives may precede the #ifndef, and nothing but the end of the
+// file may follow the #endif. `mi_file` is the file that has just
+// been entered and has not been disqualified yet.
+static File *mi_file;
+
+// Files that have been included, for -H
+static File **included_files;
+static int included_files_len;
+
+// Maps the path of a file found in include_paths to the index of the
+// include path plus one, so that #include_next knows where to resume.
+static HashMap include_path_idx;
+
 static Token *preprocess2(Token *tok);
 static Macro *find_macro(Token *tok);
 static bool expand_macro(Token **rest, Token *tok);
 static Token *directives(Token **cur, Token *start);
-static Token *subst(Token *tok, MacroArg *args);
 static bool is_supported_attr(Token *tok);
 
 static bool is_hash(Token *tok) {
@@ -90,7 +146,8 @@ static Token *skip_line(Token *tok) {
 }
 
 static Token *copy_token(Token *tok) {
-  Token *t = calloc(1, sizeof(Token));
+  Token *t = arena_calloc(&token_arena, sizeof(Token));
+  count_alloc(MEM_TOKEN, sizeof(Token));
   *t = *tok;
   t->next = NULL;
   return t;
@@ -99,6 +156,7 @@ static Token *copy_token(Token *tok) {
 static Token *new_eof(Token *tok) {
   Token *t = copy_token(tok);
   t->kind = TK_EOF;
+  t->atom = AT_NONE;
   t->len = 0;
   t->at_bol = true;
   return t;
@@ -106,6 +164,7 @@ static Token *new_eof(Token *tok) {
 
 static Token *to_eof(Token *tok) {
   tok->kind = TK_EOF;
+  tok->atom = AT_NONE;
   tok->len = 0;
   tok->at_bol = true;
   return tok;
@@ -114,6 +173,7 @@ static Token *to_eof(Token *tok) {
 static Token *new_pmark(Token *tok){
   Token *t = copy_token(tok);
   t->kind = TK_PMARK;
+  t->atom = AT_NONE;
   t->len = 0;
   return t;
 }
@@ -139,6 +199,10 @@ static void pop_macro_lock_until(Token *tok, Token *end) {
 
 static Token *skip_cond_incl2(Token *tok) {
   while (tok->kind != TK_EOF) {
+    if (tok->kind == TK_LAZY) {
+      tok = skip_cond_lazy(tok, true);
+      continue;
+    }
     if (is_hash(tok) &&
         (equal(tok->next, "if") || equal(tok->next, "ifdef") ||
          equal(tok->next, "ifndef"))) {
@@ -156,6 +220,10 @@ static Token *skip_cond_incl2(Token *tok) {
 // Nested `#if` and `#endif` are skipped.
 static Token *skip_cond_incl(Token *tok) {
   while (tok->kind != TK_EOF) {
+    if (tok->kind == TK_LAZY) {
+      tok = skip_cond_lazy(tok, false);
+      continue;
+    }
     if (is_hash(tok) &&
         (equal(tok->next, "if") || equal(tok->next, "ifdef") ||
          equal(tok->next, "ifndef"))) {
@@ -256,8 +324,18 @@ static Token *new_num_token(int val, Token *tmpl) {
 
 static void to_int_token(Token *tok, int64_t val) {
   tok->kind = TK_NUM;
-  tok->val = val;
-  tok->ty = ty_int;
+  TokenExtra *x = new_extra(tok);
+  x->val = val;
+  x->ty = ty_int;
+}
+
+// Same as to_int_token(tok, val) but without allocating.
+static void to_bool_token(Token *tok, bool val) {
+  static TokenExtra extras[2];
+  extras[val].val = val;
+  extras[val].ty = ty_int;
+  tok->kind = TK_NUM;
+  tok->extra = &extras[val];
 }
 
 static Token *read_const_expr(Token *tok) {
@@ -279,7 +357,7 @@ static Token *read_const_expr(Token *tok) {
       if (tok->kind != TK_IDENT)
         error_tok(start, "macro name must be an identifier");
 
-      to_int_token(start, !!find_macro(tok));
+      to_bool_token(start, find_macro(tok));
       cur = cur->next = start;
       tok = tok->next;
       if (has_paren)
@@ -287,12 +365,6 @@ static Token *read_const_expr(Token *tok) {
       continue;
     }
 
-    // Replace remaining non-macro identifiers with "0" before
-    // evaluating a constant expression. For example, `#if foo` is
-    // equivalent to `#if 0` if foo is not defined.
-    if (tok->kind == TK_IDENT)
-      to_int_token(tok, 0);
-
     cur = cur->next = tok;
     tok = tok->next;
   }
@@ -303,6 +375,201 @@ static Token *read_const_expr(Token *tok) {
   return head.next;
 }
 
+// #if expressions are evaluated by a precedence climbing evaluator
+// that works on tokens and allocates nothing. As C requires, values
+// are either intmax_t or uintmax_t. If an expression has anything
+// unusual, e.g. a floating-point number, or is invalid or divides by
+// zero, we fall back to the C parser, which handles the odd cases and
+// reports errors.
+typedef struct {
+  int64_t val;
+  bool is_unsigned;
+} PPValue;
+
+static bool pp_cond(Token **rest, Token *tok, PPValue *v, bool active);
+
+static bool is_punct(Token *tok, int atom) {
+  return tok->kind == TK_PUNCT && tok->atom == atom;
+}
+
+static bool pp_primary(Token **rest, Token *tok, PPValue *v, bool active) {
+  Type *ty;
+
+  switch (tok->kind) {
+  case TK_IDENT:
+    // Identifiers that are not macros are 0. For example, `#if foo`
+    // is equivalent to `#if 0` if foo is not defined.
+    *v = (PPValue){0, false};
+    *rest = tok->next;
+    return true;
+  case TK_NUM:
+    if (!is_integer(tok->extra->ty))
+      return false;
+    *v = (PPValue){tok->extra->val, tok->extra->ty->is_unsigned};
+    *rest = tok->next;
+    return true;
+  case TK_PP_NUM:
+    if (!read_pp_int(tok, &v->val, &ty))
+      return false;
+    v->is_unsigned = ty->is_unsigned;
+    *rest = tok->next;
+    return true;
+  }
+
+  if (!is_punct(tok, AT_LPAREN) || !pp_cond(&tok, tok->next, v, active) ||
+      !is_punct(tok, AT_RPAREN))
+    return false;
+  *rest = tok->next;
+  return true;
+}
+
+static bool pp_unary(Token **rest, Token *tok, PPValue *v, bool active) {
+  if (tok->kind != TK_PUNCT)
+    return pp_primary(rest, tok, v, active);
+
+  switch (tok->atom) {
+  case AT_PLUS:
+    return pp_unary(rest, tok->next, v, active);
+  case AT_MINUS:
+    if (!pp_unary(rest, tok->next, v, active))
+      return false;
+    v->val = -(uint64_t)v->val;
+    return true;
+  case AT_TILDE:
+    if (!pp_unary(rest, tok->next, v, active))
+      return false;
+    v->val = ~v->val;
+    return true;
+  case AT_NOT:
+    if (!pp_unary(rest, tok->next, v, active))
+      return false;
+    *v = (PPValue){!v->val, false};
+    return true;
+  }
+  return pp_primary(rest, tok, v, active);
+}
+
+static int pp_prec(Token *tok) {
+  if (tok->kind != TK_PUNCT)
+    return 0;
+
+  switch (tok->atom) {
+  case AT_STAR: case AT_SLASH: case AT_PERCENT: return 10;
+  case AT_PLUS: case AT_MINUS: return 9;
+  case AT_SHL: case AT_SHR: return 8;
+  case AT_LT: case AT_GT: case AT_LE: case AT_GE: return 7;
+  case AT_EQ: case AT_NE: return 6;
+  case AT_AMP: return 5;
+  case AT_XOR: return 4;
+  case AT_OR: return 3;
+  case AT_LOGAND: return 2;
+  case AT_LOGOR: return 1;
+  }
+  return 0;
+}
+
+// Computes `lhs op rhs` into lhs. An operand that is not evaluated,
+// such as the right-hand side of `0 && x`, must not fail.
+static bool pp_binop(int op, PPValue *lhs, PPValue rhs, bool active) {
+  // The usual arithmetic conversions
+  bool u = lhs->is_unsigned || rhs.is_unsigned;
+  uint64_t a = lhs->val;
+  uint64_t b = rhs.val;
+
+  switch (op) {
+  case AT_STAR: lhs->val = a * b; break;
+  case AT_PLUS: lhs->val = a + b; break;
+  case AT_MINUS: lhs->val = a - b; break;
+  case AT_AMP: lhs->val = a & b; break;
+  case AT_XOR: lhs->val = a ^ b; break;
+  case AT_OR: lhs->val = a | b; break;
+  case AT_SLASH:
+  case AT_PERCENT:
+    if (b == 0 || (!u && lhs->val == INT64_MIN && rhs.val == -1)) {
+      if (active)
+        return false;
+      lhs->val = 0;
+    } else if (u) {
+      lhs->val = (op == AT_SLASH) ? a / b : a % b;
+    } else {
+      lhs->val = (op == AT_SLASH) ? lhs->val / rhs.val : lhs->val % rhs.val;
+    }
+    break;
+  case AT_SHL:
+  case AT_SHR:
+    // The result has the type of the left-hand side.
+    if (b >= 64) {
+      if (active)
+        return false;
+      lhs->val = 0;
+    } else if (op == AT_SHL) {
+      lhs->val = a << b;
+    } else {
+      lhs->val = lhs->is_unsigned ? (int64_t)(a >> b) : lhs->val >> b;
+    }
+    return true;
+  case AT_LT: *lhs = (PPValue){u ? a < b : lhs->val < rhs.val, false}; return true;
+  case AT_GT: *lhs = (PPValue){u ? a > b : lhs->val > rhs.val, false}; return true;
+  case AT_LE: *lhs = (PPValue){u ? a <= b : lhs->val <= rhs.val, false}; return true;
+  case AT_GE: *lhs = (PPValue){u ? a >= b : lhs->val >= rhs.val, false}; return true;
+  case AT_EQ: *lhs = (PPValue){a == b, false}; return true;
+  case AT_NE: *lhs = (PPValue){a != b, false}; return true;
+  case AT_LOGAND: *lhs = (PPValue){a && b, false}; return true;
+  case AT_LOGOR: *lhs = (PPValue){a || b, false}; return true;
+  }
+  lhs->is_unsigned = u;
+  return true;
+}
+
+// Parses binary operators whose precedence is `min_prec` or higher.
+static bool pp_binary(Token **rest, Token *tok, int min_prec, PPValue *v, bool active) {
+  if (!pp_unary(&tok, tok, v, active))
+    return false;
+
+  for (;;) {
+    int prec = pp_prec(tok);
+    if (prec == 0 || prec < min_prec)
+      break;
+
+    int op = tok->atom;
+    bool active2 = active;
+    if (op == AT_LOGAND)
+      active2 = active && v->val;
+    else if (op == AT_LOGOR)
+      active2 = active && !v->val;
+
+    PPValue rhs;
+    if (!pp_binary(&tok, tok->next, prec + 1, &rhs, active2) ||
+        !pp_binop(op, v, rhs, active))
+      return false;
+  }
+
+  *rest = tok;
+  return true;
+}
+
+static bool pp_cond(Token **rest, Token *tok, PPValue *v, bool active) {
+  if (!pp_binary(&tok, tok, 1, v, active))
+    return false;
+
+  if (!is_punct(tok, AT_QUESTION)) {
+    *rest = tok;
+    return true;
+  }
+
+  bool cond = v->val;
+  PPValue then, els;
+  if (!pp_cond(&tok, tok->next, &then, active && cond) ||
+      !is_punct(tok, AT_COLON) ||
+      !pp_cond(&tok, tok->next, &els, active && !cond))
+    return false;
+
+  *v = cond ? then : els;
+  v->is_unsigned = then.is_unsigned || els.is_unsigned;
+  *rest = tok;
+  return true;
+}
+
 // Read and evaluate a constant expression.
 static bool eval_const_expr(Token **rest, Token *start) {
   Token *tok = split_line(rest, start->next);
@@ -312,6 +579,14 @@ static bool eval_const_expr(Token **rest, Token *start) {
     error_tok(start, "no expression");
 
   Token *end;
+  PPValue v;
+  if (pp_cond(&end, tok, &v, true) && end->kind == TK_EOF)
+    return v.val;
+
+  for (Token *t = tok; t->kind != TK_EOF; t = t->next)
+    if (t->kind == TK_IDENT)
+      to_int_token(t, 0);
+
   bool val = !!const_expr(&end, tok);
 
   if (end->kind != TK_EOF)
@@ -376,6 +651,170 @@ static MacroParam *read_macro_params(Token **rest, Token *tok, char **va_args_na
   return head.next;
 }
 
+// Compiles the body of a function-like macro. ops[i] is the operation
+// that starts at toks[i]. A `##` whose left-hand side turns out to be
+// a placemarker reads its right-hand side as if there were no `##`,
+// so the body can be read in more than one way. Each operation is
+// compiled once, and the ways of reading share operations after they
+// meet again.
+typedef struct {
+  Macro *m;
+  Token **toks;
+  MacroOp *ops;
+  int *work; // Pairs of start and end positions to be compiled
+  int nwork;
+} MacroCompiler;
+
+static void push_work(MacroCompiler *mc, int start, int end) {
+  mc->work[mc->nwork++] = start;
+  mc->work[mc->nwork++] = end;
+}
+
+// Returns the index of a parameter named by `tok`, or -1.
+static int param_slot(Macro *m, Token *tok) {
+  int i = 0;
+  for (MacroParam *pp = m->params; pp; pp = pp->next, i++)
+    if (equal(tok, pp->name))
+      return i;
+  if (m->va_args_name && equal(tok, m->va_args_name))
+    return i;
+  return -1;
+}
+
+// Reads a macro parameter or __VA_OPT__(...) at position `i` into
+// `op`. Returns false if it is neither.
+static bool read_op_arg(MacroCompiler *mc, int *rest, int i, int end, MacroOp *op) {
+  if (i == end)
+    return false;
+
+  Token **toks = mc->toks;
+  int slot = param_slot(mc->m, toks[i]);
+  if (slot != -1) {
+    op->slot = slot;
+    op->raw = equal(toks[i + 1], "##");
+    *rest = i + 1;
+    return true;
+  }
+
+  // __VA_OPT__(x) is treated like a parameter which expands to parameter-
+  // substituted (x) if macro-expanded __VA_ARGS__ is not empty.
+  if (equal(toks[i], "__VA_OPT__") && equal(toks[i + 1], "(")) {
+    int start = i + 2;
+    int level = 0;
+    int j = start;
+    for (; !(level == 0 && equal(toks[j], ")")); j++) {
+      if (j == end) {
+        *op = (MacroOp){OP_ERROR, toks[start], .msg = "unterminated list"};
+        return true;
+      }
+      if (equal(toks[j], "("))
+        level++;
+      else if (equal(toks[j], ")"))
+        level--;
+    }
+
+    op->slot = mc->m->va_args_name ? mc->m->nargs - 1 : -1;
+    op->va_opt = &mc->ops[start];
+    op->va_opt_end = &mc->ops[j];
+    push_work(mc, start, j);
+    op->raw = equal(toks[j + 1], "##");
+    *rest = j + 1;
+    return true;
+  }
+  return false;
+}
+
+// Compiles the operation at position `i` and returns the position of
+// the next one. Errors are reported when the macro is expanded.
+static int compile_op(MacroCompiler *mc, int i, int end) {
+  Token **toks = mc->toks;
+  Token *tok = toks[i];
+  MacroOp *op = &mc->ops[i];
+  int next = i + 1;
+
+  if (equal(tok, "#")) {
+    // "#" followed by a parameter is replaced with stringized actuals.
+    *op = (MacroOp){OP_STRINGIZE, tok};
+    if (!read_op_arg(mc, &next, i + 1, end, op))
+      *op = (MacroOp){OP_ERROR, toks[i + 1], .msg = "'#' is not followed by a macro parameter"};
+  } else if (equal(tok, ",") && equal(toks[i + 1], "##") && i + 2 != end &&
+             mc->m->va_args_name && param_slot(mc->m, toks[i + 2]) == mc->m->nargs - 1) {
+    // [GNU] `,##__VA_ARGS__`. The `##` is dropped, and the variadic
+    // argument that follows may be omitted along with the comma.
+    *op = (MacroOp){OP_COMMA_VA, tok, .slot = mc->m->nargs - 1};
+    next = i + 2;
+  } else if (equal(tok, "##")) {
+    // This is checked after `##` at the start, which is known only
+    // when the macro is expanded.
+    if (i + 1 == end) {
+      *op = (MacroOp){OP_PASTE, tok, .msg = "'##' cannot appear at end of macro expansion"};
+      return end;
+    }
+
+    *op = (MacroOp){OP_PASTE_ARG, tok, .rhs = toks[i + 1], .alt = &mc->ops[i + 1]};
+    push_work(mc, i + 1, end);
+    if (!read_op_arg(mc, &next, i + 1, end, op)) {
+      op->kind = OP_PASTE;
+      next = i + 2;
+    }
+  } else {
+    *op = (MacroOp){OP_PARAM, tok};
+    if (!read_op_arg(mc, &next, i, end, op))
+      *op = (MacroOp){OP_TOKEN, tok};
+  }
+
+  if (op->kind == OP_ERROR)
+    return end;
+  op->next = &mc->ops[next];
+  return next;
+}
+
+static MacroOp *compile_macro(Macro *m) {
+  int n = 0;
+  for (Token *t = m->body; t->kind != TK_EOF; t = t->next)
+    n++;
+
+  MacroCompiler mc = {m};
+  mc.toks = calloc(n + 1, sizeof(Token *));
+  mc.ops = calloc(n + 1, sizeof(MacroOp));
+  mc.work = calloc(4 * n + 2, sizeof(int));
+
+  Token *t = m->body;
+  for (int i = 0; i <= n; i++, t = t->next)
+    mc.toks[i] = t;
+  mc.ops[n] = (MacroOp){OP_END, mc.toks[n]};
+
+  push_work(&mc, 0, n);
+  while (mc.nwork) {
+    int end = mc.work[--mc.nwork];
+    int i = mc.work[--mc.nwork];
+
+    // The end of __VA_OPT__ contents is its closing parenthesis.
+    if (!mc.ops[end].tok)
+      mc.ops[end] = (MacroOp){OP_END, new_eof(mc.toks[end])};
+
+    while (i != end && !mc.ops[i].tok)
+      i = compile_op(&mc, i, end);
+  }
+
+  free(mc.toks);
+  free(mc.work);
+  return mc.ops;
+}
+
+static Macro *
+add_funclike_macro(char *name, Token *body, MacroParam *params, char *va_args_name) {
+  Macro *m = add_macro(name, false, body);
+  m->params = params;
+  m->va_args_name = va_args_name;
+  for (MacroParam *pp = params; pp; pp = pp->next)
+    m->nargs++;
+  if (va_args_name)
+    m->nargs++;
+  m->ops = compile_macro(m);
+  return m;
+}
+
 static void read_macro_definition(Token **rest, Token *tok) {
   if (tok->kind != TK_IDENT)
     error_tok(tok, "macro name must be an identifier");
@@ -387,16 +826,14 @@ static void read_macro_definition(Token **rest, Token *tok) {
     char *va_args_name = NULL;
     MacroParam *params = read_macro_params(&tok, tok->next, &va_args_name);
 
-    Macro *m = add_macro(name, false, split_line(rest, tok));
-    m->params = params;
-    m->va_args_name = va_args_name;
+    add_funclike_macro(name, split_line(rest, tok), params, va_args_name);
   } else {
     // Object-like macro
     add_macro(name, true, split_line(rest, tok));
   }
 }
 
-static MacroArg *read_macro_arg_one(Token **rest, Token *tok, bool read_rest) {
+static Token *read_macro_arg_one(Token **rest, Token *tok, bool read_rest) {
   Token head = {0};
   Token *cur = &head;
   int level = 0;
@@ -404,6 +841,10 @@ static MacroArg *read_macro_arg_one(Token **rest, Token *tok, bool read_rest) {
 
   for (;;) {
     pop_macro_lock(tok);
+    if (tok->kind == TK_LAZY) {
+      tok = tokenize_lazy(tok);
+      continue;
+    }
     if (locked_macros && tok->kind == TK_IDENT) {
       Macro *m = find_macro(tok);
       if (m && m->is_locked)
@@ -433,49 +874,58 @@ static MacroArg *read_macro_arg_one(Token **rest, Token *tok, bool read_rest) {
   }
 
   cur->next = new_eof(tok);
-
-  MacroArg *arg = calloc(1, sizeof(MacroArg));
-  arg->tok = head.next;
   *rest = tok;
-  return arg;
+  return head.next;
 }
 
-static MacroArg *
-read_macro_args(Token **rest, Token *tok, MacroParam *params, char *va_args_name) {
+// Reads the arguments of a function-like macro into an array indexed
+// by parameter number.
+static MacroArg *read_macro_args(Token **rest, Token *tok, Macro *m) {
   pop_macro_lock(tok->next);
   pop_macro_lock(tok->next->next);
   tok = tok->next->next;
 
-  MacroArg head = {0};
-  MacroArg *cur = &head;
+  MacroArg *args = calloc(m->nargs, sizeof(MacroArg));
+  int i = 0;
 
-  for (MacroParam *pp = params; pp; pp = pp->next) {
-    if (cur != &head)
+  for (MacroParam *pp = m->params; pp; pp = pp->next) {
+    if (i)
       tok = skip(tok, ",");
-    cur = cur->next = read_macro_arg_one(&tok, tok, false);
-    cur->name = pp->name;
+    args[i++].tok = read_macro_arg_one(&tok, tok, false);
   }
 
-  if (va_args_name) {
+  if (m->va_args_name) {
     Token *start = tok;
-    if (!equal(tok, ")") && params)
+    if (!equal(tok, ")") && m->params)
       tok = skip(tok, ",");
 
-    MacroArg *arg = read_macro_arg_one(&tok, tok, true);
-    arg->omit_comma = equal(start, ")");
-    arg->name = va_args_name;
-    arg->is_va_args = true;
-    cur->next = arg;
+    args[i].tok = read_macro_arg_one(&tok, tok, true);
+    args[i].omit_comma = equal(start, ")");
   }
 
   *rest = skip(tok, ")");
-  return head.next;
+  return args;
 }
 
+// Returns true if a token list contains a macro name that may be
+// expanded.
+static bool has_macro(Token *tok) {
+  for (; tok->kind != TK_EOF; tok = tok->next)
+    if (!tok->dont_expand && find_macro(tok))
+      return true;
+  return false;
+}
+
+// Macro-expands an argument. The result is computed on first use and
+// shared by all uses of the parameter. An argument without macros
+// expands to itself, so it is used as is instead of being copied.
 static Token *expand_arg(MacroArg *arg) {
   if (arg->expanded)
     return arg->expanded;
 
+  if (!has_macro(arg->tok))
+    return arg->expanded = arg->tok;
+
   Token *tok = arg->tok;
   Token head = {0};
   Token *cur = &head;
@@ -495,36 +945,15 @@ static Token *expand_arg(MacroArg *arg) {
   return arg->expanded = head.next;
 }
 
-static MacroArg *find_arg(Token **rest, Token *tok, MacroArg *args) {
-  for (MacroArg *ap = args; ap; ap = ap->next) {
-    if (equal(tok, ap->name)) {
-      if (rest)
-        *rest = tok->next;
-      return ap;
-    }
-  }
-
-  // __VA_OPT__(x) is treated like a parameter which expands to parameter-
-  // substituted (x) if macro-expanded __VA_ARGS__ is not empty.
-  if (equal(tok, "__VA_OPT__") && equal(tok->next, "(")) {
-    MacroArg *arg = read_macro_arg_one(&tok, tok->next->next, true);
-
-    MacroArg *va = NULL;
-    for (MacroArg *ap = args; ap; ap = ap->next)
-      if (ap->is_va_args)
-        va = ap;
-
-    if (va && expand_arg(va)->kind != TK_EOF)
-      arg->tok = subst(arg->tok, args);
-    else
-      arg->tok = new_eof(tok);
-
-    arg->expanded = arg->tok;
-    if (rest)
-      *rest = tok->next;
-    return arg;
-  }
-  return NULL;
+// Returns true if an argument expands to nothing. The argument is
+// expanded only if it starts with a macro name.
+static bool is_empty_arg(MacroArg *arg) {
+  Token *tok = arg->expanded ? arg->expanded : arg->tok;
+  if (tok->kind == TK_EOF)
+    return true;
+  if (arg->expanded || tok->dont_expand || !find_macro(tok))
+    return false;
+  return expand_arg(arg)->kind == TK_EOF;
 }
 
 // Concatenates all tokens in `tok` and returns a new string.
@@ -583,96 +1012,103 @@ static Token *paste(Token *lhs, Token *rhs) {
   return tok;
 }
 
-// Replace func-like macro parameters with given arguments.
-static Token *subst(Token *tok, MacroArg *args) {
-  Token head = {0};
-  Token *cur = &head;
+static Token *subst(Token *head, Token *cur, MacroOp *op, MacroArg *args);
 
-  while (tok->kind != TK_EOF) {
-    Token *start = tok;
+// Returns the argument of a given operation. __VA_OPT__(x) is
+// parameter-substituted x if the variadic argument is not empty.
+static MacroArg *get_op_arg(MacroOp *op, MacroArg *args) {
+  if (!op->va_opt)
+    return &args[op->slot];
 
-    // "#" followed by a parameter is replaced with stringized actuals.
-    if (equal(tok, "#")) {
-      MacroArg *arg = find_arg(&tok, tok->next, args);
-      if (!arg)
-        error_tok(tok->next, "'#' is not followed by a macro parameter");
-      cur = cur->next = stringize(start, arg->tok);
-      align_token(cur, start);
-      continue;
-    }
+  MacroArg *arg = calloc(1, sizeof(MacroArg));
+  if (op->slot != -1 && !is_empty_arg(&args[op->slot])) {
+    Token head = {0};
+    subst(&head, &head, op->va_opt, args);
+    arg->tok = head.next;
+  } else {
+    arg->tok = op->va_opt_end->tok;
+  }
+  arg->expanded = arg->tok;
+  return arg;
+}
 
-    // [GNU] If __VA_ARGS__ is empty, `,##__VA_ARGS__` is expanded
-    // to an empty token list. Otherwise, it's expanded to `,` and
-    // __VA_ARGS__.
-    if (equal(tok, ",") && equal(tok->next, "##")) {
-      MacroArg *arg = find_arg(NULL, tok->next->next, args);
-      if (arg && arg->is_va_args) {
-        if (arg->omit_comma) {
-          tok = tok->next->next->next;
-          continue;
-        }
-        cur = cur->next = copy_token(tok);
-        tok = tok->next->next;
-        continue;
-      }
-    }
+// Appends an argument in the macro body.
+static Token *subst_arg(Token *cur, MacroOp *op, MacroArg *args) {
+  MacroArg *arg = get_op_arg(op, args);
+  Token *t = op->raw ? arg->tok : expand_arg(arg);
 
-    if (equal(tok, "##")) {
-      if (cur == &head)
-        error_tok(tok, "'##' cannot appear at start of macro expansion");
+  if (t->kind == TK_EOF)
+    return cur->next = new_pmark(t);
 
-      if (tok->next->kind == TK_EOF)
-        error_tok(tok, "'##' cannot appear at end of macro expansion");
+  align_token(t, op->tok);
+  for (; t->kind != TK_EOF; t = t->next)
+    cur = cur->next = copy_token(t);
+  return cur;
+}
 
-      if (cur->kind == TK_PMARK) {
-        tok = tok->next;
-        continue;
-      }
+// Replace func-like macro parameters with given arguments. Tokens are
+// appended to `cur`, and the last one is returned.
+static Token *subst(Token *head, Token *cur, MacroOp *op, MacroArg *args) {
+  for (;;) {
+    MacroOp *next = op->next;
 
-      MacroArg *arg = find_arg(&tok, tok->next, args);
-      if (arg) {
-        if (arg->tok->kind == TK_EOF)
-          continue;
+    switch (op->kind) {
+    case OP_TOKEN:
+      cur = cur->next = copy_token(op->tok);
+      break;
+    case OP_PARAM:
+      cur = subst_arg(cur, op, args);
+      break;
+    case OP_STRINGIZE:
+      cur = cur->next = stringize(op->tok, get_op_arg(op, args)->tok);
+      align_token(cur, op->tok);
+      break;
+    case OP_COMMA_VA:
+      // [GNU] If __VA_ARGS__ is empty, `,##__VA_ARGS__` is expanded
+      // to an empty token list. Otherwise, it's expanded to `,` and
+      // __VA_ARGS__.
+      if (args[op->slot].omit_comma)
+        next = next->next;
+      else
+        cur = cur->next = copy_token(op->tok);
+      break;
+    case OP_PASTE:
+    case OP_PASTE_ARG: {
+      if (cur == head)
+        error_tok(op->tok, "'##' cannot appear at start of macro expansion");
+      if (op->msg)
+        error_tok(op->tok, "%s", op->msg);
 
-        if (arg->tok->kind != TK_PMARK)
-          *cur = *paste(cur, arg->tok);
+      if (cur->kind == TK_PMARK) {
+        next = op->alt;
+        break;
+      }
 
-        for (Token *t = arg->tok->next; t->kind != TK_EOF; t = t->next)
-          cur = cur->next = copy_token(t);
-        continue;
+      if (op->kind == OP_PASTE) {
+        *cur = *paste(cur, op->rhs);
+        break;
       }
-      *cur = *paste(cur, tok->next);
-      tok = tok->next->next;
-      continue;
-    }
 
-    MacroArg *arg = find_arg(&tok, tok, args);
-    if (arg) {
-      Token *t;
-      if (equal(tok, "##"))
-        t = arg->tok;
-      else
-        t = expand_arg(arg);
+      MacroArg *arg = get_op_arg(op, args);
+      if (arg->tok->kind == TK_EOF)
+        break;
 
-      if (t->kind == TK_EOF) {
-        cur = cur->next = new_pmark(t);
-        continue;
-      }
+      if (arg->tok->kind != TK_PMARK)
+        *cur = *paste(cur, arg->tok);
 
-      align_token(t, start);
-      for (; t->kind != TK_EOF; t = t->next)
+      for (Token *t = arg->tok->next; t->kind != TK_EOF; t = t->next)
         cur = cur->next = copy_token(t);
-      continue;
+      break;
+    }
+    case OP_ERROR:
+      error_tok(op->tok, "%s", op->msg);
+    case OP_END:
+      cur->next = op->tok;
+      return cur;
     }
 
-    // Handle a non-parameter token.
-    cur = cur->next = copy_token(tok);
-    tok = tok->next;
-    continue;
+    op = next;
   }
-
-  cur->next = tok;
-  return head.next;
 }
 
 static Token *insert_objlike(Token *tok, Token *tok2, Token *orig) {
@@ -756,9 +1192,10 @@ static bool expand_macro(Token **rest, Token *tok) {
     stop_tok = tok->next;
     *rest = insert_objlike(m->body, stop_tok, tok);
   } else {
-    MacroArg *args = read_macro_args(&stop_tok, tok, m->params, m->va_args_name);
-    Token *body = subst(m->body, args);
-    *rest = insert_funclike(body, stop_tok, tok);
+    MacroArg *args = read_macro_args(&stop_tok, tok, m);
+    Token head = {0};
+    subst(&head, &head, m->ops, args);
+    *rest = insert_funclike(head.next, stop_tok, tok);
   }
 
   if (*rest != stop_tok) {
@@ -771,34 +1208,93 @@ static bool expand_macro(Token **rest, Token *tok) {
   return true;
 }
 
+// Returns the names in a given directory. Each directory is read only
+// once, so looking for a file in a directory that doesn't have it
+// costs no system call. A directory that can't be read is empty.
+static HashMap *read_dir(char *path) {
+  static HashMap cache;
+  HashMap *names = hashmap_get(&cache, path);
+  if (names)
+    return names;
+
+  names = calloc(1, sizeof(HashMap));
+  DIR *dir = opendir(path);
+  if (dir) {
+    for (struct dirent *ent = readdir(dir); ent; ent = readdir(dir))
+      hashmap_put(names, strdup(ent->d_name), (void *)1);
+    closedir(dir);
+  }
+  stats.dirs_read++;
+  hashmap_put(&cache, path, names);
+  return names;
+}
+
+// Returns true if `dir/filename` exists. `filename` may contain
+// directory names.
+static bool dir_has_file(char *dir, char *filename) {
+  stats.include_lookups++;
+  char *slash = strrchr(filename, '/');
+  if (slash) {
+    dir = format("%s/%.*s", dir, (int)(slash - filename), filename);
+    filename = slash + 1;
+  }
+  return hashmap_get(read_dir(dir), filename);
+}
+
+static char *include_path(char *filename, int idx) {
+  char *path = format("%s/%s", include_paths.data[idx], filename);
+  hashmap_put(&include_path_idx, path, (void *)(intptr_t)(idx + 1));
+  return path;
+}
+
+// Search include paths from the `start`th one.
+static int find_include_path(char *filename, int start) {
+  for (int i = start; i < include_paths.len; i++)
+    if (dir_has_file(include_paths.data[i], filename))
+      return i;
+  return -1;
+}
+
 char *search_include_paths(char *filename) {
   if (filename[0] == '/')
     return filename;
 
+  // Both hits and misses are cached. A miss is an empty string.
   static HashMap cache;
   char *cached = hashmap_get(&cache, filename);
   if (cached)
-    return cached;
+    return *cached ? cached : NULL;
 
-  // Search a file from the include paths.
-  for (int i = 0; i < include_paths.len; i++) {
-    char *path = format("%s/%s", include_paths.data[i], filename);
-    if (!file_exists(path))
-      continue;
-    hashmap_put(&cache, filename, path);
-    include_next_idx = i + 1;
-    return path;
+  // A compile server may already know where the file is.
+  int idx;
+  if (!server_cached_include(filename, &idx)) {
+    idx = find_include_path(filename, 0);
+    server_report_include(filename, idx);
   }
-  return NULL;
+
+  char *path = (idx == -1) ? NULL : include_path(filename, idx);
+  hashmap_put(&cache, filename, path ? path : "");
+  return path;
 }
 
-static char *search_include_next(char *filename) {
-  for (; include_next_idx < include_paths.len; include_next_idx++) {
-    char *path = format("%s/%s", include_paths.data[include_next_idx], filename);
-    if (file_exists(path))
-      return path;
-  }
-  return NULL;
+// #include_next in a file found in the include paths continues the
+// search from the next include path. In other files, it is the same
+// as #include <...>.
+static char *search_include_next(char *filename, File *file) {
+  int start = (intptr_t)hashmap_get(&include_path_idx, file->name);
+  int idx = find_include_path(filename, start);
+  return (idx == -1) ? NULL : include_path(filename, idx);
+}
+
+// Returns `filename` in the directory of a given file if it exists.
+// That is the first place to look for a file in #include "...".
+static char *search_current_dir(char *filename, File *file) {
+  if (filename[0] == '/')
+    return NULL;
+  char *dir = dirname(strdup(file->name));
+  if (!dir_has_file(dir, filename))
+    return NULL;
+  return format("%s/%s", dir, filename);
 }
 
 // Read an #include argument.
@@ -841,38 +1337,101 @@ static char *read_include_filename(Token *tok, bool *is_dquote) {
 }
 
 static Token *include_file(Token *tok, char *path, Token *filename_tok) {
-  // Check for "#pragma once"
-  if (hashmap_get(&pragma_once, path))
-    return tok;
+  // The once and guard tables are keyed by file identity, so that
+  // they apply to a file however it is reached.
+  FileKey *key = get_file_key(path);
+  if (key) {
+    // Check for "#pragma once"
+    if (hashmap_get2(&pragma_once, (char *)key, sizeof(FileKey))) {
+      stats.includes_skipped++;
+      return tok;
+    }
 
-  char *guard_name = hashmap_get(&include_guards, path);
-  if (guard_name && hashmap_get(&macros, guard_name))
-    return tok;
+    char *guard_name = hashmap_get2(&include_guards, (char *)key, sizeof(FileKey));
+    if (guard_name && hashmap_get(&macros, guard_name)) {
+      stats.includes_skipped++;
+      return tok;
+    }
+  }
 
-  Token *end = NULL;
-  Token *start = tokenize_file(path, &end);
+  Token *start = tokenize_file_lazy(path, tok);
   if (!start)
     error_tok(filename_tok, "%s: cannot open file: %s", path, strerror(errno));
-  if (!end)
+  if (start == tok)
     return tok;
 
-  if (is_hash(start) && equal(start->next, "ifndef") &&
-      start->next->next->kind == TK_IDENT && equal(end, "endif"))
-    start->next->guard_file = end->guard_file = path;
+  mi_file = start->file;
+  mi_file->include_depth = filename_tok->file->include_depth + 1;
 
-  end->next = tok;
+  if (opt_H) {
+    for (int i = 0; i < mi_file->include_depth; i++)
+      fputc('.', stderr);
+    fprintf(stderr, " %s\n", path);
+
+    int i = 0;
+    while (i < included_files_len && included_files[i] != mi_file)
+      i++;
+    if (i == included_files_len) {
+      included_files = realloc(included_files, sizeof(File *) * (i + 1));
+      included_files[included_files_len++] = mi_file;
+    }
+  }
   return start;
 }
 
+// If a #if line is "#if !defined X" or "#if !defined(X)", returns X.
+static char *if_not_defined(Token *tok) {
+  Token *t = tok->next;
+  if (t->at_bol || !equal(t, "!"))
+    return NULL;
+  t = t->next;
+  if (t->at_bol || !equal(t, "defined"))
+    return NULL;
+  t = t->next;
+
+  bool paren = !t->at_bol && equal(t, "(");
+  if (paren)
+    t = t->next;
+  if (t->at_bol || t->kind != TK_IDENT)
+    return NULL;
+  Token *name = t;
+  t = t->next;
+
+  if (paren) {
+    if (t->at_bol || !equal(t, ")"))
+      return NULL;
+    t = t->next;
+  }
+  if (!t->at_bol)
+    return NULL;
+  return strndup(name->loc, name->len);
+}
+
+// Prints the headers that are neither guarded nor marked with
+// "#pragma once" like GCC's -H does.
+static void print_unguarded_files(void) {
+  bool first = true;
+  for (int i = 0; i < included_files_len; i++) {
+    FileKey *key = get_file_key(included_files[i]->name);
+    if (!key || hashmap_get2(&pragma_once, (char *)key, sizeof(FileKey)) ||
+        hashmap_get2(&include_guards, (char *)key, sizeof(FileKey)))
+      continue;
+    if (first)
+      fprintf(stderr, "Multiple include guards may be useful for:\n");
+    fprintf(stderr, "%s\n", included_files[i]->name);
+    first = false;
+  }
+}
+
 // Read #line arguments
 static void read_line_marker(Token **rest, Token *tok) {
   Token *start = tok;
   tok = preprocess2(copy_line(rest, tok));
   convert_pp_number(tok);
 
-  if (tok->kind != TK_NUM || tok->ty->kind != TY_INT)
+  if (tok->kind != TK_NUM || tok->extra->ty->kind != TY_INT)
     error_tok(tok, "invalid line marker");
-  start->file->line_delta = tok->val - start->line_no - 1;
+  start->file->line_delta = tok->extra->val - start->line_no - 1;
 
   tok = tok->next;
   if (tok->kind == TK_EOF)
@@ -881,7 +1440,7 @@ static void read_line_marker(Token **rest, Token *tok) {
   if (tok->kind != TK_STR)
     error_tok(tok, "filename expected");
 
-  start->file->display_file = add_input_file(tok->str, NULL, true);
+  start->file->display_file = add_input_file(tok->extra->str, NULL, true);
 }
 
 static void add_loc_info(Token *tok) {
@@ -901,6 +1460,14 @@ static Token *preprocess2(Token *tok) {
   Macro *start_m = locked_macros;
 
   for (; tok->kind != TK_EOF; pop_macro_lock(tok)) {
+    if (tok->kind == TK_LAZY) {
+      tok = tokenize_lazy(tok);
+      continue;
+    }
+
+    if (mi_file && !is_hash(tok))
+      mi_file = NULL;
+
     // If it is a macro, expand it.
     if (expand_macro(&tok, tok))
       continue;
@@ -926,18 +1493,18 @@ static Token *preprocess2(Token *tok) {
 static Token *directives(Token **cur, Token *start) {
   Token *tok = start->next;
 
+  // Whether this directive may control the multiple-include
+  // optimization for the current file
+  bool mi = (mi_file == start->file);
+  if (!tok->at_bol && !equal(tok, "pragma"))
+    mi_file = NULL;
+
   if (equal(tok, "include")) {
     bool is_dquote;
     char *filename = read_include_filename(split_line(&tok, tok->next), &is_dquote);
-    if (filename[0] != '/' && is_dquote) {
-      char *path = format("%s/%s", dirname(strdup(start->file->name)), filename);
-      if (file_exists(path)) {
-        tok = include_file(tok, path, start->next->next);
-        return tok;
-      }
-    }
-
-    char *path = search_include_paths(filename);
+    char *path = is_dquote ? search_current_dir(filename, start->file) : NULL;
+    if (!path)
+      path = search_include_paths(filename);
     tok = include_file(tok, path ? path : filename, start->next->next);
     return tok;
   }
@@ -945,7 +1512,7 @@ static Token *directives(Token **cur, Token *start) {
   if (equal(tok, "include_next")) {
     bool ignore;
     char *filename = read_include_filename(split_line(&tok, tok->next), &ignore);
-    char *path = search_include_next(filename);
+    char *path = search_include_next(filename, start->file);
     tok = include_file(tok, path ? path : filename, start->next->next);
     return tok;
   }
@@ -965,8 +1532,9 @@ static Token *directives(Token **cur, Token *start) {
   }
 
   if (equal(tok, "if")) {
+    char *guard_name = mi ? if_not_defined(tok) : NULL;
     bool val = eval_const_expr(&tok, tok);
-    push_cond_incl(start, val);
+    push_cond_incl(start, val)->guard_name = guard_name;
     if (!val)
       tok = skip_cond_incl(tok);
     return tok;
@@ -983,7 +1551,9 @@ static Token *directives(Token **cur, Token *start) {
 
   if (equal(tok, "ifndef")) {
     bool defined = find_macro(tok->next);
-    push_cond_incl(tok, !defined);
+    CondIncl *ci = push_cond_incl(tok, !defined);
+    if (mi && tok->next->kind == TK_IDENT)
+      ci->guard_name = strndup(tok->next->loc, tok->next->len);
     tok = skip_line(tok->next->next);
     if (defined)
       tok = skip_cond_incl(tok);
@@ -1017,14 +1587,18 @@ static Token *directives(Token **cur, Token *start) {
     if (!cond_incl)
       error_tok(start, "stray #endif");
 
-    if (tok->guard_file && tok->guard_file == cond_incl->tok->guard_file) {
-      Token *name_tok = cond_incl->tok->next;
-      char *guard_name = strndup(name_tok->loc, name_tok->len);
-      hashmap_put(&include_guards, tok->guard_file, guard_name);
-    }
-
+    CondIncl *ci = cond_incl;
     cond_incl = cond_incl->next;
     tok = skip_line(tok->next);
+
+    // If this #endif ends the file and matches the #ifndef that starts
+    // it, and there was no #else or #elif, the whole file is guarded.
+    if (ci->guard_name && ci->ctx == IN_THEN && ci->tok->file == start->file &&
+        tok->file != start->file) {
+      FileKey *key = get_file_key(start->file->name);
+      if (key)
+        hashmap_put2(&include_guards, (char *)key, sizeof(FileKey), ci->guard_name);
+    }
     return tok;
   }
 
@@ -1039,7 +1613,9 @@ static Token *directives(Token **cur, Token *start) {
   }
 
   if (equal(tok, "pragma") && equal(tok->next, "once")) {
-    hashmap_put(&pragma_once, tok->file->name, (void *)1);
+    FileKey *key = get_file_key(tok->file->name);
+    if (key)
+      hashmap_put2(&pragma_once, (char *)key, sizeof(FileKey), (void *)1);
     tok = skip_line(tok->next->next);
     return tok;
   }
@@ -1122,9 +1698,10 @@ static Token *line_macro(Token *start) {
 }
 
 // __COUNTER__ is expanded to serial values starting from 0.
+static int counter;
+
 static Token *counter_macro(Token *start) {
-  static int i = 0;
-  Token *tok = new_num_token(i++, start);
+  Token *tok = new_num_token(counter++, start);
   tok->next = start->next;
   return tok;
 }
@@ -1154,15 +1731,16 @@ static Token *base_file_macro(Token *start) {
 }
 
 static Token *stdver_macro(Token *tok) {
+  TokenExtra *x = new_extra(tok);
   switch (opt_std) {
-  case STD_C99: tok->val = 199901L; break;
-  case STD_C11: tok->val = 201112L; break;
-  case STD_C17: tok->val = 201710L; break;
-  case STD_C23: tok->val = 202311L; break;
-  default: tok->val = 201710L;
+  case STD_C99: x->val = 199901L; break;
+  case STD_C11: x->val = 201112L; break;
+  case STD_C17: x->val = 201710L; break;
+  case STD_C23: x->val = 202311L; break;
+  default: x->val = 201710L;
   }
   tok->kind = TK_NUM;
-  tok->ty = ty_long;
+  x->ty = ty_long;
   return tok;
 }
 
@@ -1209,13 +1787,8 @@ static Token *has_include_macro(Token *start) {
   bool is_dquote;
   char *filename = read_include_filename(split_paren(&tok, tok), &is_dquote);
 
-  bool found = false;
-  if (filename[0] != '/' && is_dquote) {
-    char *path = format("%s/%s", dirname(strdup(start->file->name)), filename);
-    found = file_exists(path);
-  }
-  if (!found)
-    found = search_include_paths(filename);
+  bool found = (is_dquote && search_current_dir(filename, start->file)) ||
+               search_include_paths(filename);
 
   pop_macro_lock_until(start, tok);
   Token *tok2 = new_num_token(found, start);
@@ -1362,13 +1935,13 @@ static void join_adjacent_string_literals(Token *tok) {
   // If regular string literals are adjacent to wide string literals,
   // regular string literals are converted to the wide type.
   StringKind kind = getStringKind(tok);
-  Type *basety = tok->ty->base;
+  Type *basety = tok->extra->ty->base;
 
   for (Token *t = tok->next; t != end; t = t->next) {
     StringKind k = getStringKind(t);
     if (kind == STR_NONE) {
       kind = k;
-      basety = t->ty->base;
+      basety = t->extra->ty->base;
     } else if (k != STR_NONE && kind != k) {
       error_tok(t, "unsupported non-standard concatenation of string literals");
     }
@@ -1376,27 +1949,29 @@ static void join_adjacent_string_literals(Token *tok) {
 
   if (basety->size > 1)
     for (Token *t = tok; t != end; t = t->next)
-      if (t->ty->base->size == 1)
+      if (t->extra->ty->base->size == 1)
         *t = *tokenize_string_literal(t, basety);
 
   // Concatenate adjacent string literals.
-  int len = tok->ty->array_len;
+  int len = tok->extra->ty->array_len;
   for (Token *t = tok->next; t != end; t = t->next)
-    len = len + t->ty->array_len - 1;
+    len = len + t->extra->ty->array_len - 1;
 
   char *buf = calloc(basety->size, len);
+  count_alloc(MEM_STRING, basety->size * len);
 
   int i = 0;
   for (Token *t = tok; t != end; t = t->next) {
-    memcpy(buf + i, t->str, t->ty->size);
-    i = i + t->ty->size - t->ty->base->size;
+    memcpy(buf + i, t->extra->str, t->extra->ty->size);
+    i = i + t->extra->ty->size - t->extra->ty->base->size;
   }
 
   tok->display_file_no = fileno;
   tok->display_line_no = lineno;
 
-  tok->ty = array_of(basety, len);
-  tok->str = buf;
+  TokenExtra *x = new_extra(tok);
+  x->ty = string_type(basety, len);
+  x->str = buf;
   tok->next = end;
 }
 
@@ -1410,7 +1985,7 @@ static bool is_supported_attr(Token *tok) {
   return 0;
 }
 
-static void filter_attr(Token *tok, Token **lst) {
+static void filter_attr(Token *tok, Token **attrs, Token **last) {
   bool first = true;
   for (; tok->kind != TK_EOF; first = false) {
     if (!first)
@@ -1418,7 +1993,12 @@ static void filter_attr(Token *tok, Token **lst) {
 
     if (is_supported_attr(tok)) {
       tok->kind = TK_ATTR;
-      *lst = (*lst)->attr_next = tok;
+      new_extra(tok)->attr_next = NULL;
+      if (*last)
+        (*last)->extra->attr_next = tok;
+      else
+        *attrs = tok;
+      *last = tok;
     }
     if (consume(&tok, tok->next, "(")) {
       tok = skip_paren(tok);
@@ -1433,8 +2013,8 @@ static Token *preprocess3(Token *tok) {
   Token head = {0};
   Token *cur = &head;
 
-  Token attr_head = {0};
-  Token *attr_cur = &attr_head;
+  Token *attrs = NULL;
+  Token *attr_last = NULL;
 
   while (tok->kind != TK_EOF) {
     if (equal(tok, "__attribute__") || equal(tok, "__attribute")) {
@@ -1443,7 +2023,7 @@ static Token *preprocess3(Token *tok) {
       Token *list = split_paren(&tok, tok);
       tok = skip(tok, ")");
 
-      filter_attr(list, &attr_cur);
+      filter_attr(list, &attrs, &attr_last);
       continue;
     }
 
@@ -1453,9 +2033,10 @@ static Token *preprocess3(Token *tok) {
     if (tok->kind == TK_STR && tok->next->kind == TK_STR)
       join_adjacent_string_literals(tok);
 
-    tok->attr_next = attr_head.attr_next;
-    attr_head.attr_next = NULL;
-    attr_cur = &attr_head;
+    if (attrs) {
+      new_extra(tok)->attr_next = attrs;
+      attrs = attr_last = NULL;
+    }
 
     cur = cur->next = tok;
     tok = tok->next;
@@ -1465,14 +2046,175 @@ static Token *preprocess3(Token *tok) {
   return head.next;
 }
 
+// Save the macros defined so far, i.e. the predefined ones and those
+// given on the command line, so that each translation unit compiled
+// in the same process starts with the same set.
+void save_macros(void) {
+  saved_macros = hashmap_copy(&macros);
+}
+
+// Reset the preprocessor for the next translation unit.
+void reset_preprocess(void) {
+  while (locked_macros) {
+    locked_macros->is_locked = false;
+    locked_macros = locked_macros->locked_next;
+  }
+
+  macros = hashmap_copy(&saved_macros);
+  cond_incl = NULL;
+  pragma_once = (HashMap){0};
+  include_guards = (HashMap){0};
+  mi_file = NULL;
+  included_files_len = 0;
+  counter = 0;
+}
+
+static int cmp_macro_name(const void *a, const void *b) {
+  return strcmp((*(HashEntry **)a)->key, (*(HashEntry **)b)->key);
+}
+
+static void write_macro_params(FILE *out, Macro *m) {
+  for (MacroParam *p = m->params; p; p = p->next) {
+    pch_write_int(out, 1);
+    pch_write_str(out, p->name, strlen(p->name));
+  }
+  pch_write_int(out, 0);
+
+  pch_write_int(out, !!m->va_args_name);
+  if (m->va_args_name)
+    pch_write_str(out, m->va_args_name, strlen(m->va_args_name));
+}
+
+// Writes the definitions of all macros in a canonical order, so that
+// a precompiled header can tell whether it was made with the same
+// predefined and command-line macros. __DATE__ and __TIME__ are left
+// out because they change all the time.
+void write_macro_config(FILE *out) {
+  HashEntry **ents = calloc(macros.used, sizeof(HashEntry *));
+  int n = 0;
+  HashEntry *ent;
+  for (int i = 0; (ent = hashmap_next(&macros, &i));)
+    if (strcmp(ent->key, "__DATE__") && strcmp(ent->key, "__TIME__"))
+      ents[n++] = ent;
+  qsort(ents, n, sizeof(HashEntry *), cmp_macro_name);
+
+  for (int i = 0; i < n; i++) {
+    Macro *m = ents[i]->val;
+    pch_write_str(out, ents[i]->key, ents[i]->keylen);
+    pch_write_int(out, m->is_objlike);
+    pch_write_int(out, !!m->handler);
+    write_macro_params(out, m);
+    if (m->body) {
+      char *body = join_tokens(m->body, NULL);
+      pch_write_str(out, body, strlen(body));
+      free(body);
+    }
+  }
+  free(ents);
+}
+
+// Writes the changes made to the state of the preprocessor since
+// save_macros(). read_pch_state() applies them again.
+void write_pch_state(FILE *out) {
+  HashEntry *ent;
+  for (int i = 0; (ent = hashmap_next(&macros, &i));) {
+    Macro *m = ent->val;
+    if (hashmap_get2(&saved_macros, ent->key, ent->keylen) == m)
+      continue;
+    if (m->handler)
+      error("cannot save macro %s in a precompiled header", ent->key);
+    pch_write_int(out, 1);
+    pch_write_str(out, ent->key, ent->keylen);
+    pch_write_int(out, m->is_objlike);
+    write_macro_params(out, m);
+    pch_write_tokens(out, m->body);
+  }
+  pch_write_int(out, 0);
+
+  for (int i = 0; (ent = hashmap_next(&saved_macros, &i));) {
+    if (hashmap_get2(&macros, ent->key, ent->keylen))
+      continue;
+    pch_write_int(out, 1);
+    pch_write_str(out, ent->key, ent->keylen);
+  }
+  pch_write_int(out, 0);
+
+  for (int i = 0; (ent = hashmap_next(&pragma_once, &i));) {
+    FileKey *key = (FileKey *)ent->key;
+    pch_write_int(out, 1);
+    pch_write_int(out, key->dev);
+    pch_write_int(out, key->ino);
+  }
+  pch_write_int(out, 0);
+
+  for (int i = 0; (ent = hashmap_next(&include_guards, &i));) {
+    FileKey *key = (FileKey *)ent->key;
+    pch_write_int(out, 1);
+    pch_write_int(out, key->dev);
+    pch_write_int(out, key->ino);
+    pch_write_str(out, ent->val, strlen(ent->val));
+  }
+  pch_write_int(out, 0);
+
+  pch_write_int(out, counter);
+}
+
+void read_pch_state(void) {
+  while (pch_read_int()) {
+    char *name = pch_read_str();
+    bool is_objlike = pch_read_int();
+
+    MacroParam head = {0};
+    MacroParam *cur = &head;
+    while (pch_read_int()) {
+      cur = cur->next = calloc(1, sizeof(MacroParam));
+      cur->name = pch_read_str();
+    }
+    char *va_args_name = pch_read_int() ? pch_read_str() : NULL;
+
+    Token *body = pch_read_tokens();
+    if (is_objlike)
+      add_macro(name, true, body);
+    else
+      add_funclike_macro(name, body, head.next, va_args_name);
+  }
+
+  while (pch_read_int())
+    undef_macro(pch_read_str());
+
+  while (pch_read_int()) {
+    FileKey *key = calloc(1, sizeof(FileKey));
+    key->dev = pch_read_int();
+    key->ino = pch_read_int();
+    hashmap_put2(&pragma_once, (char *)key, sizeof(FileKey), (void *)1);
+  }
+
+  while (pch_read_int()) {
+    FileKey *key = calloc(1, sizeof(FileKey));
+    key->dev = pch_read_int();
+    key->ino = pch_read_int();
+    hashmap_put2(&include_guards, (char *)key, sizeof(FileKey), pch_read_str());
+  }
+
+  counter = pch_read_int();
+}
+
 // Entry point function of the preprocessor.
 Token *preprocess(Token *tok) {
+  phase_start(PHASE_PREPROCESS);
   tok = preprocess2(tok);
   if (cond_incl)
     error_tok(cond_incl->tok, "unterminated conditional directive");
+  phase_end();
 
-  if (opt_E)
+  if (opt_H)
+    print_unguarded_files();
+
+  if (opt_E || opt_cc1_pch)
     return tok;
 
-  return preprocess3(tok);
+  phase_start(PHASE_PREPROCESS3);
+  tok = preprocess3(tok);
+  phase_end();
+  return tok;
 }
@@ -0,0 +1,261 @@
+// This file implements -ftime-report, which prints how much time each
+// phase of compilation took along with some statistics about the
+// amount of work done, and -fmem-report, which prints how much memory
+// was allocated for each kind of object.
+//
+// Phases nest. For example, included files are tokenized in the
+// middle of preprocessing. Time is charged only to the innermost
+// phase, so the phases add up to the total.
+
+#include "widcc.h"
+#include <sys/resource.h>
+
+ReportFormat opt_time_report;
+ReportFormat opt_mem_report;
+Stats stats;
+
+static char *phase_names[] = {
+  [PHASE_OTHER] = "other",
+  [PHASE_TOKENIZE] = "tokenize",
+  [PHASE_PREPROCESS] = "preprocess",
+  [PHASE_PREPROCESS3] = "preprocess3",
+  [PHASE_PARSE] = "parse",
+  [PHASE_CODEGEN] = "codegen",
+  [PHASE_ASSEMBLE] = "assemble",
+  [PHASE_WAIT] = "wait",
+};
+
+static char *mem_names[] = {
+  [MEM_TOKEN] = "Token",
+  [MEM_TOKEN_EXTRA] = "TokenExtra",
+  [MEM_NODE] = "Node",
+  [MEM_TYPE] = "Type",
+  [MEM_OBJ] = "Obj",
+  [MEM_SCOPE] = "Scope",
+  [MEM_HASHMAP] = "HashMap",
+  [MEM_STRING] = "string",
+  [MEM_FILE] = "file",
+};
+
+typedef struct {
+  int64_t wall;
+  int64_t cpu;
+} Times;
+
+typedef struct {
+  int64_t count;
+  int64_t bytes;
+} MemStat;
+
+static MemStat mem_stats[NUM_MEM];
+
+static Times phase_times[NUM_PHASES];
+static Phase stack[32];
+static int depth;
+static Times last;
+static Times start;
+
+static int64_t now(clockid_t clock) {
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static Times get_times(void) {
+  return (Times){now(CLOCK_MONOTONIC), now(CLOCK_PROCESS_CPUTIME_ID)};
+}
+
+// Charge the time since the last phase switch to the current phase.
+static void charge(void) {
+  Times t = get_times();
+  Times *p = &phase_times[stack[depth]];
+  p->wall += t.wall - last.wall;
+  p->cpu += t.cpu - last.cpu;
+  last = t;
+}
+
+// Start measuring from scratch. This is called at the beginning of
+// cc1, which may be a forked copy of the driver.
+void init_time_report(void) {
+  if (!opt_time_report)
+    return;
+
+  memset(phase_times, 0, sizeof(phase_times));
+  memset(&stats, 0, sizeof(stats));
+  depth = 0;
+  stack[0] = PHASE_OTHER;
+  start = last = get_times();
+}
+
+void phase_start(Phase phase) {
+  if (!opt_time_report)
+    return;
+
+  charge();
+  if (depth + 1 == sizeof(stack) / sizeof(*stack))
+    internal_error();
+  stack[++depth] = phase;
+}
+
+void phase_end(void) {
+  if (!opt_time_report)
+    return;
+
+  charge();
+  if (depth == 0)
+    internal_error();
+  depth--;
+}
+
+static double ms(int64_t ns) {
+  return ns / 1000000.0;
+}
+
+static int64_t children_cpu(void) {
+  struct rusage ru;
+  if (getrusage(RUSAGE_CHILDREN, &ru))
+    return 0;
+  return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000000LL +
+         (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1000LL;
+}
+
+static void print_json_string(char *s) {
+  fputc('"', stderr);
+  for (; *s; s++) {
+    if (*s == '"' || *s == '\\')
+      fprintf(stderr, "\\%c", *s);
+    else if ((unsigned char)*s < 0x20)
+      fprintf(stderr, "\\u%04x", *s);
+    else
+      fputc(*s, stderr);
+  }
+  fputc('"', stderr);
+}
+
+static void print_text(char *name, Times *total) {
+  fprintf(stderr, "time report for %s:\n", name);
+  fprintf(stderr, "  %-12s %12s %12s\n", "phase", "wall (ms)", "cpu (ms)");
+
+  for (int i = 0; i < NUM_PHASES; i++)
+    if (phase_times[i].wall)
+      fprintf(stderr, "  %-12s %12.3f %12.3f\n", phase_names[i],
+              ms(phase_times[i].wall), ms(phase_times[i].cpu));
+  fprintf(stderr, "  %-12s %12.3f %12.3f\n", "total",
+          ms(total->wall), ms(total->cpu));
+
+  int64_t lex = phase_times[PHASE_TOKENIZE].wall;
+  if (stats.source_bytes && lex)
+    fprintf(stderr, "  %lld bytes of source tokenized at %.1f MB/s\n",
+            (long long)stats.source_bytes, stats.source_bytes * 1000.0 / lex);
+  if (stats.skipped_bytes)
+    fprintf(stderr, "  %lld bytes of source skipped in excluded #if blocks\n",
+            (long long)stats.skipped_bytes);
+  if (stats.include_lookups)
+    fprintf(stderr, "  %lld include lookups answered from %lld directory listings\n",
+            (long long)stats.include_lookups, (long long)stats.dirs_read);
+  if (stats.includes_skipped || stats.reads_avoided)
+    fprintf(stderr, "  %lld includes skipped by #pragma once or include guards, "
+            "%lld re-reads avoided\n",
+            (long long)stats.includes_skipped, (long long)stats.reads_avoided);
+  if (stats.tokens || stats.nodes || stats.asm_bytes)
+    fprintf(stderr, "  %lld tokens, %lld AST nodes, %lld bytes of assembly\n",
+            (long long)stats.tokens, (long long)stats.nodes,
+            (long long)stats.asm_bytes);
+  if (stats.subprocesses)
+    fprintf(stderr, "  %lld subprocesses, %.3f ms cpu\n",
+            (long long)stats.subprocesses, ms(children_cpu()));
+}
+
+// The JSON form is a single line per process, so that reports of
+// a whole build can be collected from stderr and aggregated.
+static void print_json(char *name, Times *total) {
+  fprintf(stderr, "{\"file\": ");
+  print_json_string(name);
+  fprintf(stderr, ", \"phases\": {");
+
+  for (int i = 0; i < NUM_PHASES; i++)
+    fprintf(stderr, "%s\"%s\": {\"wall_ms\": %.3f, \"cpu_ms\": %.3f}",
+            i ? ", " : "", phase_names[i],
+            ms(phase_times[i].wall), ms(phase_times[i].cpu));
+
+  fprintf(stderr, "}, \"total\": {\"wall_ms\": %.3f, \"cpu_ms\": %.3f}",
+          ms(total->wall), ms(total->cpu));
+  fprintf(stderr, ", \"source_bytes\": %lld, \"skipped_bytes\": %lld",
+          (long long)stats.source_bytes, (long long)stats.skipped_bytes);
+  fprintf(stderr, ", \"include_lookups\": %lld, \"dirs_read\": %lld",
+          (long long)stats.include_lookups, (long long)stats.dirs_read);
+  fprintf(stderr, ", \"includes_skipped\": %lld, \"reads_avoided\": %lld",
+          (long long)stats.includes_skipped, (long long)stats.reads_avoided);
+  fprintf(stderr, ", \"tokens\": %lld, \"nodes\": %lld, \"asm_bytes\": %lld",
+          (long long)stats.tokens, (long long)stats.nodes,
+          (long long)stats.asm_bytes);
+  fprintf(stderr, ", \"subprocesses\": %lld, \"subprocess_cpu_ms\": %.3f}\n",
+          (long long)stats.subprocesses, ms(children_cpu()));
+}
+
+void print_time_report(char *name) {
+  if (!opt_time_report)
+    return;
+
+  charge();
+  Times total = {last.wall - start.wall, last.cpu - start.cpu};
+
+  if (opt_time_report == REPORT_JSON)
+    print_json(name, &total);
+  else
+    print_text(name, &total);
+}
+
+// Allocations are counted unconditionally since it's cheaper than
+// checking whether -fmem-report is given. Nothing is ever freed, so
+// the counts are also what is live at the end.
+void count_alloc(MemKind kind, size_t size) {
+  mem_stats[kind].count++;
+  mem_stats[kind].bytes += size;
+}
+
+// Returns the peak resident set size in bytes.
+static int64_t peak_rss(void) {
+  struct rusage ru;
+  if (getrusage(RUSAGE_SELF, &ru))
+    return 0;
+  return ru.ru_maxrss * 1024LL;
+}
+
+void print_mem_report(char *name) {
+  if (!opt_mem_report)
+    return;
+
+  int64_t count = 0;
+  int64_t bytes = 0;
+  for (int i = 0; i < NUM_MEM; i++) {
+    count += mem_stats[i].count;
+    bytes += mem_stats[i].bytes;
+  }
+
+  if (opt_mem_report == REPORT_JSON) {
+    fprintf(stderr, "{\"file\": ");
+    print_json_string(name);
+    fprintf(stderr, ", \"allocations\": {");
+    for (int i = 0; i < NUM_MEM; i++)
+      fprintf(stderr, "%s\"%s\": {\"count\": %lld, \"bytes\": %lld}",
+              i ? ", " : "", mem_names[i],
+              (long long)mem_stats[i].count, (long long)mem_stats[i].bytes);
+    fprintf(stderr, "}, \"total\": {\"count\": %lld, \"bytes\": %lld}",
+            (long long)count, (long long)bytes);
+    fprintf(stderr, ", \"arenas\": {\"token\": %lld, \"ast\": %lld}",
+            (long long)token_arena.reserved, (long long)ast_arena.reserved);
+    fprintf(stderr, ", \"peak_rss\": %lld}\n", (long long)peak_rss());
+    return;
+  }
+
+  fprintf(stderr, "memory report for %s:\n", name);
+  fprintf(stderr, "  %-12s %12s %14s\n", "kind", "count", "bytes");
+  for (int i = 0; i < NUM_MEM; i++)
+    fprintf(stderr, "  %-12s %12lld %14lld\n", mem_names[i],
+            (long long)mem_stats[i].count, (long long)mem_stats[i].bytes);
+  fprintf(stderr, "  %-12s %12lld %14lld\n", "total", (long long)count, (long long)bytes);
+  fprintf(stderr, "  arenas: %lld bytes for tokens, %lld bytes for AST\n",
+          (long long)token_arena.reserved, (long long)ast_arena.reserved);
+  fprintf(stderr, "  peak RSS %lld bytes\n", (long long)peak_rss());
+}
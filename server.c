@@ -0,0 +1,751 @@
+// This file implements a compile server. `widcc --server PATH` listens
+// on a Unix domain socket at PATH. If WIDCC_SERVER is set to that path,
+// the driver forwards its command line, working directory, environment
+// and standard streams to the server instead of compiling by itself.
+//
+// The server forks a child per request, so every compile starts from
+// the same pristine state just as a cold one does. What the children
+// inherit from the server are two caches which outlive each request:
+//
+//  - Tokenized files, keyed by path and validated by device, inode,
+//    mtime and size. A cache hit copies the token list instead of
+//    reading and tokenizing the file again.
+//
+//  - #include search results, keyed by the include path list and the
+//    file name. An entry is used only if none of the directories that
+//    were searched has been modified since.
+//
+// A child can't update the server's memory, so children report what
+// they have read or searched through a pipe, and the server fills its
+// caches from that between requests.
+//
+// A request runs arbitrary commands as the user who started the
+// server, so the socket is created accessible only by that user and
+// connections from anyone else are dropped.
+
+#define _GNU_SOURCE
+#include "widcc.h"
+#include <limits.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+typedef struct {
+  dev_t dev;
+  ino_t ino;
+  struct timespec mtime;
+  off_t size;
+} FileId;
+
+typedef struct {
+  FileId id;
+  char *contents;
+  Token *tok;
+} CachedFile;
+
+typedef struct {
+  char *dir;
+  struct timespec mtime; // Zero if the directory didn't exist
+} DirStamp;
+
+typedef struct {
+  int idx;               // Index into include_paths or -1 if not found
+  DirStamp *dirs;
+  int ndirs;
+} CachedInclude;
+
+typedef struct {
+  pid_t pid;
+  int conn;
+} Request;
+
+static HashMap token_cache;
+static HashMap include_cache;
+static HashMap dir_mtimes;
+static char *include_key;
+
+// The working directory of the request a child is serving. Requests
+// come from different directories, so relative paths are made
+// absolute before they are used as cache keys.
+static char *request_cwd;
+
+// The pipe through which children report to the server. report_fd is
+// -1 unless we are running under a server.
+static int report_fd = -1;
+static int report_rd = -1;
+
+static int sigchld_pipe[2];
+
+static bool is_server_child(void) {
+  return report_fd != -1;
+}
+
+static char *abs_path(char *path) {
+  if (path[0] == '/')
+    return path;
+  return format("%s/%s", request_cwd, path);
+}
+
+static bool get_file_id(char *path, FileId *id) {
+  struct stat st;
+  if (stat(path, &st))
+    return false;
+  *id = (FileId){st.st_dev, st.st_ino, st.st_mtim, st.st_size};
+  return true;
+}
+
+static bool same_file_id(FileId *a, FileId *b) {
+  return a->dev == b->dev && a->ino == b->ino && a->size == b->size &&
+         a->mtime.tv_sec == b->mtime.tv_sec && a->mtime.tv_nsec == b->mtime.tv_nsec;
+}
+
+static struct timespec get_dir_mtime(char *dir) {
+  struct stat st;
+  if (stat(dir, &st) || !S_ISDIR(st.st_mode))
+    return (struct timespec){0};
+  return st.st_mtim;
+}
+
+static bool same_time(struct timespec a, struct timespec b) {
+  return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
+}
+
+// Send a line to the server. A write of up to PIPE_BUF bytes to a pipe
+// is atomic, so lines from concurrent children don't interleave.
+static void report(char *line) {
+  int len = strlen(line);
+  if (len > PIPE_BUF || strchr(line, '\n') != line + len - 1)
+    return;
+  while (write(report_fd, line, len) == -1 && errno == EINTR);
+}
+
+//
+// Client side of the caches, used in children of the server
+//
+
+// Returns a copy of the cached tokens of a given file, or NULL if the
+// file isn't in the cache or has been modified.
+Token *server_cached_tokens(char *path, Token **end) {
+  if (!is_server_child() || !strcmp(path, "-"))
+    return NULL;
+
+  CachedFile *cf = hashmap_get(&token_cache, abs_path(path));
+  if (!cf)
+    return NULL;
+
+  FileId id;
+  if (!get_file_id(path, &id) || !same_file_id(&id, &cf->id))
+    return NULL;
+
+  return copy_token_list(cf->tok, add_input_file(path, cf->contents, false), end);
+}
+
+void server_report_file(char *path) {
+  if (!is_server_child() || !strcmp(path, "-"))
+    return;
+
+  FileId id;
+  if (!get_file_id(path, &id))
+    return;
+
+  report(format("T %llu %llu %lld %ld %lld %s\n",
+                (unsigned long long)id.dev, (unsigned long long)id.ino,
+                (long long)id.mtime.tv_sec, id.mtime.tv_nsec,
+                (long long)id.size, abs_path(path)));
+}
+
+static char *get_include_key(char *filename) {
+  if (!include_key) {
+    char *buf;
+    size_t buflen;
+    FILE *out = open_memstream(&buf, &buflen);
+    for (int i = 0; i < include_paths.len; i++)
+      fprintf(out, "%s%c", abs_path(include_paths.data[i]), '\t');
+    fclose(out);
+    include_key = buf;
+  }
+  return format("%s%s", include_key, filename);
+}
+
+// Returns true if the result of searching the include paths for
+// `filename` is known. *idx is set to the index of the include path
+// where the file was found, or -1 if it wasn't.
+bool server_cached_include(char *filename, int *idx) {
+  if (!is_server_child() || strchr(filename, '\t'))
+    return false;
+
+  CachedInclude *ci = hashmap_get(&include_cache, get_include_key(filename));
+  if (!ci)
+    return false;
+
+  // The server refreshes directory mtimes before each request.
+  for (int i = 0; i < ci->ndirs; i++) {
+    struct timespec *cur = hashmap_get(&dir_mtimes, ci->dirs[i].dir);
+    if (!cur || !same_time(*cur, ci->dirs[i].mtime))
+      return false;
+  }
+  *idx = ci->idx;
+  return true;
+}
+
+// The directories searched for a file are the include paths up to the
+// one it was found in, combined with any directory part of its name.
+static char *probed_dir(int i, char *filename) {
+  return dirname(format("%s/%s", include_paths.data[i], filename));
+}
+
+void server_report_include(char *filename, int idx) {
+  if (!is_server_child() || strchr(filename, '\t'))
+    return;
+
+  // The server splits the key at tabs, so a tab in a directory name
+  // would make it misread the key.
+  char *key = get_include_key(filename);
+  int ntabs = 0;
+  for (char *p = key; (p = strchr(p, '\t')); p++)
+    ntabs++;
+  if (ntabs != include_paths.len)
+    return;
+
+  int n = (idx == -1) ? include_paths.len : idx + 1;
+  char *buf;
+  size_t buflen;
+  FILE *out = open_memstream(&buf, &buflen);
+  fprintf(out, "I %d %d", idx, n);
+
+  for (int i = 0; i < n; i++) {
+    struct timespec t = get_dir_mtime(probed_dir(i, filename));
+    fprintf(out, " %lld %ld", (long long)t.tv_sec, t.tv_nsec);
+  }
+  fprintf(out, " %s\n", key);
+  fclose(out);
+
+  // A directory may have been modified between the search and the
+  // stat calls above. Search again so that the result we report is
+  // no older than the mtimes.
+  bool ok = true;
+  for (int i = 0; i < n; i++)
+    if (file_exists(format("%s/%s", include_paths.data[i], filename)) != (i == idx))
+      ok = false;
+
+  if (ok)
+    report(buf);
+  free(buf);
+}
+
+//
+// Server
+//
+
+// Read and tokenize a file a child has reported, unless it has been
+// modified in the meantime. Since the child managed to tokenize the
+// same file, we don't expect errors here.
+static void add_cached_file(FileId *id, char *path) {
+  CachedFile *cf = hashmap_get(&token_cache, path);
+  if (cf && same_file_id(&cf->id, id))
+    return;
+
+  FileId before, after;
+  if (!get_file_id(path, &before) || !same_file_id(&before, id))
+    return;
+
+  char *contents = read_source_file(path);
+  if (!contents)
+    return;
+
+  if (!get_file_id(path, &after) || !same_file_id(&after, id))
+    return;
+
+  cf = calloc(1, sizeof(CachedFile));
+  cf->id = *id;
+  cf->contents = contents;
+  cf->tok = tokenize(new_file(path, 0, contents), NULL);
+  hashmap_put(&token_cache, strdup(path), cf);
+}
+
+static void add_cached_include(char *p) {
+  int idx, n, len;
+  if (sscanf(p, "%d %d%n", &idx, &n, &len) != 2 || n < 0)
+    return;
+  p += len;
+
+  DirStamp *dirs = calloc(n, sizeof(DirStamp));
+  for (int i = 0; i < n; i++) {
+    long long sec;
+    long nsec;
+    if (sscanf(p, " %lld %ld%n", &sec, &nsec, &len) != 2)
+      return;
+    dirs[i].mtime = (struct timespec){sec, nsec};
+    p += len;
+  }
+  if (*p++ != ' ')
+    return;
+
+  // The key is the include paths, each followed by a tab, and the
+  // file name. The include paths are absolute, so the directories can
+  // be stat'ed from the server's working directory.
+  char *key = strdup(p);
+  char *filename = strrchr(key, '\t');
+  if (!filename)
+    return;
+  filename++;
+
+  char *s = key;
+  for (int i = 0; i < n; i++) {
+    char *tab = strchr(s, '\t');
+    if (!tab)
+      return;
+    char *dir = strndup(s, tab - s);
+    dirs[i].dir = dirname(format("%s/%s", dir, filename));
+    s = tab + 1;
+
+    if (!hashmap_get(&dir_mtimes, dirs[i].dir)) {
+      struct timespec *t = malloc(sizeof(struct timespec));
+      *t = get_dir_mtime(dirs[i].dir);
+      hashmap_put(&dir_mtimes, dirs[i].dir, t);
+    }
+  }
+
+  CachedInclude *ci = calloc(1, sizeof(CachedInclude));
+  ci->idx = idx;
+  ci->dirs = dirs;
+  ci->ndirs = n;
+  hashmap_put(&include_cache, key, ci);
+}
+
+static void handle_report(char *line) {
+  if (line[0] == 'T' && line[1] == ' ') {
+    unsigned long long dev, ino;
+    long long sec, size;
+    long nsec;
+    int len;
+    if (sscanf(line + 2, "%llu %llu %lld %ld %lld %n",
+               &dev, &ino, &sec, &nsec, &size, &len) != 5)
+      return;
+    FileId id = {dev, ino, {sec, nsec}, size};
+    add_cached_file(&id, line + 2 + len);
+    return;
+  }
+
+  if (line[0] == 'I' && line[1] == ' ')
+    add_cached_include(line + 2);
+}
+
+static void read_reports(int fd) {
+  static char *buf;
+  static int len, cap;
+
+  for (;;) {
+    if (cap - len < 4096) {
+      cap = cap * 2 + 4096;
+      buf = realloc(buf, cap);
+    }
+    int n = read(fd, buf + len, cap - len - 1);
+    if (n <= 0)
+      break;
+    len += n;
+  }
+
+  buf[len] = '\0';
+  char *p = buf;
+  for (char *q; (q = strchr(p, '\n')); p = q + 1) {
+    *q = '\0';
+    handle_report(p);
+  }
+
+  len -= p - buf;
+  memmove(buf, p, len);
+}
+
+// Directory mtimes are refreshed once per request, so that children
+// don't have to stat each directory on every #include.
+static void refresh_dir_mtimes(void) {
+  for (int i = 0; i < dir_mtimes.capacity; i++) {
+    HashEntry *ent = &dir_mtimes.buckets[i];
+    if (ent->key && ent->key != (void *)-1)
+      *(struct timespec *)ent->val = get_dir_mtime(ent->key);
+  }
+}
+
+static void handle_sigchld(int sig) {
+  int saved = errno;
+  while (write(sigchld_pipe[1], "", 1) == -1 && errno == EINTR);
+  errno = saved;
+}
+
+static bool read_full(int fd, void *buf, size_t len) {
+  while (len > 0) {
+    ssize_t n = read(fd, buf, len);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    buf = (char *)buf + n;
+    len -= n;
+  }
+  return true;
+}
+
+static bool write_full(int fd, void *buf, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(fd, buf, len);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    buf = (char *)buf + n;
+    len -= n;
+  }
+  return true;
+}
+
+static char *self_exe(void) {
+  char *buf = calloc(1, PATH_MAX + 1);
+  if (readlink("/proc/self/exe", buf, PATH_MAX) == -1)
+    return "";
+  return buf;
+}
+
+// A request consists of the length of the payload, followed by the
+// payload itself: NUL-terminated strings for the client's executable,
+// working directory, umask, arguments and environment, with the umask
+// and the counts of the argument and environment lists in decimal.
+// The client's stdin, stdout and stderr are sent along with the first
+// byte.
+static char **read_strings(char **p, char *end, int *count) {
+  if (*p >= end)
+    return NULL;
+  *count = atoi(*p);
+  *p += strlen(*p) + 1;
+
+  char **arr = calloc(*count + 1, sizeof(char *));
+  for (int i = 0; i < *count; i++) {
+    if (*p >= end)
+      return NULL;
+    arr[i] = *p;
+    *p += strlen(*p) + 1;
+  }
+  return arr;
+}
+
+// Let the client compile by itself. The server still sends our exit
+// status when we exit, but the client doesn't read it after this.
+static void reject_request(int conn) NORETURN;
+
+static void reject_request(int conn) {
+  char reply = 'R';
+  write_full(conn, &reply, 1);
+  exit(1);
+}
+
+// Read a request from a connection and run it. This is called in a
+// child of the server, so a client that is slow to send its request
+// holds up only its own child, not the server. Never returns.
+static void run_request(int conn) {
+  char byte;
+  int fds[3];
+  char ctl[CMSG_SPACE(sizeof(fds))];
+  struct iovec iov = {&byte, 1};
+  struct msghdr msg = {0};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = ctl;
+  msg.msg_controllen = sizeof(ctl);
+
+  // Don't wait forever for a client that sends nothing.
+  struct timeval timeout = {10, 0};
+  setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+  if (recvmsg(conn, &msg, 0) != 1)
+    reject_request(conn);
+
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  if (!cmsg || cmsg->cmsg_type != SCM_RIGHTS ||
+      cmsg->cmsg_len != CMSG_LEN(sizeof(fds)))
+    reject_request(conn);
+  memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+
+  uint32_t len;
+  if (!read_full(conn, &len, sizeof(len)))
+    reject_request(conn);
+  char *buf = calloc(1, len + 1);
+  if (!read_full(conn, buf, len))
+    reject_request(conn);
+
+  char *p = buf;
+  char *end = buf + len;
+  char *exe = p;
+  p += strlen(p) + 1;
+  char *cwd = p;
+  p += strlen(p) + 1;
+  char *mask = p;
+  p += strlen(p) + 1;
+
+  char **argv, **envp;
+  int argc, envc;
+  if (p > end || !(argv = read_strings(&p, end, &argc)) ||
+      !(envp = read_strings(&p, end, &envc)))
+    reject_request(conn);
+
+  // Only serve clients running the same compiler, or the output
+  // could differ from what the client would produce itself.
+  if (strcmp(exe, self_exe()))
+    reject_request(conn);
+
+  char reply = 'A';
+  if (!write_full(conn, &reply, 1))
+    exit(1);
+  close(conn);
+
+  // Run the command as the client would have run it itself.
+  signal(SIGPIPE, SIG_DFL);
+  umask(atoi(mask));
+
+  for (int i = 0; i < 3; i++) {
+    dup2(fds[i], i);
+    close(fds[i]);
+  }
+
+  if (chdir(cwd))
+    error("%s: %s", cwd, strerror(errno));
+  request_cwd = cwd;
+
+  extern char **environ;
+  environ = envp;
+  unsetenv("WIDCC_SERVER");
+
+  exit(run_driver(argc, argv));
+}
+
+// Fork a child to serve a connection. The server keeps the connection
+// to send the child's exit status to the client when the child exits.
+static void serve_request(int conn, int listen_fd, Request *reqs, int *nreqs) {
+  read_reports(report_rd);
+  refresh_dir_mtimes();
+  fflush(NULL);
+
+  pid_t pid = fork();
+  if (pid == -1) {
+    close(conn);
+    return;
+  }
+
+  if (pid > 0) {
+    reqs[(*nreqs)++] = (Request){pid, conn};
+    return;
+  }
+
+  close(listen_fd);
+  close(sigchld_pipe[0]);
+  close(sigchld_pipe[1]);
+  close(report_rd);
+  for (int i = 0; i < *nreqs; i++)
+    close(reqs[i].conn);
+  signal(SIGCHLD, SIG_DFL);
+  run_request(conn);
+}
+
+// Returns true if the other end of conn runs as the same user as us.
+static bool is_same_user(int conn) {
+  struct ucred cred;
+  socklen_t len = sizeof(cred);
+  return getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0 &&
+         cred.uid == getuid();
+}
+
+static void reap_children(Request *reqs, int *nreqs) {
+  for (;;) {
+    int status;
+    pid_t pid = waitpid(-1, &status, WNOHANG);
+    if (pid <= 0)
+      return;
+
+    for (int i = 0; i < *nreqs; i++) {
+      if (reqs[i].pid != pid)
+        continue;
+
+      int32_t code = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+      write_full(reqs[i].conn, &code, sizeof(code));
+      close(reqs[i].conn);
+      reqs[i] = reqs[--*nreqs];
+      break;
+    }
+  }
+}
+
+void run_server(char *path) {
+  int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listen_fd == -1)
+    error("socket failed: %s", strerror(errno));
+
+  struct sockaddr_un addr = {0};
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path))
+    error("%s: socket path too long", path);
+  strcpy(addr.sun_path, path);
+
+  // Replace a stale socket, but never remove anything else.
+  struct stat st;
+  if (lstat(path, &st) == 0) {
+    if (!S_ISSOCK(st.st_mode))
+      error("%s: file exists and is not a socket", path);
+    unlink(path);
+  }
+
+  mode_t mask = umask(077);
+  int r = bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr));
+  umask(mask);
+  if (r == -1 || listen(listen_fd, 64) == -1)
+    error("%s: %s", path, strerror(errno));
+
+  int report_pipe[2];
+  if (pipe(report_pipe) == -1 || pipe(sigchld_pipe) == -1)
+    error("pipe failed: %s", strerror(errno));
+  fcntl(report_pipe[0], F_SETFL, O_NONBLOCK);
+  fcntl(report_pipe[1], F_SETFD, FD_CLOEXEC);
+  fcntl(sigchld_pipe[0], F_SETFL, O_NONBLOCK);
+  fcntl(sigchld_pipe[1], F_SETFL, O_NONBLOCK);
+
+  struct sigaction sa = {0};
+  sa.sa_handler = handle_sigchld;
+  sa.sa_flags = SA_RESTART;
+  sigaction(SIGCHLD, &sa, NULL);
+  signal(SIGPIPE, SIG_IGN);
+
+  // Children write to the report pipe; we only read from it.
+  report_rd = report_pipe[0];
+  report_fd = report_pipe[1];
+
+  Request *reqs = NULL;
+  int nreqs = 0;
+  int cap = 0;
+
+  for (;;) {
+    struct pollfd fds[3] = {
+      {.fd = listen_fd, .events = POLLIN},
+      {.fd = report_pipe[0], .events = POLLIN},
+      {.fd = sigchld_pipe[0], .events = POLLIN},
+    };
+
+    if (poll(fds, 3, -1) == -1) {
+      if (errno == EINTR)
+        continue;
+      error("poll failed: %s", strerror(errno));
+    }
+
+    if (fds[1].revents & POLLIN)
+      read_reports(report_pipe[0]);
+
+    if (fds[2].revents & POLLIN) {
+      char buf[64];
+      while (read(sigchld_pipe[0], buf, sizeof(buf)) > 0);
+      reap_children(reqs, &nreqs);
+    }
+
+    if (fds[0].revents & POLLIN) {
+      int conn = accept(listen_fd, NULL, NULL);
+      if (conn == -1)
+        continue;
+      if (!is_same_user(conn)) {
+        close(conn);
+        continue;
+      }
+
+      if (nreqs == cap) {
+        cap = cap * 2 + 16;
+        reqs = realloc(reqs, sizeof(Request) * cap);
+      }
+      serve_request(conn, listen_fd, reqs, &nreqs);
+    }
+  }
+}
+
+static void add_string(FILE *out, char *s) {
+  fwrite(s, 1, strlen(s) + 1, out);
+}
+
+// If WIDCC_SERVER is set, ask the server to run this command. Returns
+// only if the server is not available, in which case we compile by
+// ourselves as usual.
+void run_client(int argc, char **argv) {
+  char *path = getenv("WIDCC_SERVER");
+  if (!path || !*path)
+    return;
+
+  struct sockaddr_un addr = {0};
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path))
+    return;
+  strcpy(addr.sun_path, path);
+
+  int conn = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (conn == -1)
+    return;
+  if (connect(conn, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+    close(conn);
+    return;
+  }
+
+  char *cwd = getcwd(NULL, 0);
+  if (!cwd) {
+    close(conn);
+    return;
+  }
+
+  char *buf;
+  size_t buflen;
+  FILE *out = open_memstream(&buf, &buflen);
+  add_string(out, self_exe());
+  add_string(out, cwd);
+
+  mode_t mask = umask(0);
+  umask(mask);
+  add_string(out, format("%d", mask));
+
+  add_string(out, format("%d", argc));
+  for (int i = 0; i < argc; i++)
+    add_string(out, argv[i]);
+
+  extern char **environ;
+  int envc = 0;
+  while (environ[envc])
+    envc++;
+  add_string(out, format("%d", envc));
+  for (int i = 0; i < envc; i++)
+    add_string(out, environ[i]);
+  fclose(out);
+
+  // Send our standard streams along with the first byte.
+  int fds[3] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+  char ctl[CMSG_SPACE(sizeof(fds))];
+  memset(ctl, 0, sizeof(ctl));
+  char byte = 0;
+  struct iovec iov = {&byte, 1};
+  struct msghdr msg = {0};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = ctl;
+  msg.msg_controllen = sizeof(ctl);
+
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+  signal(SIGPIPE, SIG_IGN);
+
+  uint32_t len = buflen;
+  char reply;
+  if (sendmsg(conn, &msg, 0) != 1 || !write_full(conn, &len, sizeof(len)) ||
+      !write_full(conn, buf, len) || !read_full(conn, &reply, 1) || reply != 'A') {
+    close(conn);
+    signal(SIGPIPE, SIG_DFL);
+    return;
+  }
+
+  // The request has been accepted, so we can't fall back anymore.
+  int32_t code;
+  if (!read_full(conn, &code, sizeof(code)))
+    error("lost connection to compile server: %s", path);
+  exit(code);
+}
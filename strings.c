@@ -27,5 +27,6 @@ char *format(char *fmt, ...) {
   vfprintf(out, fmt, ap);
   va_end(ap);
   fclose(out);
+  count_alloc(MEM_STRING, buflen + 1);
   return buf;
 }
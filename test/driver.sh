@@ -170,6 +170,258 @@ check -idirafter
 echo "#include \"idirafter\"" | $testcc -idirafter $tmp/dir1 -I$tmp/dir2 -E -xc - | grep -q bar
 check -idirafter
 
+# -fno-integrated-cc1
+echo 'int main() { return 42; }' > $tmp/foo.c
+$testcc -fno-integrated-cc1 -o $tmp/foo $tmp/foo.c
+$tmp/foo
+[ "$?" = 42 ]
+check -fno-integrated-cc1
+
+$testcc -### -c -o /dev/null $tmp/foo.c 2>&1 | grep -q -- '-cc1 -cc1-input'
+check -###
+
+# -fno-integrated-as
+$testcc -fno-integrated-as -c -o $tmp/foo.o $tmp/foo.c
+$testcc -o $tmp/foo $tmp/foo.o
+$tmp/foo
+[ "$?" = 42 ]
+check -fno-integrated-as
+
+$testcc -### -c -o /dev/null $tmp/foo.c 2>&1 | grep -q -- '-cc1-obj'
+check -fintegrated-as
+
+# Debug info falls back to the system assembler
+echo 'int x = 3; int main() { return x; }' > $tmp/foo.c
+$testcc -g -o $tmp/foo $tmp/foo.c
+$tmp/foo
+[ "$?" = 3 ]
+check '-fintegrated-as fallback'
+
+# -pipe
+echo 'int main() { return 42; }' > $tmp/foo.c
+$testcc -pipe -fno-integrated-as -o $tmp/foo $tmp/foo.c
+$tmp/foo
+[ "$?" = 42 ]
+check -pipe
+
+$testcc -### -pipe -fno-integrated-as -c -o $tmp/foo.o $tmp/foo.c 2>&1 | grep -q -- '^as -o .* -$'
+check -pipe
+
+echo 'int x = ;' > $tmp/bad.c
+rm -f $tmp/bad.o
+! $testcc -pipe -fno-integrated-as -c -o $tmp/bad.o $tmp/bad.c 2> /dev/null && [ ! -f $tmp/bad.o ]
+check '-pipe error'
+
+# -j
+for i in 1 2 3 4 5; do echo "int f$i(void) { return $i; }" > $tmp/j$i.c; done
+echo 'int f1(),f2(),f3(),f4(),f5(); int main() { return f1()+f2()+f3()+f4()+f5(); }' > $tmp/jmain.c
+$testcc -j4 -o $tmp/foo $tmp/jmain.c $tmp/j1.c $tmp/j2.c $tmp/j3.c $tmp/j4.c $tmp/j5.c
+$tmp/foo
+[ "$?" = 15 ]
+check -j
+
+(cd $tmp; $OLDPWD/$testcc -j 3 -c j1.c j2.c j3.c j4.c j5.c)
+[ -f $tmp/j1.o ] && [ -f $tmp/j5.o ]
+check '-j -c'
+
+echo '#warning first' > $tmp/w1.c
+echo 'int x = ;' > $tmp/bad.c
+echo '#warning second' > $tmp/w2.c
+$testcc -c $tmp/w1.c $tmp/bad.c $tmp/w2.c $tmp/j1.c > $tmp/out1 2>&1
+status1=$?
+$testcc -j4 -c $tmp/w1.c $tmp/bad.c $tmp/w2.c $tmp/j1.c > $tmp/out2 2>&1
+status2=$?
+[ $status1 = 1 ] && [ $status2 = 1 ] && cmp -s $tmp/out1 $tmp/out2
+check '-j diagnostics'
+
+# -j with a make jobserver; all job slots must be given back
+rm -f $tmp/j*.o
+mkfifo $tmp/jobserver
+exec 7<>$tmp/jobserver
+printf xx >&7
+(cd $tmp; MAKEFLAGS=" -j3 --jobserver-auth=fifo:$tmp/jobserver" $OLDPWD/$testcc -j8 -c j1.c j2.c j3.c j4.c j5.c)
+[ -f $tmp/j1.o ] && [ -f $tmp/j5.o ] && [ "$(dd bs=1 count=3 iflag=nonblock <&7 2>/dev/null)" = xx ]
+check '-j jobserver'
+exec 7>&-
+
+# --server
+(cd $tmp; exec $OLDPWD/$testcc --server $tmp/server) &
+server_pid=$!
+trap 'kill $server_pid; rm -rf $tmp' INT TERM HUP EXIT
+while [ ! -S $tmp/server ]; do sleep 0.1; done
+[ "$(stat -c %a $tmp/server)" = 700 ]
+check '--server socket mode'
+echo '#define VAL 3' > $tmp/server.h
+echo '#include <server.h>
+int main() { return VAL; }' > $tmp/server.c
+$testcc -I$tmp -S -o $tmp/server1.s $tmp/server.c
+WIDCC_SERVER=$tmp/server $testcc -I$tmp -S -o $tmp/server2.s $tmp/server.c
+WIDCC_SERVER=$tmp/server $testcc -I$tmp -S -o $tmp/server3.s $tmp/server.c
+cmp -s $tmp/server1.s $tmp/server2.s && cmp -s $tmp/server1.s $tmp/server3.s
+check '--server'
+echo '#define VAL 4' > $tmp/server.h
+WIDCC_SERVER=$tmp/server $testcc -I$tmp -o $tmp/server.exe $tmp/server.c
+$tmp/server.exe
+[ "$?" = 4 ]
+check '--server invalidation'
+! WIDCC_SERVER=$tmp/server $testcc -c -o $tmp/server.o $tmp/nonexistent.c 2> /dev/null
+check '--server error'
+(umask 077; WIDCC_SERVER=$tmp/server $testcc -I$tmp -c -o $tmp/server-umask.o $tmp/server.c)
+[ "$(stat -c %a $tmp/server-umask.o)" = 600 ]
+check '--server umask'
+# The server runs in $tmp, which has only inc2/x.h. The same relative
+# include paths must be searched afresh in $tmp/proj, which has both.
+mkdir -p $tmp/inc2 $tmp/proj/inc1 $tmp/proj/inc2
+echo 'int tmp_inc2;' > $tmp/inc2/x.h
+echo 'int proj_inc1;' > $tmp/proj/inc1/x.h
+echo 'int proj_inc2;' > $tmp/proj/inc2/x.h
+echo '#include <x.h>' > $tmp/incl.c
+cp $tmp/incl.c $tmp/proj/incl.c
+(cd $tmp; WIDCC_SERVER=$tmp/server $OLDPWD/$testcc -Iinc1 -Iinc2 -E incl.c) | grep -q tmp_inc2 &&
+(cd $tmp/proj; WIDCC_SERVER=$tmp/server $OLDPWD/$testcc -Iinc1 -Iinc2 -E incl.c) | grep -q proj_inc1 &&
+(cd $tmp; WIDCC_SERVER=$tmp/server $OLDPWD/$testcc -Iinc1 -Iinc2 -E incl.c) | grep -q tmp_inc2
+check '--server relative include paths'
+kill $server_pid
+wait $server_pid 2> /dev/null
+trap 'rm -rf $tmp' INT TERM HUP EXIT
+echo 'not a socket' > $tmp/server.txt
+! $testcc --server $tmp/server.txt 2> /dev/null
+grep -q 'not a socket' $tmp/server.txt
+check '--server non-socket path'
+
+# -fcache-dir
+echo 'int main() { return 5; }' > $tmp/cache.c
+$testcc -fcache-dir=$tmp/cache -c -o $tmp/cache1.o $tmp/cache.c
+echo '/* comment */ int main() { return 5; }' > $tmp/cache.c
+$testcc -fcache-dir=$tmp/cache -c -o $tmp/cache2.o $tmp/cache.c
+cmp -s $tmp/cache1.o $tmp/cache2.o && [ $(ls $tmp/cache | wc -l) = 1 ]
+check -fcache-dir
+$testcc -fcache-dir=$tmp/cache -fPIC -c -o $tmp/cache3.o $tmp/cache.c
+$testcc -fcache-dir=$tmp/cache -S -o $tmp/cache.s $tmp/cache.c
+[ $(ls $tmp/cache | wc -l) = 3 ]
+check -fcache-dir
+$testcc -o $tmp/foo $tmp/cache2.o
+$tmp/foo
+[ "$?" = 5 ]
+check -fcache-dir
+
+# -ftime-report
+echo 'int main() { return 0; }' > $tmp/foo.c
+$testcc -ftime-report -c -o $tmp/foo.o $tmp/foo.c 2>&1 | grep -q '^  parse '
+check -ftime-report
+$testcc -ftime-report=json -o $tmp/foo $tmp/foo.c 2>&1 | grep -q '^{"file": "driver", .*"subprocesses": 2,'
+check -ftime-report=json
+$testcc -ftime-report -c -o $tmp/foo.o $tmp/foo.c 2>&1 | grep -q 'bytes of source tokenized at .* MB/s'
+check '-ftime-report lexer throughput'
+
+# Comments and identifiers spanning the lexer's 16-byte blocks
+printf '/* %040d */ int x%050d_x /* * / */; // %030d\nint \xc3\xa4%020d\xc3\xa4_y;' 0 0 0 0 > $tmp/lex.c
+$testcc -E -P -o- $tmp/lex.c | tr -d '\n' | grep -q '^ *int x0*_x ;int [^ 0]*0*[^ 0]*_y;$'
+check 'lexer fast paths'
+printf '#define S(x) #x\n#define T(x) S(x)\nT(a<<=b>>=c...d->e..f&&=g||h##i-->j@)\n' > $tmp/punct.c
+$testcc -E -P -o- $tmp/punct.c | grep -q '^"a<<=b>>=c...d->e..f&&=g||h##i-->j@"$'
+check punctuators
+
+# -fmem-report
+$testcc -fmem-report -c -o $tmp/foo.o $tmp/foo.c 2>&1 | grep -q '^  Token  *[1-9]'
+check -fmem-report
+$testcc -fmem-report=json -c -o $tmp/foo.o $tmp/foo.c 2>&1 | grep -q '"peak_rss": [1-9]'
+check -fmem-report=json
+$testcc -fmem-report -c -o $tmp/foo.o $tmp/foo.c 2>&1 | grep -q '^  arenas: [1-9][0-9]* bytes for tokens, [1-9][0-9]* bytes for AST'
+check '-fmem-report arenas'
+
+# -fbatch-cc1
+echo '#define X 1
+static int counter = __COUNTER__;
+static char name[] = "batch" "header";' > $tmp/batch.h
+for i in 1 2 3; do echo "#include \"batch.h\"
+int b$i(void) { return X + counter + __COUNTER__ + sizeof(name) + $i; }" > $tmp/batch$i.c; done
+(cd $tmp; $OLDPWD/$testcc -S batch1.c batch2.c batch3.c)
+for i in 1 2 3; do mv $tmp/batch$i.s $tmp/batch$i.ref; done
+(cd $tmp; $OLDPWD/$testcc -fbatch-cc1 -S batch1.c batch2.c batch3.c)
+cmp -s $tmp/batch1.s $tmp/batch1.ref && cmp -s $tmp/batch3.s $tmp/batch3.ref
+check -fbatch-cc1
+$testcc -### -fbatch-cc1 -c $tmp/batch1.c $tmp/batch2.c 2>&1 | grep -q -- '-cc1-input .*batch1.c .*-cc1-input .*batch2.c'
+check -fbatch-cc1
+
+# Response file
+echo "-fbatch-cc1 -S '$tmp/batch1.c' $tmp/batch2.c" > $tmp/rsp
+rm -f $tmp/batch1.s $tmp/batch2.s
+(cd $tmp; $OLDPWD/$testcc @rsp)
+cmp -s $tmp/batch2.s $tmp/batch2.ref
+check '@file'
+
+# Line endings and line continuations
+printf 'int a = \\\r\n__LINE__;\r\nint b = __LINE__;\rint c = __LINE__;' > $tmp/crlf.c
+$testcc -E -P -o- $tmp/crlf.c | tr -d '\n' | grep -q 'int a = 1;int b = 3;int c = 4;'
+check 'CRLF line endings'
+
+# Line numbers are counted while tokenizing
+printf '/*\n\n*/ int a = __LINE__;\n/* */ int b = __LINE__;\n' > $tmp/lines.c
+$testcc -E -P -o- $tmp/lines.c | tr -d '\n' | grep -q 'int a = 3;int b = 4;'
+check 'line numbers'
+printf '/*\n\n*/ int a;\n\n#error foo\n' > $tmp/lines.c
+$testcc -E -o /dev/null $tmp/lines.c 2>&1 | grep -q 'lines.c:5:'
+check 'line numbers in diagnostics'
+
+# Keywords that are ordinary identifiers in strict modes
+echo 'int asm, typeof; struct typeof { int typeof; }; int main(void) { return asm + typeof; }' > $tmp/kw.c
+$testcc -std=c11 -c -o $tmp/kw.o $tmp/kw.c
+check 'asm and typeof as identifiers'
+echo 'typeof(1) x; int main(void) { return x; }' > $tmp/kw.c
+$testcc -std=c23 -c -o $tmp/kw.o $tmp/kw.c
+check 'typeof in C23'
+
+# Excluded #if blocks are skipped without tokenizing them
+printf '#if 0\n"/*" #endif\n'"'"' /*\n/*\n#endif */\n/**/ # /**/ if 1\n#else\n#endif\n#elif 1\nint a = __LINE__;\n#endif\nint b = __LINE__;\n' > $tmp/skip.c
+$testcc -E -P -o- $tmp/skip.c | tr -d '\n' | grep -q '^int a = 10;int b = 12;$'
+check 'excluded #if blocks'
+$testcc -ftime-report -E -o /dev/null $tmp/skip.c 2>&1 | grep -q '^  [1-9][0-9]* bytes of source skipped'
+check '-ftime-report skipped bytes'
+
+# Precompiled headers
+printf '#define V 1\ntypedef int T;\n' > $tmp/pch.h
+touch -r $tmp/pch.h $tmp/pch.ref
+rm -f $tmp/pch.h.pch
+$testcc -c $tmp/pch.h
+[ -f $tmp/pch.h.pch ]
+check 'precompile header'
+
+# Change the header without changing its size or timestamp to see
+# that the precompiled header is used.
+printf '#define V 2\ntypedef int T;\n' > $tmp/pch.h
+touch -r $tmp/pch.ref $tmp/pch.h
+echo 'T main(void) { return V; }' > $tmp/pch.c
+$testcc -include $tmp/pch.h -o $tmp/out $tmp/pch.c
+$tmp/out
+[ $? = 1 ]
+check 'use precompiled header'
+
+touch $tmp/pch.h
+$testcc -include $tmp/pch.h -o $tmp/out $tmp/pch.c
+$tmp/out
+[ $? = 2 ]
+check 'stale precompiled header'
+
+# A precompiled header that has been cut short is ignored.
+$testcc -o $tmp/pch.h.pch $tmp/pch.h
+head -c -16 $tmp/pch.h.pch > $tmp/pch.tmp && mv $tmp/pch.tmp $tmp/pch.h.pch
+$testcc -include $tmp/pch.h -o $tmp/out $tmp/pch.c
+$tmp/out
+[ $? = 2 ]
+check 'truncated precompiled header'
+
+printf '#define V 3\ntypedef int T;\n' > $tmp/pch.inc
+rm -f $tmp/pch.inc.pch
+$testcc -x c-header -o $tmp/pch.inc.pch $tmp/pch.inc
+[ -f $tmp/pch.inc.pch ]
+check '-x c-header'
+
+# A file whose size is a multiple of the page size
+(printf 'int x = __LINE__;\n'; head -c 4059 /dev/zero | tr '\0' ' '; printf '\nint y = __LINE__;\n') > $tmp/page.c
+$testcc -E -P -o- $tmp/page.c | tr -d '\n ' | grep -q 'intx=1;inty=3;'
+check 'page-sized source file'
+
 # -fcommon
 echo 'int foo;' | $testcc -S -o- -xc - | grep -q '\.comm "foo"'
 check '-fcommon (default)'
@@ -294,6 +546,61 @@ echo 'foo' > $tmp/next3/file2.h
 $testcc -I$tmp/next1 -I$tmp/next2 -I$tmp/next3 -E $tmp/file.c | grep -q foo
 check '#include_next'
 
+# #include_next continues after the directory of the current file,
+# even if the file was found by an earlier lookup.
+mkdir -p $tmp/next4 $tmp/next5
+echo '#include_next <x.h>' > $tmp/next4/x.h
+echo '#define BX 1' > $tmp/next5/x.h
+touch $tmp/next5/y.h
+printf '#include <x.h>\n#include <y.h>\n#undef BX\n#include <x.h>\nint v = BX;\n' > $tmp/file.c
+$testcc -I$tmp/next4 -I$tmp/next5 -E $tmp/file.c | grep -q 'int v = 1;'
+check '#include_next after a cached lookup'
+
+# Include lookups are answered from directory listings
+echo '#include "file1.h"' > $tmp/file.c
+$testcc -I$tmp/next1 -I$tmp/next2 -I$tmp/next3 -ftime-report -E -o /dev/null $tmp/file.c 2>&1 | \
+  grep -q '^  [0-9]* include lookups answered from [0-9]* directory listings'
+check '-ftime-report include lookups'
+
+# #pragma once and include guards recognize a file reached through
+# another path.
+mkdir -p $tmp/alias/sub
+echo '#pragma once' > $tmp/alias/once.h
+echo 'struct Once { int x; };' >> $tmp/alias/once.h
+printf '#ifndef GUARD_H\n#define GUARD_H\nstruct Guard { int x; };\n#endif\n' > $tmp/alias/guard.h
+rm -f $tmp/alias/link
+ln -s $tmp/alias $tmp/alias/link
+printf '#include "once.h"\n#include "sub/../once.h"\n#include "link/once.h"\n' > $tmp/alias/alias.c
+printf '#include "guard.h"\n#include "./guard.h"\n#include "link/guard.h"\n' >> $tmp/alias/alias.c
+[ "$($testcc -E $tmp/alias/alias.c | grep -c 'struct')" = 2 ]
+check 'aliased #pragma once and include guards'
+
+# Multiple-include optimization. -H prints included files and those
+# that are not guarded.
+mkdir -p $tmp/mi
+printf '#if !defined(MI1_H)\n#define MI1_H\n#endif\n' > $tmp/mi/mi1.h
+printf '#pragma GCC system_header\n#ifndef MI2_H\n#define MI2_H\n#endif /* MI2_H */\n' > $tmp/mi/mi2.h
+printf '#ifndef MI3_H\n#define MI3_H\n#else\nint mi3;\n#endif\n' > $tmp/mi/mi3.h
+printf '#include "mi1.h"\n#include "mi2.h"\n#include "mi3.h"\n' > $tmp/mi/mi.c
+cat $tmp/mi/mi.c $tmp/mi/mi.c > $tmp/mi/mi2.c
+$testcc -E -H -o $tmp/mi/out $tmp/mi/mi2.c 2> $tmp/mi/log
+[ "$(grep -c '^\. ' $tmp/mi/log)" = 4 ] && grep -q 'int mi3;' $tmp/mi/out &&
+  [ "$(sed -n '/^Multiple include guards/,$p' $tmp/mi/log | tail -n +2)" = "$tmp/mi/mi3.h" ]
+check 'multiple-include optimization'
+
+# #if arithmetic is done in intmax_t/uintmax_t, and operands that are
+# not evaluated may divide by zero.
+printf '#if -1 > 0u && 0xFFFFFFFF + 1 == 0x100000000 && (0 && 1 / 0) == 0\nok\n#endif\n' > $tmp/ifexpr.c
+printf '#if (1 ? 2 : 1 %% 0) == 2 && undefined_ident == 0 && (0 ? 1u : -1) > 0\nok2\n#endif\n' >> $tmp/ifexpr.c
+$testcc -E -P $tmp/ifexpr.c | tr -d '\n' | grep -q '^okok2$'
+check '#if expressions'
+
+# A `##` followed by `,` can be read in two ways, which must not
+# multiply when they are chained.
+printf '#define F(x) x%s\nint x;\n' "$(printf ' ## ,%.0s' $(seq 100))" > $tmp/pastechain.c
+$testcc -E -P $tmp/pastechain.c | grep -q 'int x;'
+check 'long ## chain'
+
 # -static
 echo 'extern int bar; int foo() { return bar; }' > $tmp/foo.c
 echo 'int foo(); int bar=3; int main() { foo(); }' > $tmp/bar.c
@@ -39,6 +39,19 @@ ASSERT(0, strcmp("bbz", STR(M5(M5(z,a),b)) ));
 #define join(c, d) in_between(c hash_hash d)
 ASSERT(0, strcmp("x ## y", join(x,y) ));
 
+#define EMPTY
+#define EMPTYF()
+#define M6(...) H([__VA_OPT__(x __VA_ARGS__ y)])
+ASSERT(0, strcmp("[]", M6(EMPTY EMPTYF()) ));
+ASSERT(0, strcmp("[x EMPTYF y]", M6(EMPTYF) ));
+ASSERT(0, strcmp("[x 1 y]", M6(EMPTY 1) ));
+
+#define M7(x) x + x
+ASSERT(0, strcmp("a b + a b + a b + a b", STR(M7(M7(a b))) ));
+
+#define M8(x, y) x ## # y
+ASSERT(0, strcmp("b", M8(,b) ));
+
 
 printf("OK\n");
 
@@ -1,10 +1,32 @@
 #include "widcc.h"
+#include <sys/mman.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 // Input file
 static File *current_file;
 
 // A list of all input files.
 static File **input_files;
+static HashMap input_files_map;
+static int input_files_len;
+
+// If true, tokenize_file() keeps the tokens of each file so that they
+// can be reused when the file is read again in a later translation
+// unit in the same process.
+bool reuse_tokens;
+static HashMap token_cache;
+
+// Interned spellings. atoms[i] is the spelling of atom i.
+static HashMap atom_map;
+static Atom *atoms;
+static int atoms_len;
+static int atoms_capacity;
+
+// The line number of the current position
+static int line_no;
 
 // True if the current position is at the beginning of a line
 static bool at_bol;
@@ -101,13 +123,44 @@ bool consume(Token **rest, Token *tok, char *str) {
   return false;
 }
 
+// Same as skip() and consume() but compare atoms, which is just an
+// integer comparison.
+Token *skip_atom(Token *tok, int atom) {
+  if (tok->atom != atom) {
+    Atom *a = get_atom(atom);
+    error_tok(tok, "expected '%.*s'", a->len, a->name);
+  }
+  return tok->next;
+}
+
+bool consume_atom(Token **rest, Token *tok, int atom) {
+  if (tok->atom == atom) {
+    *rest = tok->next;
+    return true;
+  }
+  return false;
+}
+
+// Give tok its own copy of the out-of-line fields and return it.
+TokenExtra *new_extra(Token *tok) {
+  TokenExtra *x = arena_calloc(&token_arena, sizeof(TokenExtra));
+  count_alloc(MEM_TOKEN_EXTRA, sizeof(TokenExtra));
+  if (tok->extra)
+    *x = *tok->extra;
+  tok->extra = x;
+  return x;
+}
+
 // Create a new token.
 static Token *new_token(TokenKind kind, char *start, char *end) {
-  Token *tok = calloc(1, sizeof(Token));
+  Token *tok = arena_calloc(&token_arena, sizeof(Token));
+  count_alloc(MEM_TOKEN, sizeof(Token));
+  stats.tokens++;
   tok->kind = kind;
   tok->loc = start;
   tok->len = end - start;
   tok->file = current_file;
+  tok->line_no = line_no;
   tok->at_bol = at_bol;
   tok->has_space = has_space;
 
@@ -115,22 +168,168 @@ static Token *new_token(TokenKind kind, char *start, char *end) {
   return tok;
 }
 
+// This is called with short string constants, so a plain loop that
+// the C compiler can unroll is faster than strncmp() and strlen().
 static bool startswith(char *p, char *q) {
-  return strncmp(p, q, strlen(q)) == 0;
+  for (; *q; p++, q++)
+    if (*p != *q)
+      return false;
+  return true;
+}
+
+// Whitespace other than newline, which is significant to the
+// preprocessor.
+static bool is_hspace(char c) {
+  return c == ' ' || c == '\t' || c == '\v' || c == '\f' || c == '\r';
+}
+
+static bool is_ascii_ident1(char c) {
+  return ('a' <= c && c <= 'z') || ('A' <= c && c <= 'Z') || c == '_' || c == '$';
+}
+
+#ifndef __SSE2__
+static bool is_ascii_ident2(char c) {
+  return is_ascii_ident1(c) || ('0' <= c && c <= '9');
+}
+#endif
+
+// The following functions skip runs of bytes of a certain class. With
+// SSE2, they examine 16 bytes at a time. The loads are aligned, and an
+// aligned load never crosses a page boundary, so it is safe to read
+// past the terminating NUL as long as the scan stops at it.
+#ifdef __SSE2__
+typedef int ScanFn(__m128i v);
+
+static int scan_hspace(__m128i v) {
+  __m128i ctrl = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('\t' - 1)),
+                               _mm_cmplt_epi8(v, _mm_set1_epi8('\r' + 1)));
+  ctrl = _mm_andnot_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')), ctrl);
+  __m128i m = _mm_or_si128(ctrl, _mm_cmpeq_epi8(v, _mm_set1_epi8(' ')));
+  return ~_mm_movemask_epi8(m) & 0xffff;
+}
+
+static int scan_ascii_ident(__m128i v) {
+  __m128i lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+  __m128i alpha = _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)),
+                                _mm_cmplt_epi8(lower, _mm_set1_epi8('z' + 1)));
+  __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('0' - 1)),
+                                _mm_cmplt_epi8(v, _mm_set1_epi8('9' + 1)));
+  __m128i m = _mm_or_si128(_mm_or_si128(alpha, digit),
+                           _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('_')),
+                                        _mm_cmpeq_epi8(v, _mm_set1_epi8('$'))));
+  return ~_mm_movemask_epi8(m) & 0xffff;
+}
+
+static int scan_newline(__m128i v) {
+  __m128i m = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')),
+                           _mm_cmpeq_epi8(v, _mm_setzero_si128()));
+  return _mm_movemask_epi8(m);
+}
+
+static int scan_star(__m128i v) {
+  __m128i m = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('*')),
+                           _mm_cmpeq_epi8(v, _mm_setzero_si128()));
+  return _mm_movemask_epi8(m);
+}
+
+// Returns the first byte at or after p for which `fn` sets a bit.
+// `fn` must set the bit for NUL.
+static char *scan(char *p, ScanFn *fn) {
+  char *q = (char *)((uintptr_t)p & ~(uintptr_t)15);
+  int mask = fn(_mm_load_si128((__m128i *)q)) >> (p - q);
+  if (mask)
+    return p + __builtin_ctz(mask);
+
+  for (;;) {
+    q += 16;
+    mask = fn(_mm_load_si128((__m128i *)q));
+    if (mask)
+      return q + __builtin_ctz(mask);
+  }
+}
+#endif
+
+static char *skip_hspace(char *p) {
+#ifdef __SSE2__
+  // Most runs are a single space, which isn't worth a vector load.
+  if (!is_hspace(*p))
+    return p;
+  return scan(p, scan_hspace);
+#else
+  while (is_hspace(*p))
+    p++;
+  return p;
+#endif
+}
+
+static char *skip_ascii_ident(char *p) {
+#ifdef __SSE2__
+  return scan(p, scan_ascii_ident);
+#else
+  while (is_ascii_ident2(*p))
+    p++;
+  return p;
+#endif
+}
+
+// Returns the newline (or the NUL) that ends a line comment.
+static char *skip_line_comment(char *p) {
+#ifdef __SSE2__
+  return scan(p, scan_newline);
+#else
+  while (*p != '\n' && *p)
+    p++;
+  return p;
+#endif
+}
+
+// Returns the position just after the "*/" that ends a block comment,
+// or NULL if there's no such "*/".
+static char *skip_block_comment(char *p) {
+  for (;;) {
+#ifdef __SSE2__
+    p = scan(p, scan_star);
+#else
+    while (*p != '*' && *p)
+      p++;
+#endif
+    if (!*p)
+      return NULL;
+    if (p[1] == '/')
+      return p + 2;
+    p++;
+  }
+}
+
+// Advances the line number past the newlines in [p, end). tokenize()
+// counts newlines between tokens itself, so this is only needed for
+// block comments and for malformed char literals spanning lines.
+static void count_newlines(char *p, char *end) {
+  while ((p = memchr(p, '\n', end - p))) {
+    line_no++;
+    p++;
+  }
 }
 
 // Read an identifier and returns the length of it.
 // If p does not point to a valid identifier, 0 is returned.
 static int read_ident(char *start) {
   char *p = start;
-  uint32_t c = decode_utf8(&p, p);
-  if (!is_ident1(c))
-    return 0;
+  if (is_ascii_ident1(*p)) {
+    p++;
+  } else {
+    if (!(*p & 0x80) || !is_ident1(decode_utf8(&p, p)))
+      return 0;
+  }
 
+  // Only non-ASCII characters need to be decoded.
   for (;;) {
+    p = skip_ascii_ident(p);
+    if (!(*p & 0x80))
+      return p - start;
+
     char *q;
-    c = decode_utf8(&q, p);
-    if (!is_ident2(c))
+    if (!is_ident2(decode_utf8(&q, p)))
       return p - start;
     p = q;
   }
@@ -144,46 +343,188 @@ static int from_hex(char c) {
   return c - 'A' + 10;
 }
 
-// Read a punctuator token from p and returns its length.
-static int read_punct(char *p) {
-  static char *kw[] = {
-    "<<=", ">>=", "...", "==", "!=", "<=", ">=", "->", "+=",
-    "-=", "*=", "/=", "++", "--", "%=", "&=", "|=", "^=", "&&",
-    "||", "<<", ">>", "##",
-  };
+// Punctuators are recognized by looking up their first character in
+// the following tables. punct1[c] is the atom of c by itself,
+// punct_eq[c] is the atom of c followed by '=', and punct_twice[c]
+// is the atom of c repeated.
+static uint8_t punct1[256] = {
+  ['('] = AT_LPAREN, [')'] = AT_RPAREN, ['['] = AT_LBRACKET,
+  [']'] = AT_RBRACKET, ['{'] = AT_LBRACE, ['}'] = AT_RBRACE,
+  ['.'] = AT_DOT, ['&'] = AT_AMP, ['*'] = AT_STAR, ['+'] = AT_PLUS,
+  ['-'] = AT_MINUS, ['~'] = AT_TILDE, ['!'] = AT_NOT, ['/'] = AT_SLASH,
+  ['%'] = AT_PERCENT, ['<'] = AT_LT, ['>'] = AT_GT, ['^'] = AT_XOR,
+  ['|'] = AT_OR, ['?'] = AT_QUESTION, [':'] = AT_COLON,
+  [';'] = AT_SEMICOLON, ['='] = AT_ASSIGN, [','] = AT_COMMA,
+  ['#'] = AT_HASH,
+};
+
+static uint8_t punct_eq[256] = {
+  ['='] = AT_EQ, ['!'] = AT_NE, ['<'] = AT_LE, ['>'] = AT_GE,
+  ['*'] = AT_MUL_ASSIGN, ['/'] = AT_DIV_ASSIGN, ['%'] = AT_MOD_ASSIGN,
+  ['+'] = AT_ADD_ASSIGN, ['-'] = AT_SUB_ASSIGN, ['&'] = AT_AND_ASSIGN,
+  ['^'] = AT_XOR_ASSIGN, ['|'] = AT_OR_ASSIGN,
+};
+
+static uint8_t punct_twice[256] = {
+  ['+'] = AT_INC, ['-'] = AT_DEC, ['<'] = AT_SHL, ['>'] = AT_SHR,
+  ['&'] = AT_LOGAND, ['|'] = AT_LOGOR, ['#'] = AT_HASHHASH,
+};
+
+// Read a punctuator token from p and returns its length. *atom is
+// set to its atom, or AT_NONE if it is a stray character such as '@'
+// that has no predefined atom.
+static int read_punct(char *p, int *atom) {
+  unsigned char c = *p;
+
+  if (c == '.' && p[1] == '.' && p[2] == '.') {
+    *atom = AT_ELLIPSIS;
+    return 3;
+  }
+
+  if (c == '-' && p[1] == '>') {
+    *atom = AT_ARROW;
+    return 2;
+  }
+
+  if (p[1] == c && punct_twice[c]) {
+    if (p[2] == '=' && (c == '<' || c == '>')) {
+      *atom = (c == '<') ? AT_SHL_ASSIGN : AT_SHR_ASSIGN;
+      return 3;
+    }
+    *atom = punct_twice[c];
+    return 2;
+  }
+
+  if (p[1] == '=' && punct_eq[c]) {
+    *atom = punct_eq[c];
+    return 2;
+  }
 
-  for (int i = 0; i < sizeof(kw) / sizeof(*kw); i++)
-    if (startswith(p, kw[i]))
-      return strlen(kw[i]);
+  *atom = punct1[c];
+  return ispunct(c) ? 1 : 0;
+}
 
-  return ispunct(*p) ? 1 : 0;
+static char *atom_names[] = {
+  [AT_RETURN] = "return", [AT_IF] = "if", [AT_ELSE] = "else",
+  [AT_FOR] = "for", [AT_WHILE] = "while", [AT_INT] = "int",
+  [AT_SIZEOF] = "sizeof", [AT_CHAR] = "char", [AT_STRUCT] = "struct",
+  [AT_UNION] = "union", [AT_SHORT] = "short", [AT_LONG] = "long",
+  [AT_VOID] = "void", [AT_TYPEDEF] = "typedef", [AT__BOOL] = "_Bool",
+  [AT_ENUM] = "enum", [AT_STATIC] = "static", [AT_GOTO] = "goto",
+  [AT_BREAK] = "break", [AT_CONTINUE] = "continue", [AT_SWITCH] = "switch",
+  [AT_CASE] = "case", [AT_DEFAULT] = "default", [AT_EXTERN] = "extern",
+  [AT__ALIGNOF] = "_Alignof", [AT_DO] = "do", [AT_SIGNED] = "signed",
+  [AT_UNSIGNED] = "unsigned", [AT_CONST] = "const",
+  [AT_VOLATILE] = "volatile", [AT_AUTO] = "auto",
+  [AT_REGISTER] = "register", [AT_RESTRICT] = "restrict",
+  [AT___RESTRICT] = "__restrict", [AT___RESTRICT__] = "__restrict__",
+  [AT__NORETURN] = "_Noreturn", [AT_FLOAT] = "float",
+  [AT_DOUBLE] = "double", [AT__THREAD_LOCAL] = "_Thread_local",
+  [AT___THREAD] = "__thread", [AT___ATTRIBUTE__] = "__attribute__",
+  [AT___ASM] = "__asm", [AT___ASM__] = "__asm__",
+  [AT___TYPEOF] = "__typeof", [AT___TYPEOF__] = "__typeof__",
+  [AT_INLINE] = "inline", [AT_ASM] = "asm", [AT_TYPEOF] = "typeof",
+
+  [AT_LPAREN] = "(", [AT_RPAREN] = ")", [AT_LBRACKET] = "[",
+  [AT_RBRACKET] = "]", [AT_LBRACE] = "{", [AT_RBRACE] = "}",
+  [AT_DOT] = ".", [AT_ARROW] = "->", [AT_INC] = "++", [AT_DEC] = "--",
+  [AT_AMP] = "&", [AT_STAR] = "*", [AT_PLUS] = "+", [AT_MINUS] = "-",
+  [AT_TILDE] = "~", [AT_NOT] = "!", [AT_SLASH] = "/", [AT_PERCENT] = "%",
+  [AT_SHL] = "<<", [AT_SHR] = ">>", [AT_LT] = "<", [AT_GT] = ">",
+  [AT_LE] = "<=", [AT_GE] = ">=", [AT_EQ] = "==", [AT_NE] = "!=",
+  [AT_XOR] = "^", [AT_OR] = "|", [AT_LOGAND] = "&&", [AT_LOGOR] = "||",
+  [AT_QUESTION] = "?", [AT_COLON] = ":", [AT_SEMICOLON] = ";",
+  [AT_ELLIPSIS] = "...", [AT_ASSIGN] = "=", [AT_MUL_ASSIGN] = "*=",
+  [AT_DIV_ASSIGN] = "/=", [AT_MOD_ASSIGN] = "%=", [AT_ADD_ASSIGN] = "+=",
+  [AT_SUB_ASSIGN] = "-=", [AT_SHL_ASSIGN] = "<<=", [AT_SHR_ASSIGN] = ">>=",
+  [AT_AND_ASSIGN] = "&=", [AT_XOR_ASSIGN] = "^=", [AT_OR_ASSIGN] = "|=",
+  [AT_COMMA] = ",", [AT_HASH] = "#", [AT_HASHHASH] = "##",
+
+  [AT_IFDEF] = "ifdef", [AT_IFNDEF] = "ifndef", [AT_ELIF] = "elif",
+};
+
+// Keywords are recognized with a perfect hash function of their first
+// two characters, their last character and their length. The
+// multiplier was chosen so that no two keywords fall into the same
+// slot of keyword_table; init_atoms() asserts that this still holds.
+#define KEYWORD_HASH_MUL 0x091aa046832f76cb
+
+static uint8_t keyword_table[128];
+
+static int keyword_hash(char *p, int len) {
+  uint64_t x = (uint8_t)p[0] | (uint8_t)p[1] << 8 |
+               (uint8_t)p[len - 1] << 16 | (uint64_t)len << 24;
+  return (x * KEYWORD_HASH_MUL) >> 57;
 }
 
-bool is_keyword(Token *tok) {
-  static HashMap map;
+// Returns the atom of a keyword, or AT_NONE if a given identifier is
+// not a keyword. Keywords are 2 to 13 characters long.
+static int find_keyword(char *p, int len) {
+  if (len < 2 || len > 13)
+    return AT_NONE;
+  int atom = keyword_table[keyword_hash(p, len)];
+  if (atom && atoms[atom].len == len && !memcmp(atoms[atom].name, p, len))
+    return atom;
+  return AT_NONE;
+}
+
+static int add_atom(char *name, int len, uint64_t hash) {
+  if (atoms_len == atoms_capacity) {
+    atoms_capacity *= 2;
+    atoms = realloc(atoms, sizeof(Atom) * atoms_capacity);
+  }
+
+  name = strndup(name, len);
+  count_alloc(MEM_STRING, len + 1);
+  atoms[atoms_len] = (Atom){name, len, hash};
+  hashmap_put2(&atom_map, name, len, (void *)(intptr_t)atoms_len);
+  return atoms_len++;
+}
 
-  if (map.capacity == 0) {
-    static char *kw[] = {
-      "return", "if", "else", "for", "while", "int", "sizeof", "char",
-      "struct", "union", "short", "long", "void", "typedef", "_Bool",
-      "enum", "static", "goto", "break", "continue", "switch", "case",
-      "default", "extern", "_Alignof", "do", "signed",
-      "unsigned", "const", "volatile", "auto", "register", "restrict",
-      "__restrict", "__restrict__", "_Noreturn", "float", "double",
-      "_Thread_local", "__thread", "__attribute__",
-      "__asm", "__asm__", "__typeof", "__typeof__", "inline",
-    };
+static void init_atoms(void) {
+  // Atom 0 is AT_NONE, which has no spelling.
+  atoms_capacity = 1024;
+  atoms = calloc(atoms_capacity, sizeof(Atom));
+  atoms[0].name = "";
+  atoms_len = 1;
 
-    for (int i = 0; i < sizeof(kw) / sizeof(*kw); i++)
-      hashmap_put(&map, kw[i], (void *)1);
+  for (int i = 1; i < NUM_PREDEFINED_ATOMS; i++) {
+    int len = strlen(atom_names[i]);
+    add_atom(atom_names[i], len, fnv_hash(atom_names[i], len));
+  }
 
-    if (opt_std == STD_NONE)
-      hashmap_put(&map, "asm", (void *)1);
-    if (opt_std == STD_NONE || opt_std >= STD_C23)
-      hashmap_put(&map, "typeof", (void *)1);      
+  for (int i = AT_RETURN; i <= AT_TYPEOF; i++) {
+    int h = keyword_hash(atoms[i].name, atoms[i].len);
+    assert(keyword_table[h] == 0);
+    keyword_table[h] = i;
   }
+}
+
+// Returns the atom for a given spelling, creating a new one if it
+// has not been seen before.
+int intern(char *name, int len) {
+  int kw = find_keyword(name, len);
+  if (kw)
+    return kw;
+
+  uint64_t hash = fnv_hash(name, len);
+  void *val = hashmap_get3(&atom_map, name, len, hash);
+  if (val)
+    return (intptr_t)val;
+  return add_atom(name, len, hash);
+}
+
+// The returned pointer is valid until the next call of intern().
+Atom *get_atom(int atom) {
+  return &atoms[atom];
+}
 
-  return hashmap_get2(&map, tok->loc, tok->len);
+bool is_keyword(Token *tok) {
+  if (tok->atom == AT_ASM)
+    return opt_std == STD_NONE;
+  if (tok->atom == AT_TYPEOF)
+    return opt_std == STD_NONE || opt_std >= STD_C23;
+  return AT_RETURN <= tok->atom && tok->atom <= AT_INLINE;
 }
 
 static int read_escaped_char(char **new_pos, char *p) {
@@ -254,6 +595,7 @@ static char *string_literal_end(char *p) {
 static Token *read_string_literal(char *start, char *quote) {
   char *end = string_literal_end(quote + 1);
   char *buf = calloc(1, end - quote);
+  count_alloc(MEM_STRING, end - quote);
   int len = 0;
 
   for (char *p = quote + 1; p < end;) {
@@ -264,8 +606,9 @@ static Token *read_string_literal(char *start, char *quote) {
   }
 
   Token *tok = new_token(TK_STR, start, end + 1);
-  tok->ty = array_of(ty_pchar, len + 1);
-  tok->str = buf;
+  TokenExtra *x = new_extra(tok);
+  x->ty = string_type(ty_pchar, len + 1);
+  x->str = buf;
   return tok;
 }
 
@@ -279,6 +622,7 @@ static Token *read_string_literal(char *start, char *quote) {
 static Token *read_utf16_string_literal(char *start, char *quote) {
   char *end = string_literal_end(quote + 1);
   uint16_t *buf = calloc(2, end - start);
+  count_alloc(MEM_STRING, 2 * (end - start));
   int len = 0;
 
   for (char *p = quote + 1; p < end;) {
@@ -300,8 +644,9 @@ static Token *read_utf16_string_literal(char *start, char *quote) {
   }
 
   Token *tok = new_token(TK_STR, start, end + 1);
-  tok->ty = array_of(ty_ushort, len + 1);
-  tok->str = (char *)buf;
+  TokenExtra *x = new_extra(tok);
+  x->ty = string_type(ty_ushort, len + 1);
+  x->str = (char *)buf;
   return tok;
 }
 
@@ -312,6 +657,7 @@ static Token *read_utf16_string_literal(char *start, char *quote) {
 static Token *read_utf32_string_literal(char *start, char *quote, Type *ty) {
   char *end = string_literal_end(quote + 1);
   uint32_t *buf = calloc(4, end - quote);
+  count_alloc(MEM_STRING, 4 * (end - quote));
   int len = 0;
 
   for (char *p = quote + 1; p < end;) {
@@ -322,8 +668,9 @@ static Token *read_utf32_string_literal(char *start, char *quote, Type *ty) {
   }
 
   Token *tok = new_token(TK_STR, start, end + 1);
-  tok->ty = array_of(ty, len + 1);
-  tok->str = (char *)buf;
+  TokenExtra *x = new_extra(tok);
+  x->ty = string_type(ty, len + 1);
+  x->str = (char *)buf;
   return tok;
 }
 
@@ -343,12 +690,16 @@ static Token *read_char_literal(char *start, char *quote, Type *ty) {
     error_at(p, "unclosed char literal");
 
   Token *tok = new_token(TK_NUM, start, end + 1);
-  tok->val = c;
-  tok->ty = ty;
+  TokenExtra *x = new_extra(tok);
+  x->val = c;
+  x->ty = ty;
+  count_newlines(start, end);
   return tok;
 }
 
-static bool convert_pp_int(Token *tok) {
+// Reads the value and the type of an integer pp-number. Returns false
+// if the token is not an integer.
+bool read_pp_int(Token *tok, int64_t *valp, Type **typ) {
   char *p = tok->loc;
 
   // Read a binary, octal, decimal or hexadecimal number.
@@ -429,9 +780,21 @@ static bool convert_pp_int(Token *tok) {
       ty = ty_int;
   }
 
+  *valp = val;
+  *typ = ty;
+  return true;
+}
+
+static bool convert_pp_int(Token *tok) {
+  int64_t val;
+  Type *ty;
+  if (!read_pp_int(tok, &val, &ty))
+    return false;
+
   tok->kind = TK_NUM;
-  tok->val = val;
-  tok->ty = ty;
+  TokenExtra *x = new_extra(tok);
+  x->val = val;
+  x->ty = ty;
   return true;
 }
 
@@ -466,23 +829,9 @@ void convert_pp_number(Token *tok) {
     error_tok(tok, "invalid numeric constant");
 
   tok->kind = TK_NUM;
-  tok->fval = val;
-  tok->ty = ty;
-}
-
-// Initialize line info for all tokens.
-static void add_line_numbers(Token *tok) {
-  char *p = current_file->contents;
-  int n = 1;
-
-  do {
-    if (p == tok->loc) {
-      tok->line_no = n;
-      tok = tok->next;
-    }
-    if (*p == '\n')
-      n++;
-  } while (*p++);
+  TokenExtra *x = new_extra(tok);
+  x->fval = val;
+  x->ty = ty;
 }
 
 Token *tokenize_string_literal(Token *tok, Type *basety) {
@@ -491,18 +840,41 @@ Token *tokenize_string_literal(Token *tok, Type *basety) {
     t = read_utf16_string_literal(tok->loc, tok->loc);
   else
     t = read_utf32_string_literal(tok->loc, tok->loc, basety);
+  t->line_no = tok->line_no;
   t->next = tok->next;
   return t;
 }
 
-// Tokenize a given string and returns new tokens.
-Token *tokenize(File *file, Token **end) {
+static bool is_cond_directive(Token *tok) {
+  int a = tok->atom;
+  return a == AT_IF || a == AT_IFDEF || a == AT_IFNDEF || a == AT_ELIF ||
+         a == AT_ELSE;
+}
+
+// Tokenize `file` from `p`, which is at the beginning of line `line`,
+// and returns new tokens followed by `next`, or by an EOF token if
+// `next` is NULL.
+//
+// If `lazy` is true, tokenization stops at the end of the first line
+// that is a conditional directive such as `#if` or `#else`, and the
+// rest of the file is represented by a TK_LAZY token. The preprocessor
+// tokenizes the rest when it gets there, or skips the following block
+// at the byte level if the condition is false.
+static Token *tokenize2(File *file, char *p, int line, Token *next,
+                        bool lazy, Token **end) {
   current_file = file;
 
-  char *p = file->contents;
+  // Punctuators get their predefined atoms without calling intern(),
+  // so the atom table has to be set up before the first token.
+  if (!atoms)
+    init_atoms();
+
+  char *start = p;
   Token head = {0};
   Token *cur = &head;
+  bool in_cond_directive = false;
 
+  line_no = line;
   at_bol = true;
   has_space = false;
 
@@ -510,33 +882,35 @@ Token *tokenize(File *file, Token **end) {
     // Skip newline.
     if (*p == '\n') {
       p++;
+      line_no++;
       at_bol = true;
       has_space = false;
+      if (in_cond_directive)
+        break;
       continue;
     }
 
     // Skip whitespace characters.
-    if (isspace(*p)) {
-      p++;
+    if (is_hspace(*p)) {
+      p = skip_hspace(p + 1);
       has_space = true;
       continue;
     }
 
     // Skip line comments.
-    if (startswith(p, "//")) {
-      p += 2;
-      while (*p != '\n')
-        p++;
+    if (p[0] == '/' && p[1] == '/') {
+      p = skip_line_comment(p + 2);
       has_space = true;
       continue;
     }
 
     // Skip block comments.
-    if (startswith(p, "/*")) {
-      char *q = strstr(p + 2, "*/");
+    if (p[0] == '/' && p[1] == '*') {
+      char *q = skip_block_comment(p + 2);
       if (!q)
         error_at(p, "unclosed block comment");
-      p = q + 2;
+      count_newlines(p, q);
+      p = q;
       has_space = true;
       continue;
     }
@@ -598,7 +972,7 @@ Token *tokenize(File *file, Token **end) {
     // Character literal
     if (*p == '\'') {
       cur = cur->next = read_char_literal(p, p, ty_int);
-      cur->val = (char)cur->val;
+      cur->extra->val = (char)cur->extra->val;
       p += cur->len;
       continue;
     }
@@ -606,7 +980,7 @@ Token *tokenize(File *file, Token **end) {
     // UTF-16 character literal
     if (startswith(p, "u'")) {
       cur = cur->next = read_char_literal(p, p + 1, ty_ushort);
-      cur->val &= 0xffff;
+      cur->extra->val &= 0xffff;
       p += cur->len;
       continue;
     }
@@ -628,15 +1002,21 @@ Token *tokenize(File *file, Token **end) {
     // Identifier or keyword
     int ident_len = read_ident(p);
     if (ident_len) {
+      Token *prev = cur;
       cur = cur->next = new_token(TK_IDENT, p, p + ident_len);
+      cur->atom = intern(p, ident_len);
       p += cur->len;
+      if (lazy && prev->at_bol && prev->atom == AT_HASH && is_cond_directive(cur))
+        in_cond_directive = true;
       continue;
     }
 
     // Punctuators
-    int punct_len = read_punct(p);
+    int atom;
+    int punct_len = read_punct(p, &atom);
     if (punct_len) {
       cur = cur->next = new_token(TK_PUNCT, p, p + punct_len);
+      cur->atom = atom ? atom : intern(p, punct_len);
       p += cur->len;
       continue;
     }
@@ -646,11 +1026,157 @@ Token *tokenize(File *file, Token **end) {
 
   if (end && cur != &head)
     *end = cur;
-  cur->next = new_token(TK_EOF, p, p);
-  add_line_numbers(head.next);
+  stats.source_bytes += p - start;
+
+  if (*p) {
+    cur->next = new_token(TK_LAZY, p, p);
+    cur->next->next = next;
+  } else {
+    cur->next = next ? next : new_token(TK_EOF, p, p);
+  }
   return head.next;
 }
 
+// Tokenize a given string and returns new tokens.
+Token *tokenize(File *file, Token **end) {
+  return tokenize2(file, file->contents, 1, NULL, false, end);
+}
+
+// Tokenize the part of a file that a TK_LAZY token stands for.
+Token *tokenize_lazy(Token *tok) {
+  assert(tok->kind == TK_LAZY);
+  phase_start(PHASE_TOKENIZE);
+  Token *start = tokenize2(tok->file, tok->loc, tok->line_no, tok->next,
+                           true, NULL);
+  phase_end();
+  return start;
+}
+
+// Returns the start of the next line, or the terminating NUL.
+// Comments and string literals are respected, so that a "/*" in a
+// string doesn't start a comment and a newline in a comment doesn't
+// end the line. A line without '/' can't contain the start of a
+// comment, so it's found with a single scan for its end.
+static char *skip_line_bytes(char *p) {
+  char *nl = skip_line_comment(p);
+  if (!memchr(p, '/', nl - p))
+    return *nl ? nl + 1 : nl;
+
+  while (p < nl) {
+    if (*p == '"' || *p == '\'') {
+      // Unterminated literals are not errors in a skipped block.
+      // They end at the end of the line.
+      char quote = *p++;
+      while (p < nl && *p != quote)
+        p += (*p == '\\' && p + 1 < nl) ? 2 : 1;
+      if (p < nl)
+        p++;
+      continue;
+    }
+
+    if (p[0] == '/' && p[1] == '/')
+      break;
+
+    if (p[0] == '/' && p[1] == '*') {
+      char *q = skip_block_comment(p + 2);
+      if (!q)
+        error_at(p, "unclosed block comment");
+      p = q;
+      if (p > nl)
+        nl = skip_line_comment(p);
+      continue;
+    }
+    p++;
+  }
+  return *nl ? nl + 1 : nl;
+}
+
+// Skips horizontal whitespace and block comments.
+static char *skip_hspace_and_comments(char *p) {
+  for (;;) {
+    p = skip_hspace(p);
+    if (p[0] != '/' || p[1] != '*')
+      return p;
+    char *q = skip_block_comment(p + 2);
+    if (!q)
+      error_at(p, "unclosed block comment");
+    p = q;
+  }
+}
+
+// Skips a block of a lazily tokenized file that is excluded by a
+// conditional directive, without tokenizing it. `tok` must be a
+// TK_LAZY token. Returns the tokens from the line of the `#elif`,
+// `#else` or `#endif` that ends the block. If `endif_only` is true,
+// the block ends only at the matching `#endif`.
+Token *skip_cond_lazy(Token *tok, bool endif_only) {
+  assert(tok->kind == TK_LAZY);
+  char *p = tok->loc;
+  int depth = 0;
+
+  while (*p) {
+    char *line = p;
+    p = skip_hspace_and_comments(p);
+
+    if (*p == '#') {
+      char *name = skip_hspace_and_comments(p + 1);
+      int len = read_ident(name);
+
+      if ((len == 2 && !memcmp(name, "if", 2)) ||
+          (len == 5 && !memcmp(name, "ifdef", 5)) ||
+          (len == 6 && !memcmp(name, "ifndef", 6))) {
+        depth++;
+      } else if (len == 5 && !memcmp(name, "endif", 5)) {
+        if (depth-- == 0) {
+          p = line;
+          break;
+        }
+      } else if (depth == 0 && !endif_only &&
+                 ((len == 4 && !memcmp(name, "elif", 4)) ||
+                  (len == 4 && !memcmp(name, "else", 4)))) {
+        p = line;
+        break;
+      }
+      p = name + len;
+    }
+
+    p = skip_line_bytes(p);
+  }
+
+  stats.skipped_bytes += p - tok->loc;
+
+  line_no = tok->line_no;
+  count_newlines(tok->loc, p);
+  Token t = *tok;
+  t.loc = p;
+  t.line_no = line_no;
+  return tokenize_lazy(&t);
+}
+
+// Maps a file into memory. The mapping is private, so it can be
+// modified without affecting the file. Returns NULL if the mapping
+// can't be used as the contents of the file as is, i.e. if the file
+// doesn't end with a newline, or if its size is a multiple of the page
+// size so that there is no zero byte after the end to terminate it.
+static char *map_file(int fd) {
+  struct stat st;
+  if (fstat(fd, &st) || !S_ISREG(st.st_mode) || st.st_size == 0 ||
+      st.st_size % sysconf(_SC_PAGESIZE) == 0)
+    return NULL;
+
+  char *p = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if (p == MAP_FAILED)
+    return NULL;
+
+  if (p[st.st_size - 1] != '\n') {
+    munmap(p, st.st_size);
+    return NULL;
+  }
+
+  count_alloc(MEM_FILE, st.st_size + 1);
+  return p;
+}
+
 // Returns the contents of a given file.
 static char *read_file(char *path) {
   FILE *fp;
@@ -659,9 +1185,21 @@ static char *read_file(char *path) {
     // By convention, read from stdin if a given filename is "-".
     fp = stdin;
   } else {
-    fp = fopen(path, "r");
-    if (!fp)
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+      return NULL;
+
+    char *p = map_file(fd);
+    if (p) {
+      close(fd);
+      return p;
+    }
+
+    fp = fdopen(fd, "r");
+    if (!fp) {
+      close(fd);
       return NULL;
+    }
   }
 
   char *buf;
@@ -686,6 +1224,7 @@ static char *read_file(char *path) {
     fputc('\n', out);
   fputc('\0', out);
   fclose(out);
+  count_alloc(MEM_FILE, buflen + 1);
   return buf;
 }
 
@@ -695,6 +1234,7 @@ File **get_input_files(void) {
 
 File *new_file(char *name, int file_no, char *contents) {
   File *file = calloc(1, sizeof(File));
+  count_alloc(MEM_FILE, sizeof(File));
   file->name = name;
   file->display_file = file;
   file->file_no = file_no;
@@ -702,27 +1242,19 @@ File *new_file(char *name, int file_no, char *contents) {
   return file;
 }
 
-// Replaces \r or \r\n with \n.
-static void canonicalize_newline(char *p) {
-  int i = 0, j = 0;
-
-  while (p[i]) {
-    if (p[i] == '\r' && p[i + 1] == '\n') {
-      i += 2;
-      p[j++] = '\n';
-    } else if (p[i] == '\r') {
-      i++;
-      p[j++] = '\n';
-    } else {
-      p[j++] = p[i++];
-    }
-  }
-
-  p[j] = '\0';
+// Returns true if a given text contains \r, a backslash followed by
+// a newline, or something that may be a \u or \U escape sequence.
+// Most files contain none of them, so they can be used as is.
+static bool needs_normalization(char *p) {
+  for (p = strpbrk(p, "\r\\"); p; p = strpbrk(p + 1, "\r\\"))
+    if (*p == '\r' || p[1] == '\n' || p[1] == '\r' || p[1] == 'u' || p[1] == 'U')
+      return true;
+  return false;
 }
 
-// Removes backslashes followed by a newline.
-static void remove_backslash_newline(char *p) {
+// Replaces \r or \r\n with \n, and removes backslashes followed by
+// a newline.
+static void normalize_newlines(char *p) {
   int i = 0, j = 0;
 
   // We want to keep the number of newline characters so that
@@ -731,11 +1263,12 @@ static void remove_backslash_newline(char *p) {
   int n = 0;
 
   while (p[i]) {
-    if (p[i] == '\\' && p[i + 1] == '\n') {
-      i += 2;
+    if (p[i] == '\\' && (p[i + 1] == '\n' || p[i + 1] == '\r')) {
+      i += (p[i + 1] == '\r' && p[i + 2] == '\n') ? 3 : 2;
       n++;
-    } else if (p[i] == '\n') {
-      p[j++] = p[i++];
+    } else if (p[i] == '\n' || p[i] == '\r') {
+      i += (p[i] == '\r' && p[i + 1] == '\n') ? 2 : 1;
+      p[j++] = '\n';
       for (; n > 0; n--)
         p[j++] = '\n';
     } else {
@@ -791,26 +1324,50 @@ static void convert_universal_chars(char *p) {
 }
 
 File *add_input_file(char *path, char *contents, bool not_input) {
-  static HashMap input_files_map;
-
   File *file = hashmap_get(&input_files_map, path);
   if (file)
     return file;
 
-  static int file_no;
+  int file_no = input_files_len;
   file = new_file(path, file_no + 1, contents);
   file->non_input = not_input;
 
   input_files = realloc(input_files, sizeof(File *) * (file_no + 2));
   input_files[file_no] = file;
   input_files[file_no + 1] = NULL;
-  file_no++;
+  input_files_len++;
 
   hashmap_put(&input_files_map, path, file);
   return file;
 }
 
-Token *tokenize_file(char *path, Token **end) {
+// Forget the input files of the previous translation unit, so that
+// file numbers start from 1 again.
+void reset_input_files(void) {
+  input_files = NULL;
+  input_files_len = 0;
+  input_files_map = (HashMap){0};
+}
+
+// Returns a copy of a token list that belongs to `file`. If `end` is
+// not NULL, it is set to the last token before EOF like tokenize() does.
+Token *copy_token_list(Token *tok, File *file, Token **end) {
+  Token head = {0};
+  Token *cur = &head;
+  for (Token *t = tok; t; t = t->next) {
+    cur = cur->next = arena_calloc(&token_arena, sizeof(Token));
+    count_alloc(MEM_TOKEN, sizeof(Token));
+    *cur = *t;
+    cur->file = file;
+    if (end && cur->kind != TK_EOF)
+      *end = cur;
+  }
+  return head.next;
+}
+
+// Read a source file and apply the translation phases that precede
+// tokenization to it.
+char *read_source_file(char *path) {
   char *p = read_file(path);
   if (!p)
     return NULL;
@@ -822,9 +1379,120 @@ Token *tokenize_file(char *path, Token **end) {
   if (!memcmp(p, "\xef\xbb\xbf", 3))
     p += 3;
 
-  canonicalize_newline(p);
-  remove_backslash_newline(p);
-  convert_universal_chars(p);
+  if (needs_normalization(p)) {
+    normalize_newlines(p);
+    convert_universal_chars(p);
+  }
+  return p;
+}
+
+// Returns the identity of a file, or NULL if it doesn't exist. A file
+// reached through different paths, e.g. "./foo.h", "dir/../foo.h" or a
+// symbolic link, has one identity. Each path is stat'ed only once.
+FileKey *get_file_key(char *path) {
+  static HashMap cache;
+  FileKey *key = hashmap_get(&cache, path);
+  if (key)
+    return key;
+
+  struct stat st;
+  if (stat(path, &st))
+    return NULL;
+  key = calloc(1, sizeof(FileKey));
+  key->dev = st.st_dev;
+  key->ino = st.st_ino;
+  hashmap_put(&cache, path, key);
+  return key;
+}
+
+// Same as read_source_file() except that a file that has been read
+// before, possibly through another path, is not read again.
+static char *read_source_file_once(char *path) {
+  static HashMap cache;
+  FileKey *key = strcmp(path, "-") ? get_file_key(path) : NULL;
+  if (!key)
+    return read_source_file(path);
+
+  char *p = hashmap_get2(&cache, (char *)key, sizeof(FileKey));
+  if (p) {
+    stats.reads_avoided++;
+    return p;
+  }
 
-  return tokenize(add_input_file(path, p, false), end);
+  p = read_source_file(path);
+  if (p)
+    hashmap_put2(&cache, (char *)key, sizeof(FileKey), p);
+  return p;
+}
+
+static Token *tokenize_file2(char *path, Token **end) {
+  // The preprocessor modifies the token list it is given, so a cached
+  // list is never handed out itself but only copies of it.
+  Token *tok = hashmap_get(&token_cache, path);
+  if (tok)
+    return copy_token_list(tok, add_input_file(path, tok->file->contents, false), end);
+
+  tok = server_cached_tokens(path, end);
+  if (tok)
+    return tok;
+
+  char *p = read_source_file_once(path);
+  if (!p)
+    return NULL;
+
+  File *file = add_input_file(path, p, false);
+  tok = tokenize(file, end);
+  server_report_file(path);
+
+  if (reuse_tokens && strcmp(path, "-")) {
+    hashmap_put(&token_cache, path, tok);
+    return copy_token_list(tok, file, end);
+  }
+  return tok;
+}
+
+Token *tokenize_file(char *path, Token **end) {
+  phase_start(PHASE_TOKENIZE);
+  Token *tok = tokenize_file2(path, end);
+  phase_end();
+  return tok;
+}
+
+// Replaces the EOF token at the end of a token list with `next`.
+// `end` is the last token before EOF as returned by tokenize().
+static Token *append_tokens(Token *tok, Token *end, Token *next) {
+  if (!tok || !next)
+    return tok;
+  if (!end)
+    return next;
+  end->next = next;
+  return tok;
+}
+
+// Returns the tokens of a file followed by `next`, or by an EOF token
+// if `next` is NULL. The file is tokenized lazily as described in
+// tokenize2(), unless its tokens are cached, in which case a copy of
+// the whole token list is returned.
+Token *tokenize_file_lazy(char *path, Token *next) {
+  Token *end = NULL;
+  if (reuse_tokens) {
+    Token *tok = tokenize_file(path, &end);
+    return append_tokens(tok, end, next);
+  }
+
+  phase_start(PHASE_TOKENIZE);
+  Token *tok = server_cached_tokens(path, &end);
+  if (tok) {
+    tok = append_tokens(tok, end, next);
+  } else {
+    char *p = read_source_file_once(path);
+    if (p) {
+      // A file that has been read before keeps its first contents.
+      File *file = add_input_file(path, p, false);
+      tok = tokenize2(file, file->contents, 1, next, true, NULL);
+      server_report_file(path);
+    }
+  }
+  phase_end();
+  return tok;
 }
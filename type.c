@@ -21,14 +21,19 @@ Type *ty_float = &(Type){TY_FLOAT, 4, 4};
 Type *ty_double = &(Type){TY_DOUBLE, 8, 8};
 Type *ty_ldouble = &(Type){TY_LDOUBLE, 16, 16};
 
-Type *new_type(TypeKind kind, int size, int align) {
-  Type *ty = calloc(1, sizeof(Type));
+static Type *alloc_type(Arena *arena, TypeKind kind, int size, int align) {
+  Type *ty = arena_calloc(arena, sizeof(Type));
+  count_alloc(MEM_TYPE, sizeof(Type));
   ty->kind = kind;
   ty->size = size;
   ty->align = align;
   return ty;
 }
 
+Type *new_type(TypeKind kind, int size, int align) {
+  return alloc_type(&ast_arena, kind, size, align);
+}
+
 bool is_integer(Type *ty) {
   TypeKind k = ty->kind;
   return k == TY_BOOL || k == TY_PCHAR || k == TY_CHAR || k == TY_SHORT ||
@@ -126,7 +131,8 @@ bool is_compatible(Type *t1, Type *t2) {
 }
 
 Type *copy_type(Type *ty) {
-  Type *ret = calloc(1, sizeof(Type));
+  Type *ret = arena_calloc(&ast_arena, sizeof(Type));
+  count_alloc(MEM_TYPE, sizeof(Type));
   *ret = *ty;
   ret->origin = ty;
   return ret;
@@ -160,6 +166,15 @@ Type *array_of(Type *base, int len) {
   return ty;
 }
 
+// The type of a string literal token. Tokens outlive the AST of a
+// translation unit, so the type is allocated along with them.
+Type *string_type(Type *base, int len) {
+  Type *ty = alloc_type(&token_arena, TY_ARRAY, base->size * len, base->align);
+  ty->base = base;
+  ty->array_len = len;
+  return ty;
+}
+
 Type *vla_of(Type *base, Node *len) {
   Type *ty = new_type(TY_VLA, 8, 8);
   ty->base = base;
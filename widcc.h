@@ -2,8 +2,11 @@
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <glob.h>
 #include <libgen.h>
+#include <poll.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdint.h>
@@ -62,12 +65,39 @@ typedef struct {
 
 void *hashmap_get(HashMap *map, char *key);
 void *hashmap_get2(HashMap *map, char *key, int keylen);
+void *hashmap_get3(HashMap *map, char *key, int keylen, uint64_t hash);
 void hashmap_put(HashMap *map, char *key, void *val);
 void hashmap_put2(HashMap *map, char *key, int keylen, void *val);
 void hashmap_delete(HashMap *map, char *key);
 void hashmap_delete2(HashMap *map, char *key, int keylen);
+HashMap hashmap_copy(HashMap *map);
+HashEntry *hashmap_next(HashMap *map, int *i);
+uint64_t fnv_hash(char *s, int len);
 void hashmap_test(void);
 
+//
+// arena.c
+//
+
+typedef struct ArenaBlock ArenaBlock;
+
+typedef struct {
+  char *ptr;
+  char *end;
+  ArenaBlock *blocks;
+  size_t reserved;
+} Arena;
+
+// Tokens and their out-of-line fields
+extern Arena token_arena;
+
+// Objects that make up the AST: nodes, types, variables and scopes.
+// They are freed between translation units in -fbatch-cc1 mode.
+extern Arena ast_arena;
+
+void *arena_calloc(Arena *arena, size_t size);
+void arena_free(Arena *arena);
+
 //
 // strings.c
 //
@@ -95,9 +125,140 @@ typedef enum {
   TK_PP_NUM,  // Preprocessing numbers
   TK_PMARK,   // Placermarkers
   TK_ATTR,    // GNU attribute
+  TK_LAZY,    // The rest of a file that has not been tokenized yet
   TK_EOF,     // End-of-file markers
 } TokenKind;
 
+// Atoms
+//
+// The spelling of each identifier, keyword and punctuator is interned
+// when it is tokenized, so that tokens can be compared by an integer
+// and names by a pointer. Keywords and punctuators have predefined
+// atoms; the atom of a keyword is its spelling in uppercase. So do
+// the conditional directive names, which the tokenizer looks for.
+typedef enum {
+  AT_NONE,
+
+  // Keywords
+  AT_RETURN,
+  AT_IF,
+  AT_ELSE,
+  AT_FOR,
+  AT_WHILE,
+  AT_INT,
+  AT_SIZEOF,
+  AT_CHAR,
+  AT_STRUCT,
+  AT_UNION,
+  AT_SHORT,
+  AT_LONG,
+  AT_VOID,
+  AT_TYPEDEF,
+  AT__BOOL,
+  AT_ENUM,
+  AT_STATIC,
+  AT_GOTO,
+  AT_BREAK,
+  AT_CONTINUE,
+  AT_SWITCH,
+  AT_CASE,
+  AT_DEFAULT,
+  AT_EXTERN,
+  AT__ALIGNOF,
+  AT_DO,
+  AT_SIGNED,
+  AT_UNSIGNED,
+  AT_CONST,
+  AT_VOLATILE,
+  AT_AUTO,
+  AT_REGISTER,
+  AT_RESTRICT,
+  AT___RESTRICT,
+  AT___RESTRICT__,
+  AT__NORETURN,
+  AT_FLOAT,
+  AT_DOUBLE,
+  AT__THREAD_LOCAL,
+  AT___THREAD,
+  AT___ATTRIBUTE__,
+  AT___ASM,
+  AT___ASM__,
+  AT___TYPEOF,
+  AT___TYPEOF__,
+  AT_INLINE,
+  AT_ASM,    // Keyword only in GNU mode
+  AT_TYPEOF, // Keyword only in GNU mode and C23
+
+  // Punctuators
+  AT_LPAREN,
+  AT_RPAREN,
+  AT_LBRACKET,
+  AT_RBRACKET,
+  AT_LBRACE,
+  AT_RBRACE,
+  AT_DOT,
+  AT_ARROW,
+  AT_INC,
+  AT_DEC,
+  AT_AMP,
+  AT_STAR,
+  AT_PLUS,
+  AT_MINUS,
+  AT_TILDE,
+  AT_NOT,
+  AT_SLASH,
+  AT_PERCENT,
+  AT_SHL,
+  AT_SHR,
+  AT_LT,
+  AT_GT,
+  AT_LE,
+  AT_GE,
+  AT_EQ,
+  AT_NE,
+  AT_XOR,
+  AT_OR,
+  AT_LOGAND,
+  AT_LOGOR,
+  AT_QUESTION,
+  AT_COLON,
+  AT_SEMICOLON,
+  AT_ELLIPSIS,
+  AT_ASSIGN,
+  AT_MUL_ASSIGN,
+  AT_DIV_ASSIGN,
+  AT_MOD_ASSIGN,
+  AT_ADD_ASSIGN,
+  AT_SUB_ASSIGN,
+  AT_SHL_ASSIGN,
+  AT_SHR_ASSIGN,
+  AT_AND_ASSIGN,
+  AT_XOR_ASSIGN,
+  AT_OR_ASSIGN,
+  AT_COMMA,
+  AT_HASH,
+  AT_HASHHASH,
+
+  // Preprocessor directives that are not keywords
+  AT_IFDEF,
+  AT_IFNDEF,
+  AT_ELIF,
+
+  NUM_PREDEFINED_ATOMS,
+} AtomKind;
+
+typedef struct {
+  char *name;
+  int len;
+  uint64_t hash;
+} Atom;
+
+// Identifies a file regardless of the path it is reached through
+typedef struct {
+  dev_t dev;
+  ino_t ino;
+} FileKey;
+
 typedef struct File File;
 struct File {
   char *name;
@@ -108,30 +269,41 @@ struct File {
   File *display_file;
   int line_delta;
   bool non_input;
+
+  // For -H
+  int include_depth;
 };
 
 // Token type
 typedef struct Token Token;
-struct Token {
-  TokenKind kind;   // Token kind
-  Token *next;      // Next token
+
+// Fields that only a few tokens need, such as the values of literals,
+// are kept out of line to keep Token small. Copies of a token share
+// them, so they must not be modified in place; new_extra() gives a
+// token its own copy.
+typedef struct {
   int64_t val;      // If kind is TK_NUM, its value
   long double fval; // If kind is TK_NUM, its value
-  char *loc;        // Token location
-  int len;          // Token length
   Type *ty;         // Used if TK_NUM or TK_STR
   char *str;        // String literal contents including terminating '\0'
+  Token *attr_next;
+} TokenExtra;
 
+struct Token {
+  Token *next;      // Next token
+  char *loc;        // Token location
   File *file;       // Source location
+  Token *origin;    // If this is expanded from a macro, the original token
+  TokenExtra *extra;
+  int atom;         // If kind is TK_IDENT, TK_KEYWORD or TK_PUNCT, its atom
+  int len;          // Token length
   int line_no;      // Line number
   int display_line_no;
   int display_file_no;
+  uint8_t kind;     // Token kind (TokenKind)
   bool at_bol;      // True if this token is at beginning of line
   bool has_space;   // True if this token follows a space character
   bool dont_expand; // True if a macro token is encountered during the macro's expansion
-  Token *origin;    // If this is expanded from a macro, the original token
-  char *guard_file; // The path of a potentially include-guarded file
-  Token *attr_next;
 };
 
 void error(char *fmt, ...) FMTCHK(1,2) NORETURN;
@@ -142,14 +314,28 @@ void verror_at(char *filename, char *input, int line_no, char *loc, char *fmt, v
 bool equal(Token *tok, char *op);
 Token *skip(Token *tok, char *op);
 bool consume(Token **rest, Token *tok, char *str);
+Token *skip_atom(Token *tok, int atom);
+bool consume_atom(Token **rest, Token *tok, int atom);
 File **get_input_files(void);
 File *new_file(char *name, int file_no, char *contents);
 Token *tokenize_string_literal(Token *tok, Type *basety);
 Token *tokenize(File *file, Token **end);
 Token *tokenize_file(char *filename, Token **end);
+Token *tokenize_file_lazy(char *path, Token *next);
+Token *tokenize_lazy(Token *tok);
+Token *skip_cond_lazy(Token *tok, bool endif_only);
+char *read_source_file(char *path);
+FileKey *get_file_key(char *path);
 File *add_input_file(char *path, char *content, bool not_input);
+void reset_input_files(void);
+extern bool reuse_tokens;
+Token *copy_token_list(Token *tok, File *file, Token **end);
+TokenExtra *new_extra(Token *tok);
+bool read_pp_int(Token *tok, int64_t *val, Type **ty);
 void convert_pp_number(Token *tok);
 bool is_keyword(Token *tok);
+int intern(char *name, int len);
+Atom *get_atom(int atom);
 
 #define internal_error() \
   error("internal error at %s:%d", __FILE__, __LINE__)
@@ -162,6 +348,11 @@ char *search_include_paths(char *filename);
 void init_macros(void);
 void define_macro(char *name, char *buf);
 void undef_macro(char *name);
+void save_macros(void);
+void reset_preprocess(void);
+void write_macro_config(FILE *out);
+void write_pch_state(FILE *out);
+void read_pch_state(void);
 Token *preprocess(Token *tok);
 
 //
@@ -351,6 +542,7 @@ struct Scope {
 Node *new_cast(Node *expr, Type *ty);
 int64_t const_expr(Token **rest, Token *tok);
 Obj *parse(Token *tok);
+void reset_parse(void);
 Token *skip_paren(Token *tok);
 //
 // type.c
@@ -460,20 +652,120 @@ Type *copy_type(Type *ty);
 Type *pointer_to(Type *base);
 Type *func_type(Type *return_ty);
 Type *array_of(Type *base, int size);
+Type *string_type(Type *base, int len);
 Type *vla_of(Type *base, Node *expr);
 Type *enum_type(void);
 void add_type(Node *node);
 Type *new_type(TypeKind kind, int size, int align);
 
+//
+// cache.c
+//
+
+void write_compiler_id(FILE *out);
+bool cache_lookup(char *dir, Token *tok, bool is_obj, char *output);
+void cache_store(char *dir, char *output);
+
+//
+// pch.c
+//
+
+void pch_write_int(FILE *out, int64_t val);
+void pch_write_str(FILE *out, char *s, int len);
+int64_t pch_read_int(void);
+char *pch_read_str(void);
+void pch_write_tokens(FILE *out, Token *tok);
+Token *pch_read_tokens(void);
+void begin_pch(int nincludes);
+void write_pch(char *path, Token *tok);
+Token *read_pch(char *header, Token **end);
+
 //
 // codegen.c
 //
 
 void codegen(Obj *prog, FILE *out);
+void reset_codegen(void);
 int align_to(int n, int align);
 
 extern bool dont_reuse_stack;
 
+//
+// elf.c
+//
+
+bool emit_elf_object(char *text, FILE *out);
+
+//
+// report.c
+//
+
+typedef enum {
+  PHASE_OTHER,
+  PHASE_TOKENIZE,
+  PHASE_PREPROCESS,
+  PHASE_PREPROCESS3,
+  PHASE_PARSE,
+  PHASE_CODEGEN,
+  PHASE_ASSEMBLE,
+  PHASE_WAIT,
+  NUM_PHASES,
+} Phase;
+
+typedef enum {
+  REPORT_NONE,
+  REPORT_TEXT,
+  REPORT_JSON,
+} ReportFormat;
+
+typedef struct {
+  int64_t source_bytes;
+  int64_t skipped_bytes;
+  int64_t include_lookups;
+  int64_t dirs_read;
+  int64_t includes_skipped;
+  int64_t reads_avoided;
+  int64_t tokens;
+  int64_t nodes;
+  int64_t asm_bytes;
+  int64_t subprocesses;
+} Stats;
+
+typedef enum {
+  MEM_TOKEN,
+  MEM_TOKEN_EXTRA,
+  MEM_NODE,
+  MEM_TYPE,
+  MEM_OBJ,
+  MEM_SCOPE,
+  MEM_HASHMAP,
+  MEM_STRING,
+  MEM_FILE,
+  NUM_MEM,
+} MemKind;
+
+extern ReportFormat opt_time_report;
+extern ReportFormat opt_mem_report;
+extern Stats stats;
+
+void init_time_report(void);
+void phase_start(Phase phase);
+void phase_end(void);
+void print_time_report(char *name);
+void count_alloc(MemKind kind, size_t size);
+void print_mem_report(char *name);
+
+//
+// server.c
+//
+
+void run_server(char *path) NORETURN;
+void run_client(int argc, char **argv);
+Token *server_cached_tokens(char *path, Token **end);
+void server_report_file(char *path);
+bool server_cached_include(char *filename, int *idx);
+void server_report_include(char *filename, int idx);
+
 //
 // unicode.c
 //
@@ -497,6 +789,7 @@ typedef enum {
 } StdVer;
 
 bool file_exists(char *path);
+int run_driver(int argc, char **argv);
 
 extern StringArray include_paths;
 extern bool opt_E;
@@ -506,5 +799,7 @@ extern bool opt_g;
 extern bool opt_func_sections;
 extern bool opt_data_sections;
 extern bool opt_cc1_asm_pp;
+extern bool opt_cc1_pch;
+extern bool opt_H;
 extern char *base_file;
 extern StdVer opt_std;